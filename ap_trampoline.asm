@@ -1,6 +1,8 @@
 extern ap_entry64
 extern LAPIC_addr
+extern x2APIC_enabled
 extern ap_stacks
+extern CPU_count
 global init_tramp
 global ap_tramp32
 global ap_tramp64
@@ -46,8 +48,8 @@ check_A20_ap:
 	call ip0
 ip0:
 	pop bx ; Get IP
-	mov bp,[bx+ACTIVE_CPU_CNT-ip0] ; save CPU number
-	lock inc dword [bx+ACTIVE_CPU_CNT-ip0] ; Increase active CPU counter
+	mov ebp,1
+	lock xadd [bx+ACTIVE_CPU_CNT-ip0],ebp ; Take a CPU number and increase the active CPU counter in one step
 	db 0xEA ; jmp 0:start
 JMP_START_PTR:
 	dw 0 ; offset
@@ -111,11 +113,28 @@ ap_tramp64:
 	mov fs,ax
 	mov gs,ax
 	; ENABLE LAPIC
+	cmp byte [x2APIC_enabled],0
+	je xapic
+	mov ecx,0x1B ; IA32_APIC_BASE
+	rdmsr
+	or eax,0x800 ; Enable the xAPIC first, going from disabled to x2APIC directly is invalid
+	wrmsr
+	or eax,0x400 ; Switch to x2APIC mode like the BSP
+	wrmsr
+	mov ecx,0x80F ; x2APIC spurious interrupt register
+	mov eax,0x1FF
+	xor edx,edx
+	wrmsr
+	jmp lapic_enabled
+xapic:
 	mov rdi,[LAPIC_addr]
 	mov [rdi+0xF0],dword 0x1FF
+lapic_enabled:
+	; ap_stacks has a page for CPU numbers below CPU_count, a retried start may have taken a larger one
+	cmp ebp,[CPU_count]
+	jae park
 	; SETUP STACK
-	mov ebx,ebp   ; get CPU number (n-th activated)
-	and ebx,0xFF
+	mov ebx,ebp   ; get CPU number (n-th activated), all 32 bits
 	mov rcx,rbx
 	shl rbx,12
 	add rbx,[ap_stacks]
@@ -125,6 +144,10 @@ ap_tramp64:
 sleep:
 	hlt
 	jmp sleep
+park:
+	cli
+	hlt
+	jmp park
 
 
 ; Taken from the Pure64 bootloader by ReturnInfinity
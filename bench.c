@@ -0,0 +1,161 @@
+#include "vmx_api.h"
+#include "vmx_emu.h"
+#include "regs.h"
+#include "smp.h"
+#include "hv_handlers.h"
+#include "hypercall.h"
+#include "xstate.h"
+#include "bench.h"
+
+/*
+
+Micro benchmarks executed in guest mode on the BSP. The guest is the same image as the
+hypervisor, so it can flip hypervisor settings in the HVM directly to compare both paths.
+
+*/
+
+uint64_t bench_cpuid_exit(uint32_t leaf){
+  uint64_t rax, rbx, rcx, rdx;
+  uint64_t start, end;
+  uint32_t i;
+
+  start = get_tsc();
+  for(i = 0; i < BENCH_ITERATIONS; ++i){
+    rax = leaf;
+    rcx = 0;
+    emu_cpuid(&rax, &rbx, &rcx, &rdx);
+  }
+  end = get_tsc();
+
+  return (end - start) / BENCH_ITERATIONS;
+}
+
+uint64_t bench_vmcall_exit(void){
+  uint64_t start, end;
+  uint32_t i;
+
+  start = get_tsc();
+  for(i = 0; i < BENCH_ITERATIONS; ++i){
+    vmx_vmcall(VMCALL_PING);
+  }
+  end = get_tsc();
+
+  return (end - start) / BENCH_ITERATIONS;
+}
+
+// Average cycles of a CPUID/VMCALL exit round trip with and without the vmx_exit fast path
+void bench_exit_roundtrip(HVM * hvm){
+  uint64_t cpuid_slow, cpuid_fast, vmcall_slow, vmcall_fast;
+  bool fast_exit_enabled = hvm->fast_exit_enabled;
+
+  hvm->fast_exit_enabled = false;
+  cpuid_slow = bench_cpuid_exit(0);
+  vmcall_slow = bench_vmcall_exit();
+
+  hvm->fast_exit_enabled = true;
+  cpuid_fast = bench_cpuid_exit(0);
+  vmcall_fast = bench_vmcall_exit();
+
+  hvm->fast_exit_enabled = fast_exit_enabled;
+
+  bsp_printf("Exit round trip (cycles, %u iterations):\r\n", (uint64_t)BENCH_ITERATIONS);
+  bsp_printf("  CPUID:  %u full path, %u fast path\r\n", cpuid_slow, cpuid_fast);
+  bsp_printf("  VMCALL: %u full path, %u fast path\r\n", vmcall_slow, vmcall_fast);
+}
+
+uint8_t bench_tlb_buffer[BENCH_TLB_PAGES * 4096] __attribute__ ((aligned(4096)));
+
+// Cycles to touch one byte on each page of bench_tlb_buffer
+uint64_t bench_tlb_touch(void){
+  volatile uint8_t * page = bench_tlb_buffer;
+  uint64_t start, end;
+  uint32_t i;
+
+  start = get_tsc();
+  for(i = 0; i < BENCH_TLB_PAGES; ++i){
+    (void)page[i * 4096];
+  }
+  end = get_tsc();
+
+  return end - start;
+}
+
+// Guest TLB refill cost after a VM exit. Without VPID every exit flushes the guest TLB, so the
+// pages touched right after a CPUID exit miss again. Build with VPID_ENABLED 0 for the baseline.
+// The number of TLB entries involved depends on the page size the firmware maps the buffer with.
+void bench_tlb_refill(HVM * hvm){
+  uint64_t rax, rbx, rcx, rdx;
+  uint64_t warm = 0, after_exit = 0;
+  uint32_t i;
+
+  bench_tlb_touch(); // Fault in and cache the translations
+
+  for(i = 0; i < BENCH_ITERATIONS; ++i){
+    warm += bench_tlb_touch();
+
+    rax = 0;
+    rcx = 0;
+    emu_cpuid(&rax, &rbx, &rcx, &rdx);
+    after_exit += bench_tlb_touch();
+  }
+
+  bsp_printf("TLB refill (cycles per %u page touches, VPID %u):\r\n", (uint64_t)BENCH_TLB_PAGES, (uint64_t)hvm->vpid);
+  bsp_printf("  warm: %u, after VM exit: %u\r\n", warm / BENCH_ITERATIONS, after_exit / BENCH_ITERATIONS);
+}
+
+// Cycles of an outermost xstate_begin()/xstate_end() pair, 0 if the section can't be entered
+uint64_t bench_xstate_section(HVM * hvm, uint64_t components){
+  uint64_t start, end;
+  uint32_t i;
+
+  start = get_tsc();
+  for(i = 0; i < BENCH_ITERATIONS; ++i){
+    if(!xstate_begin(hvm, components)){
+      return 0;
+    }
+    xstate_end(hvm);
+  }
+  end = get_tsc();
+
+  return (end - start) / BENCH_ITERATIONS;
+}
+
+// Cost of saving and restoring the guest's vector state around root mode vector code. Only
+// components the guest enabled are asked for, widening XCR0 from here would exit on XSETBV.
+// The XINUSE shortcut and XSAVEOPT are switched off in turn; the sections aren't counted.
+void bench_xstate(HVM * hvm){
+  XSTATE * xstate = hvm->xstate;
+  uint64_t components = hvm->guest_XCR0 & (XSTATE_SSE | XSTATE_AVX | XSTATE_AVX512);
+  uint64_t found, xsaveopt = 0, xsave;
+  uint64_t sections, skipped, widened, cycles;
+  bool xinuse_enabled, xsaveopt_enabled;
+
+  if(!xstate || !(get_cr4() & X86_CR4_OSXSAVE)){
+    bsp_printf("XSAVE section: no XSAVE\r\n");
+    return;
+  }
+  sections = xstate->sections;
+  skipped = xstate->skipped;
+  widened = xstate->widened;
+  cycles = xstate->cycles;
+  xinuse_enabled = xstate->xinuse;
+  xsaveopt_enabled = xstate->xsaveopt;
+
+  found = bench_xstate_section(hvm, components);
+  xstate->xinuse = false;
+  if(xsaveopt_enabled){
+    xsaveopt = bench_xstate_section(hvm, components);
+  }
+  xstate->xsaveopt = false;
+  xsave = bench_xstate_section(hvm, components);
+
+  xstate->xinuse = xinuse_enabled;
+  xstate->xsaveopt = xsaveopt_enabled;
+  xstate->sections = sections;
+  xstate->skipped = skipped;
+  xstate->widened = widened;
+  xstate->cycles = cycles;
+
+  bsp_printf("XSAVE section (cycles, %u iterations, XCR0 %x):\r\n", (uint64_t)BENCH_ITERATIONS, hvm->guest_XCR0);
+  bsp_printf("  state as found: %u, XSAVEOPT: %u, XSAVE: %u\r\n", found, xsaveopt, xsave);
+}
@@ -0,0 +1,16 @@
+#ifndef _BENCH_
+#define _BENCH_
+
+#include <stdint.h>
+#include "vmx_api.h"
+
+#define BENCH_ENABLED 0 // run the micro benchmarks from the guest right after VMLAUNCH
+#define BENCH_ITERATIONS 10000
+
+#define BENCH_TLB_PAGES 64
+
+void bench_exit_roundtrip(HVM * hvm);
+void bench_tlb_refill(HVM * hvm);
+void bench_xstate(HVM * hvm);
+
+#endif
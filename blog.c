@@ -0,0 +1,168 @@
+#include "lib_uefi.h"
+#include "regs.h"
+#include "string.h"
+#include "smp.h"
+#include "tsc.h"
+#include "logring.h"
+#include "vm_setup.h"
+#include "hypercall.h"
+#include "blog.h"
+
+/*
+
+Binary structured log
+
+A BLOG() call site costs a TSC read and a copy of its arguments into the CPU's binary ring, no
+formatting happens in the hypervisor. The format table is the .blogfmt section: the linker sorts
+.blogfmt$a (the marker below) before the .blogfmt$m entries of all call sites, so the offset of
+an entry from the marker identifies it in every build of the same image.
+
+The binary rings are never drained while running, they keep the most recent records. blog_save()
+writes all of them to BLOG_DUMP_FILE at boot, later the guest copies them out with
+VMCALL_BLOG_DUMP, in the same format. Turning either dump back into text:
+
+  make blog
+  tools/blogdec blogfmt.bin blog.bin
+
+*/
+
+const uint64_t blog_table_start __attribute__((section(".blogfmt$a"), aligned(8))) = BLOG_TABLE_MAGIC;
+
+void blog_write(HVM * hvm, const BLOG_FORMAT * format, const uint64_t * args){
+  uint64_t buf[sizeof(BLOG_RECORD) / 8 + BLOG_MAX_ARGS];
+  BLOG_RECORD * rec = (BLOG_RECORD*)buf;
+  uint32_t nargs = format->nargs < BLOG_MAX_ARGS ? format->nargs : BLOG_MAX_ARGS;
+  int cpu;
+
+  if(!hvm){
+    cpu = cpu_hvm ? smp_cpu_index(get_apic_id()) : -1;
+    if(cpu < 0){
+      return;
+    }
+    hvm = cpu_hvm[cpu];
+  }
+  if(!hvm || !hvm->blog_ring){
+    return;
+  }
+
+  rec->id = (uint8_t*)format - (uint8_t*)&blog_table_start;
+  rec->nargs = nargs;
+  rec->tsc = get_tsc();
+  if(nargs){
+    CopyMem(rec->args, (void*)args, nargs * 8);
+  }
+
+  logring_write(hvm->blog_ring, LOGRING_BINARY, rec, sizeof(BLOG_RECORD) + nargs * 8);
+}
+
+void blog_dump_header(int cpu, BLOG_DUMP_HEADER * hdr){
+  LOGRING * ring = cpu_hvm[cpu]->blog_ring;
+
+  hdr->magic = BLOG_DUMP_MAGIC;
+  hdr->cpu = cpu;
+  hdr->apic_id = Proc_x2APIC_IDs[cpu];
+  hdr->size = ring->size;
+  hdr->head = ring->head;
+  hdr->tail = ring->tail;
+  hdr->records = ring->records;
+  hdr->drops = ring->drops;
+  hdr->tsc_khz = tsc_khz;
+}
+
+/*
+  The other CPUs keep logging while their rings are copied, so the oldest records of a busy CPU
+  may be overwritten halfway. The decoder checks every record and stops at the first bad one.
+*/
+EFI_STATUS blog_save(EFI_HANDLE device){
+  EFI_FILE_HANDLE root, file;
+  BLOG_DUMP_HEADER hdr;
+  EFI_STATUS st;
+  LOGRING * ring;
+  UINTN size;
+  uint32_t saved = 0;
+  int cpu;
+
+  root = LibOpenRoot(device);
+  if(!root){
+    return EFI_NOT_FOUND;
+  }
+
+  // Open() doesn't truncate, remove an older and possibly longer dump first
+  if(root->Open(root, &file, BLOG_DUMP_FILE, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0) == EFI_SUCCESS){
+    file->Delete(file);
+  }
+  st = root->Open(root, &file, BLOG_DUMP_FILE, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+  if(st != EFI_SUCCESS){
+    root->Close(root);
+    return st;
+  }
+
+  for(cpu = 0; cpu < CPU_count && st == EFI_SUCCESS; ++cpu){
+    if(!cpu_hvm[cpu] || !cpu_hvm[cpu]->blog_ring) continue;
+    ring = cpu_hvm[cpu]->blog_ring;
+    blog_dump_header(cpu, &hdr);
+
+    size = sizeof(hdr);
+    st = file->Write(file, &size, &hdr);
+    if(st == EFI_SUCCESS){
+      size = ring->size;
+      st = file->Write(file, &size, ring->data);
+    }
+    if(st == EFI_SUCCESS){
+      ++saved;
+    }
+  }
+
+  file->Close(file);
+  root->Close(root);
+
+  printf("Binary log: %u CPUs saved\r\n", (uint64_t)saved);
+  return st;
+}
+
+uint64_t blog_dump_size(void){
+  uint64_t size = 0;
+  int cpu;
+
+  for(cpu = 0; cpu < CPU_count; ++cpu){
+    if(!cpu_hvm[cpu] || !cpu_hvm[cpu]->blog_ring) continue;
+    size += sizeof(BLOG_DUMP_HEADER) + cpu_hvm[cpu]->blog_ring->size;
+  }
+
+  return size;
+}
+
+// The BLOG_DUMP_FILE format, copied while the CPUs keep logging like in blog_save()
+uint64_t hc_blog_dump(GUEST_REGS * regs){
+  uint64_t addr = regs->rcx;
+  uint64_t size = blog_dump_size();
+  uint8_t * out = (uint8_t*)addr;
+  LOGRING * ring;
+  int cpu;
+
+  regs->rcx = size;
+  if(regs->rdx < size){
+    return HC_ERR_BUFFER_TOO_SMALL;
+  }
+  if(!ept_guest_writable(regs->hvm, addr, size)){
+    return HC_ERR_ACCESS;
+  }
+
+  for(cpu = 0; cpu < CPU_count; ++cpu){
+    if(!cpu_hvm[cpu] || !cpu_hvm[cpu]->blog_ring) continue;
+    ring = cpu_hvm[cpu]->blog_ring;
+
+    blog_dump_header(cpu, (BLOG_DUMP_HEADER*)out);
+    out += sizeof(BLOG_DUMP_HEADER);
+    CopyMem(out, ring->data, ring->size);
+    out += ring->size;
+  }
+  ept_guest_written(addr, size);
+
+  return HC_SUCCESS;
+}
+
+// After hypercall_init()
+void blog_init(void){
+  register_hypercall(VMCALL_BLOG_DUMP, hc_blog_dump, HC_KERNEL, "blog_dump");
+}
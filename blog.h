@@ -0,0 +1,89 @@
+#ifndef _BLOG_
+#define _BLOG_
+
+#include <efi.h>
+#include <efilib.h>
+#include <stdint.h>
+#include "vmx_api.h"
+
+/*
+  Binary log: BLOG()/BLOG_HVM() store a format ID, the TSC and up to BLOG_MAX_ARGS raw 64-bit
+  arguments in the CPU's binary ring. The format strings stay in the .blogfmt section of the image
+  and are turned back into text by tools/blogdec. Only %u, %x, %b and %c make sense as arguments.
+
+  Records above BLOG_LEVEL or outside BLOG_CATEGORIES are compiled out, the condition is constant;
+  only their few bytes in the format table remain.
+*/
+
+// Levels
+#define BLOG_ERROR 1
+#define BLOG_WARN 2
+#define BLOG_INFO 3
+#define BLOG_DEBUG 4
+
+// Categories
+#define BLOG_CAT_EXIT 0x01 // VM exit dispatch
+#define BLOG_CAT_SMP 0x02  // AP start-up and SIPI handling
+#define BLOG_CAT_EPT 0x04
+#define BLOG_CAT_INVAL 0x08
+#define BLOG_CAT_CPUID 0x10
+
+#define BLOG_LEVEL BLOG_DEBUG
+#define BLOG_CATEGORIES (BLOG_CAT_SMP | BLOG_CAT_EPT | BLOG_CAT_INVAL)
+
+#define BLOG_MAX_ARGS 8
+#define BLOG_RING_PAGES 4 // per CPU, header included
+#define BLOG_DUMP_MAGIC 0x504D5544474F4C42ULL // "BLOGDUMP"
+#define BLOG_TABLE_MAGIC 0x00544D46474F4C42ULL // "BLOGFMT", first entry of .blogfmt
+#define BLOG_DUMP_FILE L"\\EFI\\BlueGuard\\blog.bin"
+
+// Entry of the format table, the record ID is its offset from the start of .blogfmt
+typedef struct{
+  uint16_t level;
+  uint16_t category;
+  uint16_t nargs;
+  uint16_t line;
+  char fmt[];
+} BLOG_FORMAT;
+
+// Payload of a LOGRING_BINARY record
+typedef struct{
+  uint32_t id;
+  uint32_t nargs;
+  uint64_t tsc;
+  uint64_t args[];
+} BLOG_RECORD;
+
+// Per CPU in the dump file and in VMCALL_BLOG_DUMP output, followed by size bytes of ring data
+typedef struct{
+  uint64_t magic;
+  uint32_t cpu;
+  uint32_t apic_id;
+  uint64_t size;
+  uint64_t head;
+  uint64_t tail;
+  uint64_t records;
+  uint64_t drops;
+  uint64_t tsc_khz;
+} BLOG_DUMP_HEADER;
+
+#define BLOG_ON(level, cat) ((level) <= BLOG_LEVEL && ((cat) & BLOG_CATEGORIES))
+
+#define BLOG_HVM(hvm, level, cat, format, ...) do{ \
+  if(BLOG_ON(level, cat)){ \
+    static const BLOG_FORMAT blog_format __attribute__((section(".blogfmt$m"), aligned(8))) = \
+      {level, cat, sizeof((uint64_t[]){0, ##__VA_ARGS__}) / 8 - 1, __LINE__, format}; \
+    const uint64_t blog_args[] = {0, ##__VA_ARGS__}; \
+    _Static_assert(sizeof(blog_args) / 8 - 1 <= BLOG_MAX_ARGS, "too many BLOG() arguments"); \
+    blog_write(hvm, &blog_format, blog_args + 1); \
+  } \
+} while(0)
+
+// Looks up the CPU by APIC ID, use BLOG_HVM() where the HVM is at hand
+#define BLOG(level, cat, format, ...) BLOG_HVM(NULL, level, cat, format, ##__VA_ARGS__)
+
+void blog_init(void);
+void blog_write(HVM * hvm, const BLOG_FORMAT * format, const uint64_t * args);
+EFI_STATUS blog_save(EFI_HANDLE device);
+
+#endif
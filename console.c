@@ -0,0 +1,255 @@
+#include "lib_uefi.h"
+#include "regs.h"
+#include "string.h"
+#include "spinlock.h"
+#include "tsc.h"
+#include "console.h"
+
+/*
+
+Buffered console
+
+printf() and bsp_printf() end up in console_write(), which appends to one buffer shared by all
+CPUs. The buffer goes out to the selected backends once CONSOLE_FLUSH_BYTES are waiting or the
+oldest byte is CONSOLE_FLUSH_US old; console_poll() checks the age on every VM exit so a lone
+message doesn't sit in the buffer until the next one arrives.
+
+ConOut needs boot services and is only used until ExitBootServices(). While it is active every
+write is flushed right away, so printf() output stays in order with the direct print() calls.
+The UART and the debug port are plain port I/O and keep working in VMX root afterwards.
+
+*/
+
+#define UART_THR 0 // transmit holding register
+#define UART_IER 1
+#define UART_FCR 2
+#define UART_LCR 3
+#define UART_MCR 4
+#define UART_LSR 5
+#define UART_SCR 7
+#define UART_DLL 0 // divisor latch, with LCR_DLAB set
+#define UART_DLM 1
+
+#define LCR_8N1 0x03
+#define LCR_DLAB 0x80
+#define FCR_ENABLE_CLEAR 0x07
+#define MCR_DTR_RTS 0x03
+#define LSR_THRE 0x20
+#define UART_FIFO_SIZE 16
+
+#define E9_PORT 0xE9
+
+EFI_GUID console_variable_guid = CONSOLE_VARIABLE_GUID;
+EFI_EVENT console_exit_event;
+
+volatile uint32_t console_backends = CONSOLE_CONOUT;
+uint16_t console_uart_port = CONSOLE_UART_PORT;
+
+char console_buffer[CONSOLE_BUFFER_SIZE];
+volatile uint32_t console_fill;
+uint64_t console_first_tsc; // when the oldest buffered byte was written
+
+CONSOLE_STATS console_stats;
+LOCK_STATS console_lock_stats = {"console"};
+ticket_lock_t console_lock = {0, 0, &console_lock_stats};
+
+// Scratch register round trip, the port reads 0xFF if there is no UART
+bool uart_init(uint16_t port){
+  io_out8(port + UART_SCR, 0x5A);
+  if(io_in8(port + UART_SCR) != 0x5A){
+    return false;
+  }
+
+  io_out8(port + UART_IER, 0); // polled
+  io_out8(port + UART_LCR, LCR_DLAB);
+  io_out8(port + UART_DLL, CONSOLE_UART_DIVISOR & 0xFF);
+  io_out8(port + UART_DLM, CONSOLE_UART_DIVISOR >> 8);
+  io_out8(port + UART_LCR, LCR_8N1);
+  io_out8(port + UART_FCR, FCR_ENABLE_CLEAR);
+  io_out8(port + UART_MCR, MCR_DTR_RTS);
+
+  return true;
+}
+
+// A UART that stops draining its FIFO is given up on instead of stalling every flush
+void uart_write(const char * str, uint32_t len){
+  uint32_t polls, i;
+
+  while(len){
+    for(polls = 0; !(io_in8(console_uart_port + UART_LSR) & LSR_THRE); ++polls){
+      if(polls == CONSOLE_UART_TIMEOUT){
+        ++console_stats.uart_timeouts;
+        console_backends &= ~CONSOLE_UART;
+        return;
+      }
+    }
+
+    // An empty transmit holding register means an empty FIFO
+    for(i = 0; i < UART_FIFO_SIZE && len; ++i, --len){
+      io_out8(console_uart_port + UART_THR, *str++);
+    }
+  }
+}
+
+void conout_write(const char * str, uint32_t len){
+  CHAR16 wstr[128];
+  uint32_t chunk;
+
+  while(len){
+    chunk = len < 127 ? len : 127;
+    str2wstr(wstr, (char*)str, chunk);
+    wstr[chunk] = 0;
+    print(wstr);
+    str += chunk;
+    len -= chunk;
+  }
+}
+
+void console_output(const char * str, uint32_t len){
+  uint32_t backends = console_backends;
+  uint32_t i;
+
+  if(backends & CONSOLE_CONOUT){
+    conout_write(str, len);
+  }
+  if(backends & CONSOLE_UART){
+    uart_write(str, len);
+  }
+  if(backends & CONSOLE_E9){
+    for(i = 0; i < len; ++i){
+      io_out8(E9_PORT, str[i]);
+    }
+  }
+}
+
+// With console_lock held
+void console_flush_locked(void){
+  if(console_fill){
+    console_output(console_buffer, console_fill);
+    console_fill = 0;
+    ++console_stats.flushes;
+  }
+}
+
+void console_write(const char * str, uint32_t len){
+  uint64_t now;
+
+  if(!len){
+    return;
+  }
+
+  ticket_lock(&console_lock);
+  console_stats.bytes += len;
+  now = get_tsc();
+
+  if(console_fill + len > CONSOLE_BUFFER_SIZE){
+    console_flush_locked();
+  }
+  if(len > CONSOLE_BUFFER_SIZE){
+    ++console_stats.unbuffered;
+    console_output(str, len);
+  }
+  else{
+    if(!console_fill){
+      console_first_tsc = now;
+    }
+    CopyMem(console_buffer + console_fill, (void*)str, len);
+    console_fill += len;
+  }
+
+  if((console_backends & CONSOLE_CONOUT) || console_fill >= CONSOLE_FLUSH_BYTES ||
+     tsc_to_us(now - console_first_tsc) >= CONSOLE_FLUSH_US){
+    console_flush_locked();
+  }
+  ticket_unlock(&console_lock);
+}
+
+void console_flush(void){
+  ticket_lock(&console_lock);
+  console_flush_locked();
+  ticket_unlock(&console_lock);
+}
+
+// Cheap unless something has been waiting for CONSOLE_FLUSH_US, another CPU may be flushing already.
+// Until ExitBootServices() every write is flushed and only the BSP may touch ConOut.
+void console_poll(void){
+  if(!console_shared() || !console_fill || tsc_to_us(get_tsc() - console_first_tsc) < CONSOLE_FLUSH_US){
+    return;
+  }
+  if(ticket_trylock(&console_lock)){
+    console_flush_locked();
+    ticket_unlock(&console_lock);
+  }
+}
+
+// True once every CPU may write to the console itself, before that only the BSP may call ConOut
+bool console_shared(void){
+  return !(console_backends & CONSOLE_CONOUT);
+}
+
+VOID console_exit_boot_services(IN EFI_EVENT event, IN VOID * context){
+  // Whatever is buffered goes out on the port backends with the next flush
+  console_backends &= ~CONSOLE_CONOUT;
+}
+
+// "conout", "uart", "uart=<port>" and "e9", separated by commas
+uint32_t console_parse(const char * str, uint32_t len, uint16_t * port){
+  uint32_t backends = 0;
+  uint32_t pos = 0, end, value;
+
+  while(pos < len && str[pos]){
+    for(end = pos; end < len && str[end] && str[end] != ','; ++end);
+
+    if(end - pos == 6 && !strncmp((void*)(str + pos), "conout", 6)){
+      backends |= CONSOLE_CONOUT;
+    }
+    else if(end - pos == 2 && !strncmp((void*)(str + pos), "e9", 2)){
+      backends |= CONSOLE_E9;
+    }
+    else if(end - pos >= 4 && !strncmp((void*)(str + pos), "uart", 4)){
+      backends |= CONSOLE_UART;
+      if(end - pos > 7 && str[pos + 4] == '=' && str[pos + 5] == '0' && (str[pos + 6] | 0x20) == 'x'){
+        for(value = 0, pos += 7; pos < end; ++pos){
+          value = value * 16 + (str[pos] <= '9' ? str[pos] - '0' : (str[pos] | 0x20) - 'a' + 10);
+        }
+        *port = value;
+      }
+    }
+
+    pos = end + 1;
+  }
+
+  return backends;
+}
+
+void console_init(void){
+  char option[64];
+  UINTN size = sizeof(option);
+  uint32_t backends = CONSOLE_DEFAULT;
+  uint16_t port = CONSOLE_UART_PORT;
+
+  if(RT->GetVariable(CONSOLE_VARIABLE, &console_variable_guid, NULL, &size, option) == EFI_SUCCESS){
+    backends = console_parse(option, size, &port);
+  }
+
+  if((backends & CONSOLE_UART) && !uart_init(port)){
+    backends &= ~CONSOLE_UART;
+  }
+  console_uart_port = port;
+
+  if(BS->CreateEvent(EVT_SIGNAL_EXIT_BOOT_SERVICES, TPL_NOTIFY, console_exit_boot_services, NULL,
+     &console_exit_event) != EFI_SUCCESS){
+    backends &= ~CONSOLE_CONOUT; // Nothing would turn it off in time
+  }
+
+  console_backends = backends;
+  lock_stats_register(&console_lock_stats);
+}
+
+void console_report(void){
+  printf("Console:%s%s%s, %u bytes in %u flushes, %u unbuffered, %u UART timeouts\r\n",
+    console_backends & CONSOLE_CONOUT ? " ConOut" : "",
+    console_backends & CONSOLE_UART ? " UART" : "",
+    console_backends & CONSOLE_E9 ? " port E9" : "",
+    console_stats.bytes, console_stats.flushes, console_stats.unbuffered, console_stats.uart_timeouts);
+}
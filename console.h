@@ -0,0 +1,42 @@
+#ifndef _CONSOLE_
+#define _CONSOLE_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Backends, any combination
+#define CONSOLE_CONOUT 0x1 // UEFI ConOut, dropped at ExitBootServices()
+#define CONSOLE_UART 0x2   // 16550 UART, disabled if nothing answers at the port
+#define CONSOLE_E9 0x4     // Bochs/QEMU debug port 0xE9
+#define CONSOLE_DEFAULT (CONSOLE_CONOUT | CONSOLE_UART)
+
+#define CONSOLE_UART_PORT 0x3F8 // COM1
+#define CONSOLE_UART_DIVISOR 1  // 115200 baud
+#define CONSOLE_UART_TIMEOUT 100000 // status polls before giving up on a byte
+
+#define CONSOLE_BUFFER_SIZE 4096
+#define CONSOLE_FLUSH_BYTES 2048 // flush once this much is buffered
+#define CONSOLE_FLUSH_US 10000   // or when the oldest buffered byte is this old
+
+/*
+  Backend selection at boot: the ASCII variable BlueGuardConsole, e.g. "uart", "uart=0x2F8,conout"
+  or "e9". Set it from the UEFI shell with setvar BlueGuardConsole -guid <CONSOLE_VARIABLE_GUID>.
+*/
+#define CONSOLE_VARIABLE L"BlueGuardConsole"
+#define CONSOLE_VARIABLE_GUID {0x3c1b8e5a, 0x7d2f, 0x4b61, {0x9a, 0x0e, 0x52, 0xc4, 0x1f, 0x8d, 0x6b, 0x37}}
+
+typedef struct{
+  uint64_t bytes;
+  uint64_t flushes;
+  uint64_t uart_timeouts;
+  uint64_t unbuffered; // writes larger than the buffer
+} CONSOLE_STATS;
+
+void console_init(void);
+void console_write(const char * str, uint32_t len);
+void console_flush(void);
+void console_poll(void);
+bool console_shared(void);
+void console_report(void);
+
+#endif
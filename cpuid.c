@@ -0,0 +1,222 @@
+#include "lib_uefi.h"
+#include "vmx_api.h"
+#include "vmx_emu.h"
+#include "regs.h"
+#include "vmcs_cache.h"
+#include "cpuid.h"
+
+/*
+
+CPUID virtualization
+
+Every CPU snapshots its CPUID leaves once in vmcs_init() and the policy below is applied to the
+snapshot. Exits are answered from the table: leaves without subleaves by the vmx_exit fast path,
+leaves 4, 7, 0xB, 0xD and the hypervisor leaves by handle_cpuid(). Only leaves outside of the
+table still execute the physical CPUID.
+
+Guest dependent bits are patched in on every lookup instead of being snapshotted:
+CPUID.01H:ECX.OSXSAVE follows guest CR4.OSXSAVE, the APIC IDs in CPUID.01H:EBX[31:24] and
+CPUID.0BH:EDX come from the owning CPU and CPUID.0DH.0:EBX follows the guest XCR0.
+
+*/
+
+CPUID_POLICY cpuid_policy = {
+  .leaf1_ecx_clear = CPUID_01_ECX_VMX, // VMX instructions are not virtualized
+  .hypervisor_present = true,
+  .vendor = "BlueGuard HV"
+};
+
+// Leaves with subleaves (ECX input) can't be answered by a single table entry
+#define CPUID_SUBLEAF_LEAVES ( \
+  1ULL << 0x4 | 1ULL << 0x7 | 1ULL << 0xB | 1ULL << 0xD | 1ULL << 0xF | 1ULL << 0x10 | \
+  1ULL << 0x12 | 1ULL << 0x14 | 1ULL << 0x17 | 1ULL << 0x18 | 1ULL << 0x1B | 1ULL << 0x1D | \
+  1ULL << 0x1F | 1ULL << 0x20)
+
+void cpuid_read(uint32_t leaf, uint32_t subleaf, CPUID_LEAF * out){
+  uint64_t rax = leaf, rbx = 0, rcx = subleaf, rdx = 0;
+
+  emu_cpuid(&rax, &rbx, &rcx, &rdx);
+  out->eax = rax;
+  out->ebx = rbx;
+  out->ecx = rcx;
+  out->edx = rdx;
+}
+
+void cpuid_apply_policy(CPUID_TABLE * table){
+  CPUID_POLICY * policy = &cpuid_policy;
+  uint32_t * vendor = (uint32_t*)policy->vendor;
+
+  table->basic[1].ecx &= ~policy->leaf1_ecx_clear;
+  table->basic[1].edx &= ~policy->leaf1_edx_clear;
+  table->leaf7[0].ebx &= ~policy->leaf7_ebx_clear;
+  table->leaf7[0].ecx &= ~policy->leaf7_ecx_clear;
+  table->leaf7[0].edx &= ~policy->leaf7_edx_clear;
+  table->ext[1].ecx &= ~policy->ext1_ecx_clear;
+  table->ext[1].edx &= ~policy->ext1_edx_clear;
+
+  if(policy->hypervisor_present){
+    table->basic[1].ecx |= CPUID_01_ECX_HYPERVISOR;
+
+    table->hv[0].eax = CPUID_HV_BASE + CPUID_HV_LEAVES - 1;
+    table->hv[0].ebx = vendor[0];
+    table->hv[0].ecx = vendor[1];
+    table->hv[0].edx = vendor[2];
+    // CPUID.40000001H:EAX = 0 - not a Hyper-V compatible interface
+  }
+  else{
+    table->basic[1].ecx &= ~CPUID_01_ECX_HYPERVISOR;
+  }
+}
+
+// Snapshot the leaves of the current CPU, must run on the CPU owning hvm
+void cpuid_init(HVM * hvm){
+  CPUID_TABLE * table = hvm->cpuid_table;
+  uint32_t i;
+
+  ZeroMem(table, sizeof(CPUID_TABLE));
+
+  cpuid_read(0, 0, &table->basic[0]);
+  table->max_basic = table->basic[0].eax;
+  for(i = 1; i <= table->max_basic && i < CPUID_FAST_LEAVES; ++i){
+    cpuid_read(i, 0, &table->basic[i]);
+  }
+  table->basic_mask = (i == CPUID_FAST_LEAVES ? ~0ULL : (1ULL << i) - 1);
+  table->basic_mask &= ~CPUID_SUBLEAF_LEAVES;
+
+  cpuid_read(CPUID_EXT_BASE, 0, &table->ext[0]);
+  if(table->ext[0].eax >= CPUID_EXT_BASE){
+    table->max_ext = table->ext[0].eax;
+    for(i = 1; i <= table->max_ext - CPUID_EXT_BASE && i < CPUID_FAST_LEAVES; ++i){
+      cpuid_read(CPUID_EXT_BASE + i, 0, &table->ext[i]);
+    }
+    table->ext_mask = (i == CPUID_FAST_LEAVES ? ~0ULL : (1ULL << i) - 1);
+  }
+  else{
+    table->max_ext = 0; // No extended leaves
+  }
+
+  table->apic_id = table->basic[1].ebx >> 24;
+
+  if(table->max_basic >= 0x4){ // Deterministic cache parameters, until cache type 0
+    for(i = 0; i < CPUID_LEAF4_SUBLEAVES; ++i){
+      cpuid_read(0x4, i, &table->leaf4[i]);
+      if(!(table->leaf4[i].eax & 0x1F)) break;
+    }
+    table->leaf4_count = i;
+  }
+
+  if(table->max_basic >= 0x7){ // Structured extended features, EAX of subleaf 0 is the last subleaf
+    cpuid_read(0x7, 0, &table->leaf7[0]);
+    for(i = 1; i <= table->leaf7[0].eax && i < CPUID_LEAF7_SUBLEAVES; ++i){
+      cpuid_read(0x7, i, &table->leaf7[i]);
+    }
+    table->leaf7_count = i;
+  }
+
+  if(table->max_basic >= 0xB){ // Extended topology, until level type 0
+    for(i = 0; i < CPUID_LEAFB_SUBLEAVES; ++i){
+      cpuid_read(0xB, i, &table->leafB[i]);
+      if(!(table->leafB[i].ecx & 0xFF00)) break;
+    }
+    table->leafB_count = i;
+    if(i){
+      table->apic_id = table->leafB[0].edx;
+    }
+  }
+
+  if(table->max_basic >= 0xD){ // XSAVE state components
+    for(i = 0; i < CPUID_LEAFD_SUBLEAVES; ++i){
+      cpuid_read(0xD, i, &table->leafD[i]);
+    }
+  }
+
+  cpuid_apply_policy(table);
+}
+
+// Size of the XSAVE area for the state components enabled in xcr0 (CPUID.0DH.0:EBX)
+uint32_t cpuid_xsave_size(CPUID_TABLE * table, uint64_t xcr0){
+  uint32_t size = 512 + 64; // legacy region + XSAVE header
+  uint32_t end;
+  int i;
+
+  for(i = 2; i < CPUID_LEAFD_SUBLEAVES; ++i){
+    if(!(xcr0 & (1ULL << i))) continue;
+    end = table->leafD[i].ebx + table->leafD[i].eax; // offset + size
+    if(end > size){
+      size = end;
+    }
+  }
+
+  return size;
+}
+
+void cpuid_patch_dynamic(HVM * hvm, uint32_t leaf, uint32_t subleaf, CPUID_LEAF * out){
+  CPUID_TABLE * table = hvm->cpuid_table;
+
+  switch(leaf){
+    case 0x1:
+      out->ebx = (out->ebx & 0x00FFFFFF) | (table->apic_id << 24);
+      out->ecx &= ~CPUID_01_ECX_OSXSAVE;
+      if(vmcs_read(hvm, GUEST_CR4) & X86_CR4_OSXSAVE){
+        out->ecx |= CPUID_01_ECX_OSXSAVE;
+      }
+      break;
+    case 0xB:
+      out->edx = table->apic_id;
+      break;
+    case 0xD:
+      if(subleaf == 0){
+        out->ebx = cpuid_xsave_size(table, hvm->guest_XCR0);
+      }
+      break;
+    default:;
+  }
+}
+
+// Fills out with the policy-filtered response, returns false for leaves that are not in the table
+bool cpuid_lookup(HVM * hvm, uint32_t leaf, uint32_t subleaf, CPUID_LEAF * out){
+  CPUID_TABLE * table = hvm->cpuid_table;
+  CPUID_LEAF zero = {0};
+
+  if(leaf >= CPUID_HV_BASE && leaf < CPUID_HV_BASE + CPUID_HV_LEAVES && cpuid_policy.hypervisor_present){
+    *out = table->hv[leaf - CPUID_HV_BASE];
+    return true;
+  }
+  if(leaf >= CPUID_EXT_BASE){
+    if(leaf > table->max_ext || leaf - CPUID_EXT_BASE >= CPUID_FAST_LEAVES) return false;
+    *out = table->ext[leaf - CPUID_EXT_BASE];
+    return true;
+  }
+  if(leaf > table->max_basic || leaf >= CPUID_FAST_LEAVES){
+    return false;
+  }
+
+  switch(leaf){
+    case 0x4:
+      *out = subleaf < table->leaf4_count ? table->leaf4[subleaf] : zero;
+      break;
+    case 0x7:
+      *out = subleaf < table->leaf7_count ? table->leaf7[subleaf] : zero;
+      break;
+    case 0xB:
+      if(subleaf < table->leafB_count){
+        *out = table->leafB[subleaf];
+      }
+      else{ // Invalid level: EAX = EBX = 0, ECX[7:0] = input level
+        *out = zero;
+        out->ecx = subleaf & 0xFF;
+      }
+      break;
+    case 0xD:
+      *out = subleaf < CPUID_LEAFD_SUBLEAVES ? table->leafD[subleaf] : zero;
+      break;
+    default:
+      if(CPUID_SUBLEAF_LEAVES & (1ULL << leaf)){
+        return false; // Subleaves not in the table
+      }
+      *out = table->basic[leaf];
+  }
+
+  cpuid_patch_dynamic(hvm, leaf, subleaf, out);
+  return true;
+}
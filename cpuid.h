@@ -0,0 +1,69 @@
+#ifndef _CPUID_
+#define _CPUID_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmx_api.h"
+
+#define CPUID_FAST_LEAVES 64 // basic and extended leaves covered by the table
+#define CPUID_EXT_BASE 0x80000000
+#define CPUID_HV_BASE 0x40000000 // hypervisor vendor leaves
+#define CPUID_HV_LEAVES 2
+
+#define CPUID_LEAF7_SUBLEAVES 4
+#define CPUID_LEAF4_SUBLEAVES 8
+#define CPUID_LEAFB_SUBLEAVES 8
+#define CPUID_LEAFD_SUBLEAVES 64
+
+// Feature bits referenced by the policy and the dynamic patching
+#define CPUID_01_ECX_VMX (1 << 5)
+#define CPUID_01_ECX_XSAVE (1 << 26)
+#define CPUID_01_ECX_OSXSAVE (1 << 27)
+#define CPUID_01_ECX_HYPERVISOR (1U << 31)
+
+typedef struct{
+  uint32_t eax;
+  uint32_t ebx;
+  uint32_t ecx;
+  uint32_t edx;
+} CPUID_LEAF;
+
+// Per-CPU CPUID responses, the head is read by the vmx_exit fast path (offsets in vmx_api.asm)
+typedef struct _CPUID_TABLE{
+  uint64_t basic_mask; // bit n set: leaf n is answered from basic[n] by the fast path
+  uint64_t ext_mask;   // bit n set: leaf 0x80000000 + n is answered from ext[n] by the fast path
+  CPUID_LEAF basic[CPUID_FAST_LEAVES];
+  CPUID_LEAF ext[CPUID_FAST_LEAVES];
+  // Answered by handle_cpuid()
+  uint32_t max_basic;
+  uint32_t max_ext;
+  uint32_t apic_id; // initial APIC ID (x2APIC ID if available)
+  uint32_t leaf7_count;
+  uint32_t leaf4_count;
+  uint32_t leafB_count;
+  CPUID_LEAF leaf7[CPUID_LEAF7_SUBLEAVES];
+  CPUID_LEAF leaf4[CPUID_LEAF4_SUBLEAVES];
+  CPUID_LEAF leafB[CPUID_LEAFB_SUBLEAVES];
+  CPUID_LEAF leafD[CPUID_LEAFD_SUBLEAVES];
+  CPUID_LEAF hv[CPUID_HV_LEAVES];
+} CPUID_TABLE;
+
+// Applied to every CPU's table at cpuid_init() time
+typedef struct{
+  uint32_t leaf1_ecx_clear;
+  uint32_t leaf1_edx_clear;
+  uint32_t leaf7_ebx_clear;
+  uint32_t leaf7_ecx_clear;
+  uint32_t leaf7_edx_clear;
+  uint32_t ext1_ecx_clear;
+  uint32_t ext1_edx_clear;
+  bool hypervisor_present; // CPUID.01H:ECX[31] and the 0x4000000x leaves
+  char vendor[12];         // CPUID.40000000H:EBX,ECX,EDX
+} CPUID_POLICY;
+
+extern CPUID_POLICY cpuid_policy;
+
+void cpuid_init(HVM * hvm);
+bool cpuid_lookup(HVM * hvm, uint32_t leaf, uint32_t subleaf, CPUID_LEAF * out);
+
+#endif
@@ -0,0 +1,313 @@
+#include "lib_uefi.h"
+#include "vmx_api.h"
+#include "vm_setup.h"
+#include "vmcs_cache.h"
+#include "regs.h"
+#include "hv_handlers.h"
+#include "string.h"
+#include "smp.h"
+#include "tsc.h"
+#include "spinlock.h"
+#include "inval.h"
+#include "hypercall.h"
+#include "dirty.h"
+
+/*
+
+Dirty page tracking
+
+With accessed/dirty flags in the EPTP the CPU sets EPT_DIRTY in a leaf on the first write through
+it. With page modification logging it also appends the GPA to the 512-entry log of the CPU and
+exits when the log is full. The logs are drained into the pending bitmap, a dirty large leaf
+counts as a whole. A harvest takes the pending bitmap, clears the dirty flags of the pages in
+it and invalidates every CPU's EPT translations, so the next write to any of them is logged
+again. While tracking, every leaf with its dirty flag set is in the pending bitmap or in a log.
+The hypervisor's own writes to guest memory bypass the EPT, every such copy is followed by
+ept_guest_written(), which marks the pages pending.
+
+A harvest kicks every CPU twice: once so it drains its log, which only the CPU itself can do,
+and once to drop translations that still have the dirty flag cached. Writes between the second
+clear and the invalidation land in pages the harvest already reports.
+
+Without PML the harvest walks the whole EPT for dirty flags instead, DIRTY_MODE_SCAN.
+
+*/
+
+DIRTY_STATE dirty;
+volatile uint64_t dirty_generation; // bumped to make every CPU drain its log and follow dirty.tracking
+// One control or harvest at a time, taken before ept_lock. Never spun on: the holder waits in
+// inval_commit() for every CPU to exit to dirty_sync(), a CPU spinning in root never would.
+ticket_lock_t dirty_lock = {0, 0, NULL};
+
+// Sets the bits of the pages in [gpa, gpa + size), other CPUs may set bits at the same time
+void dirty_mark_bits(uint64_t * bitmap, uint64_t gpa, uint64_t size){
+  uint64_t page = gpa >> 12;
+  uint64_t end = (gpa + size + 4095) >> 12;
+  uint64_t bit, count, mask;
+
+  if(end > dirty.limit){
+    __atomic_add_fetch(&dirty.outside, 1, __ATOMIC_RELAXED);
+    end = dirty.limit;
+  }
+
+  while(page < end){
+    bit = page % 64;
+    count = end - page < 64 - bit ? end - page : 64 - bit;
+    mask = (count == 64 ? ~0ULL : (1ULL << count) - 1) << bit;
+    __atomic_fetch_or(&bitmap[page / 64], mask, __ATOMIC_RELAXED);
+    page += count;
+  }
+}
+
+void dirty_mark(uint64_t gpa, uint64_t size){
+  if(dirty.pending){
+    dirty_mark_bits(dirty.pending, gpa, size);
+  }
+}
+
+// Moves the dirty flags of the leaves below table into bitmap (NULL: only clears them), ept_lock held
+void dirty_scan(uint64_t * table, int level, uint64_t base, uint64_t * bitmap){
+  uint64_t size = EPT_LEVEL_SIZE(level);
+  uint64_t entry;
+  int i;
+
+  for(i = 0; i < 512; ++i){
+    entry = table[i];
+    if(!(entry & EPT_RWX)) continue;
+
+    if(level > 1 && !(entry & EPT_LEAF)){
+      dirty_scan((uint64_t*)(entry & EPT_ADDR_MASK), level - 1, base + i * size, bitmap);
+    }
+    else if(entry & EPT_DIRTY){
+      __atomic_fetch_and(&table[i], ~(uint64_t)EPT_DIRTY, __ATOMIC_RELAXED);
+      if(bitmap){
+        dirty_mark_bits(bitmap, base + i * size, size);
+      }
+    }
+  }
+}
+
+// Clears the dirty flags of the leaves mapping the pages in bitmap, ept_lock held
+void dirty_clear(uint64_t * pml4t, uint64_t * bitmap){
+  uint64_t word, bits, * entry;
+  int level;
+
+  for(word = 0; word < dirty.limit / 64; ++word){
+    for(bits = bitmap[word]; bits; bits &= bits - 1){
+      entry = ept_get_entry(pml4t, (word * 64 + __builtin_ctzll(bits)) << 12, &level);
+      if(*entry & EPT_DIRTY){
+        __atomic_fetch_and(entry, ~(uint64_t)EPT_DIRTY, __ATOMIC_RELAXED);
+      }
+    }
+  }
+}
+
+// Moves the GPAs in this CPU's log to the pending bitmap and empties the log
+void dirty_drain(HVM * hvm){
+  uint64_t index = vmcs_read(hvm, GUEST_PML_INDEX) & 0xFFFF;
+  uint64_t first = index >= PML_ENTRIES ? 0 : index + 1; // the index wraps to 0xFFFF once the log is full
+  uint64_t gpa, size;
+  int level;
+  uint32_t i;
+
+  if(first == PML_ENTRIES){
+    return;
+  }
+
+  ticket_lock(&ept_lock);
+  for(i = first; i < PML_ENTRIES; ++i){
+    gpa = hvm->pml_buffer[i] & ~0xFFFULL;
+    // A mapping removed since the write leaves a non-present entry, possibly a PML4E or PDPTE
+    size = *ept_get_entry((uint64_t*)hvm->st->ept_area, gpa, &level) & EPT_RWX ? EPT_LEVEL_SIZE(level) : 4096;
+    dirty_mark(gpa & ~(size - 1), size);
+  }
+  ticket_unlock(&ept_lock);
+
+  hvm->pml_logged += PML_ENTRIES - first;
+  vmcs_write(hvm, GUEST_PML_INDEX, PML_ENTRIES - 1);
+}
+
+// Drains the log and switches PML on or off, called by vmexit_handler() before inval_sync()
+void dirty_sync(HVM * hvm){
+  uint64_t generation = dirty_generation;
+  uint64_t ctls;
+
+  if(hvm->dirty_generation == generation){
+    return;
+  }
+
+  if(dirty.mode == DIRTY_MODE_PML){
+    ctls = vmcs_read(hvm, SECONDARY_CPU_BASED_VM_EXEC_CONTROL);
+    if(ctls & VM_EXEC_PML){
+      dirty_drain(hvm);
+    }
+    if(dirty.tracking && !(ctls & VM_EXEC_PML)){
+      vmcs_write(hvm, PML_ADDRESS, (uint64_t)hvm->pml_buffer);
+      vmcs_write(hvm, GUEST_PML_INDEX, PML_ENTRIES - 1);
+      vmcs_write(hvm, SECONDARY_CPU_BASED_VM_EXEC_CONTROL, ctls | VM_EXEC_PML);
+    }
+    else if(!dirty.tracking && (ctls & VM_EXEC_PML)){
+      vmcs_write(hvm, SECONDARY_CPU_BASED_VM_EXEC_CONTROL, ctls & ~VM_EXEC_PML);
+    }
+  }
+
+  hvm->dirty_generation = generation;
+}
+
+// Makes every CPU, this one first, run dirty_sync() and drop its EPT translations
+void dirty_kick(HVM * hvm){
+  __atomic_add_fetch(&dirty_generation, 1, __ATOMIC_SEQ_CST);
+  dirty_sync(hvm);
+  inval_queue(INVAL_EPT_SINGLE);
+  inval_commit(hvm, true);
+}
+
+int handle_pml_full(GUEST_REGS * regs, uint64_t exit_reason){
+  ++regs->hvm->pml_full_exits;
+  dirty_drain(regs->hvm);
+
+  return EXIT_KEEP_RIP; // The write that found the log full is retried
+}
+
+uint64_t dirty_bitmap_size(void){
+  return dirty.limit / 8;
+}
+
+uint64_t hc_dirty_control(GUEST_REGS * regs){
+  HVM * hvm = regs->hvm;
+
+  if(!ticket_trylock(&dirty_lock)){
+    return HC_ERR_BUSY;
+  }
+  if(regs->rcx){
+    ZeroMem(dirty.pending, dirty_bitmap_size());
+    dirty.tracking = true;
+
+    // Logging first, then the flags set before are cleared: no write goes unseen
+    dirty_kick(hvm);
+    ticket_lock(&ept_lock);
+    dirty_scan((uint64_t*)hvm->st->ept_area, 4, 0, NULL);
+    ticket_unlock(&ept_lock);
+    inval_queue(INVAL_EPT_SINGLE);
+    inval_commit(hvm, true);
+  }
+  else{
+    dirty.tracking = false;
+    dirty_kick(hvm);
+  }
+  ticket_unlock(&dirty_lock);
+
+  regs->rcx = dirty.mode;
+  regs->rdx = dirty_bitmap_size();
+  return HC_SUCCESS;
+}
+
+uint64_t hc_dirty_harvest(GUEST_REGS * regs){
+  HVM * hvm = regs->hvm;
+  uint64_t * pml4t = (uint64_t*)hvm->st->ept_area;
+  uint64_t addr = regs->rcx;
+  uint64_t start = get_tsc();
+  uint64_t word, pages = 0;
+
+  regs->rcx = dirty_bitmap_size();
+  if(!dirty.tracking){
+    return HC_ERR_INVALID_ARG;
+  }
+  if(regs->rdx < dirty_bitmap_size()){
+    return HC_ERR_BUFFER_TOO_SMALL;
+  }
+  if(!ept_guest_writable(hvm, addr, dirty_bitmap_size())){
+    return HC_ERR_ACCESS;
+  }
+
+  if(!ticket_trylock(&dirty_lock)){
+    return HC_ERR_BUSY;
+  }
+  if(dirty.mode == DIRTY_MODE_PML){
+    dirty_kick(hvm);
+  }
+
+  // Pages logged from here on stay pending for the next harvest
+  for(word = 0; word < dirty.limit / 64; ++word){
+    dirty.snapshot[word] = __atomic_exchange_n(&dirty.pending[word], 0, __ATOMIC_RELAXED);
+  }
+
+  ticket_lock(&ept_lock);
+  if(dirty.mode == DIRTY_MODE_PML){
+    dirty_clear(pml4t, dirty.snapshot);
+  }
+  else{
+    dirty_scan(pml4t, 4, 0, dirty.snapshot);
+  }
+  ticket_unlock(&ept_lock);
+  inval_queue(INVAL_EPT_SINGLE);
+  inval_commit(hvm, true);
+
+  for(word = 0; word < dirty.limit / 64; ++word){
+    pages += __builtin_popcountll(dirty.snapshot[word]);
+  }
+  CopyMem((void*)addr, dirty.snapshot, dirty_bitmap_size());
+  ept_guest_written(addr, dirty_bitmap_size()); // Reported by the next harvest
+
+  ++dirty.harvests;
+  dirty.pages += pages;
+  dirty.harvest_cycles += get_tsc() - start;
+  ticket_unlock(&dirty_lock);
+
+  regs->rdx = pages;
+  return HC_SUCCESS;
+}
+
+// After ept_init() and hypercall_init(), while boot services are available
+bool dirty_init(void){
+  EFI_PHYSICAL_ADDRESS bitmaps = 0;
+  uint64_t ctls2 = get_msr(MSR_IA32_VMX_PROCBASED_CTLS2);
+  uint64_t top = ept_stats.top > 0x100000000ULL ? ept_stats.top : 0x100000000ULL;
+
+  dirty.mode = DIRTY_MODE_NONE;
+#if DIRTY_ENABLED
+  if(!features.ept || !features.ept_ad){
+    return false;
+  }
+
+  // One bit per page up to the end of RAM and the MMIO below 4 GB, in whole words
+  dirty.limit = ((top >> 12) + 63) & ~63ULL;
+  if(BS->AllocatePages(AllocateAnyPages, EfiRuntimeServicesData, EFI_SIZE_TO_PAGES(dirty.limit / 8) * 2, &bitmaps) != EFI_SUCCESS){
+    return false;
+  }
+  dirty.pending = (uint64_t*)bitmaps;
+  dirty.snapshot = (uint64_t*)(bitmaps + EFI_SIZE_TO_PAGES(dirty.limit / 8) * 4096);
+  ZeroMem(dirty.pending, dirty.limit / 8);
+
+  features.pml = ((ctls2 >> 32) & VM_EXEC_PML) != 0;
+  dirty.mode = features.pml ? DIRTY_MODE_PML : DIRTY_MODE_SCAN;
+
+  // Both kick and wait for every CPU, which a ring batch holding hcring_lock would only slow down
+  register_hypercall(VMCALL_DIRTY_CONTROL, hc_dirty_control, HC_KERNEL | HC_NO_RING, "dirty_control");
+  register_hypercall(VMCALL_DIRTY_HARVEST, hc_dirty_harvest, HC_KERNEL | HC_NO_RING, "dirty_harvest");
+  return true;
+#else
+  return false;
+#endif
+}
+
+void dirty_report(void){
+  uint64_t logged = 0, full = 0;
+  int cpu;
+
+  if(dirty.mode == DIRTY_MODE_NONE){
+    return;
+  }
+
+  for(cpu = 0; cpu < CPU_count; ++cpu){
+    logged += cpu_hvm[cpu]->pml_logged;
+    full += cpu_hvm[cpu]->pml_full_exits;
+  }
+
+  bsp_printf("Dirty tracking: %s, %u MB covered, %u harvests, %u pages, %u us per harvest\r\n",
+    dirty.mode == DIRTY_MODE_PML ? "PML" : "EPT scan", dirty.limit >> 8, dirty.harvests, dirty.pages,
+    dirty.harvests ? tsc_to_us(dirty.harvest_cycles / dirty.harvests) : 0);
+  if(dirty.mode == DIRTY_MODE_PML){
+    bsp_printf("  %u GPAs logged, %u PML full exits, %u outside the bitmap\r\n", logged, full, dirty.outside);
+  }
+}
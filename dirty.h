@@ -0,0 +1,37 @@
+#ifndef _DIRTY_
+#define _DIRTY_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmx_api.h"
+#include "regs.h"
+
+#define DIRTY_ENABLED 1 // dirty page tracking through VMCALL_DIRTY_CONTROL/VMCALL_DIRTY_HARVEST
+#define PML_ENTRIES 512
+
+// How dirty pages are found, VMCALL_DIRTY_CONTROL returns it in RCX
+#define DIRTY_MODE_NONE 0 // no EPT accessed/dirty flags
+#define DIRTY_MODE_PML 1 // the CPUs log the pages they set dirty flags for
+#define DIRTY_MODE_SCAN 2 // the EPT is walked for dirty flags on every harvest
+
+typedef struct{
+  uint32_t mode; // DIRTY_MODE_*
+  bool tracking;
+  uint64_t limit; // pages from 0 up to here are tracked, one bit each
+  uint64_t * pending; // pages logged or written by the hypervisor since the last harvest
+  uint64_t * snapshot; // the harvest being copied out
+  uint64_t harvests;
+  uint64_t harvest_cycles;
+  uint64_t pages; // dirty pages reported
+  uint64_t outside; // dirty GPAs at or above limit, MMIO mostly
+} DIRTY_STATE;
+
+extern DIRTY_STATE dirty;
+
+bool dirty_init(void);
+void dirty_mark(uint64_t gpa, uint64_t size);
+void dirty_sync(HVM * hvm);
+int handle_pml_full(GUEST_REGS * regs, uint64_t exit_reason);
+void dirty_report(void);
+
+#endif
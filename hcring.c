@@ -0,0 +1,215 @@
+#include "lib_uefi.h"
+#include "vmx_api.h"
+#include "vm_setup.h"
+#include "regs.h"
+#include "string.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "hypercall.h"
+#include "hcring.h"
+
+/*
+
+Shared hypercall rings
+
+A guest that issues many small calls registers a submission and a completion ring in its own
+memory with VMCALL_RING_REGISTER, queues calls in the submission ring and rings the doorbell,
+VMCALL_RING_DOORBELL. One exit then runs every queued call through hypercall_dispatch() and
+posts the results to the completion ring. Ring memory is identity mapped, so the hypervisor
+uses the guest physical addresses directly.
+
+With HCRING_POLL the CPU that registered the rings also drains them on each of its VM exits,
+the guest may then skip the doorbell when it can wait for that CPU's next exit.
+
+Ring entries skip the CPL check of hypercall_dispatch(), so both the doorbell and the
+registration are kernel only and the rings must sit in memory user mode can't write: anything
+that can queue an entry runs it with kernel rights, with HCRING_POLL even without a doorbell.
+
+The guest only writes the submission tail and the completion head; the hypervisor keeps its own
+copy of everything else and checks the guest's indices before using them. Each entry is copied
+out of the ring before it runs, changing it meanwhile has no effect.
+
+*/
+
+_Static_assert(sizeof(HCRING_SQE) == sizeof(HCRING_CQE), "HCRING_SIZE() covers both rings");
+
+#define HCRING_NO_POLL 0xFFFFFFFF
+
+typedef struct{
+  HCRING_HEADER * sq; // NULL: no rings registered
+  HCRING_HEADER * cq;
+  uint32_t entries;
+  uint32_t poll_cpu; // HCRING_NO_POLL or the cpu_id draining the rings on its exits
+  uint32_t sq_head; // next entry to take
+  uint32_t cq_tail; // next completion to post
+  uint64_t batches; // hcring_process() calls that completed something
+  uint64_t completed;
+  uint64_t stalls; // batches cut short by a full completion ring
+  uint64_t broken; // bad guest indices seen
+} HCRING;
+
+HCRING hcring = {NULL, NULL, 0, HCRING_NO_POLL};
+ticket_lock_t hcring_lock = {0, 0, NULL}; // one batch at a time, dispatch may take other locks inside
+
+uint64_t hc_ring_register(GUEST_REGS * regs){
+  uint64_t sq = regs->rcx, cq = regs->rdx, entries = regs->r8, flags = regs->r9;
+  uint64_t size = HCRING_SIZE(entries);
+
+  // RCX 0 unregisters
+  if(!sq){
+    ticket_lock(&hcring_lock);
+    hcring.sq = hcring.cq = NULL;
+    hcring.poll_cpu = HCRING_NO_POLL;
+    ticket_unlock(&hcring_lock);
+    return HC_SUCCESS;
+  }
+
+  if(!entries || entries > HCRING_MAX_ENTRIES || (entries & (entries - 1))){
+    return HC_ERR_INVALID_ARG;
+  }
+  if((sq | cq) & (sizeof(HCRING_HEADER) - 1) || flags & ~HCRING_POLL){
+    return HC_ERR_INVALID_ARG;
+  }
+  if(sq < cq + size && cq < sq + size){
+    return HC_ERR_INVALID_ARG;
+  }
+  if(!ept_guest_writable(regs->hvm, sq, size) || !ept_guest_writable(regs->hvm, cq, size)){
+    return HC_ERR_ACCESS;
+  }
+
+  ticket_lock(&hcring_lock);
+  hcring.sq = (HCRING_HEADER*)sq;
+  hcring.cq = (HCRING_HEADER*)cq;
+  hcring.entries = entries;
+  hcring.poll_cpu = (flags & HCRING_POLL) ? regs->hvm->cpu_id : HCRING_NO_POLL;
+  hcring.sq_head = hcring.cq_tail = 0;
+
+  ZeroMem(hcring.sq, sizeof(HCRING_HEADER));
+  ZeroMem(hcring.cq, sizeof(HCRING_HEADER));
+  hcring.sq->entries = hcring.cq->entries = entries;
+  ept_guest_written(sq, sizeof(HCRING_HEADER));
+  ept_guest_written(cq, sizeof(HCRING_HEADER));
+  ticket_unlock(&hcring_lock);
+
+  return HC_SUCCESS;
+}
+
+uint64_t hc_ring_doorbell(GUEST_REGS * regs){
+  uint32_t left;
+
+  if(!hcring.sq){
+    return HC_ERR_INVALID_ARG;
+  }
+
+  regs->rcx = hcring_process(regs->hvm, &left);
+  regs->rdx = left;
+  return HC_SUCCESS;
+}
+
+void hcring_init(void){
+  register_hypercall(VMCALL_RING_REGISTER, hc_ring_register, HC_KERNEL | HC_NO_RING, "ring_register");
+  register_hypercall(VMCALL_RING_DOORBELL, hc_ring_doorbell, HC_KERNEL | HC_NO_RING, "ring_doorbell");
+}
+
+// Runs the queued calls the completion ring has room for, returns how many ran
+uint32_t hcring_process(HVM * hvm, uint32_t * left){
+  HCRING_SQE * sqes;
+  HCRING_CQE * cqe;
+  HCRING_SQE sqe;
+  GUEST_REGS regs;
+  uint32_t sq_tail, cq_head, mask, done = 0;
+
+  *left = 0;
+  ticket_lock(&hcring_lock);
+  if(!hcring.sq){
+    goto out;
+  }
+
+  sqes = (HCRING_SQE*)(hcring.sq + 1);
+  mask = hcring.entries - 1;
+
+  // Entries are read after the tail that published them
+  sq_tail = __atomic_load_n(&hcring.sq->tail, __ATOMIC_ACQUIRE);
+  cq_head = __atomic_load_n(&hcring.cq->head, __ATOMIC_ACQUIRE);
+  if(sq_tail - hcring.sq_head > hcring.entries || hcring.cq_tail - cq_head > hcring.entries){
+    hcring.sq->flags |= HCRING_BROKEN;
+    hcring.cq->flags |= HCRING_BROKEN;
+    ept_guest_written((uint64_t)hcring.sq, sizeof(HCRING_HEADER));
+    ept_guest_written((uint64_t)hcring.cq, sizeof(HCRING_HEADER));
+    hcring.sq = hcring.cq = NULL;
+    hcring.poll_cpu = HCRING_NO_POLL;
+    ++hcring.broken;
+    goto out;
+  }
+
+  while(hcring.sq_head != sq_tail && hcring.cq_tail - cq_head < hcring.entries){
+    CopyMem(&sqe, &sqes[hcring.sq_head & mask], sizeof(sqe));
+
+    ZeroMem(&regs, sizeof(regs));
+    regs.hvm = hvm;
+    regs.rax = sqe.call;
+    regs.rcx = sqe.args[0];
+    regs.rdx = sqe.args[1];
+    regs.r8 = sqe.args[2];
+    regs.r9 = sqe.args[3];
+
+    cqe = (HCRING_CQE*)(hcring.cq + 1) + (hcring.cq_tail & mask);
+    cqe->status = hypercall_dispatch(&regs, true);
+    cqe->user_data = sqe.user_data;
+    cqe->results[0] = regs.rcx;
+    cqe->results[1] = regs.rdx;
+    cqe->results[2] = regs.r8;
+    cqe->results[3] = regs.r9;
+
+    ++hcring.sq_head;
+    ++hcring.cq_tail;
+    ++done;
+  }
+
+  // Completions become visible before the submission slots are handed back
+  __atomic_store_n(&hcring.cq->tail, hcring.cq_tail, __ATOMIC_RELEASE);
+  __atomic_store_n(&hcring.sq->head, hcring.sq_head, __ATOMIC_RELEASE);
+  hcring.sq->processed += done;
+  if(done){
+    // The completions may wrap around, the whole completion ring is reported
+    ept_guest_written((uint64_t)hcring.sq, sizeof(HCRING_HEADER));
+    ept_guest_written((uint64_t)hcring.cq, HCRING_SIZE(hcring.entries));
+  }
+
+  *left = sq_tail - hcring.sq_head;
+  if(*left){
+    ++hcring.stalls;
+  }
+  if(done){
+    ++hcring.batches;
+    hcring.completed += done;
+  }
+
+  out:
+  ticket_unlock(&hcring_lock);
+  return done;
+}
+
+// On every VM exit, a racy look at the tail keeps idle rings to a single load
+void hcring_poll(HVM * hvm){
+  HCRING_HEADER * sq;
+  uint32_t left;
+
+  if(hcring.poll_cpu != hvm->cpu_id){
+    return;
+  }
+  sq = hcring.sq;
+  if(sq && sq->tail != hcring.sq_head){
+    hcring_process(hvm, &left);
+  }
+}
+
+void hcring_report(void){
+  if(!hcring.batches && !hcring.broken){
+    return;
+  }
+
+  printf("Hypercall rings: %u calls in %u batches, %u per batch, %u stalls, %u bad indices\r\n",
+    hcring.completed, hcring.batches, hcring.batches ? hcring.completed / hcring.batches : 0,
+    hcring.stalls, hcring.broken);
+}
@@ -0,0 +1,50 @@
+#ifndef _HCRING_
+#define _HCRING_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmx_api.h"
+
+#define HCRING_MAX_ENTRIES 4096
+#define HCRING_SIZE(entries) (sizeof(HCRING_HEADER) + (entries) * sizeof(HCRING_SQE)) // bytes per ring
+
+// VMCALL_RING_REGISTER flags (R9)
+#define HCRING_POLL 0x1 // also drained on every VM exit of the registering CPU
+
+// Header status flags, written by the hypervisor
+#define HCRING_BROKEN 0x1 // the guest moved an index past the ring, the rings are dropped until registered again
+
+/*
+  Both rings are guest memory, mapped for the kernel only: their calls run without a CPL check.
+  In the submission ring the guest fills entries at tail and the hypervisor takes them at head,
+  in the completion ring it is the other way round. Indices run freely and are masked with
+  entries - 1; a ring is full when tail - head == entries.
+*/
+typedef struct{
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  uint32_t entries; // written by VMCALL_RING_REGISTER
+  volatile uint32_t flags; // HCRING_BROKEN
+  uint64_t processed; // submission ring: entries taken so far
+  uint64_t reserved[5];
+} HCRING_HEADER;
+
+typedef struct{
+  uint64_t user_data; // copied to the completion
+  uint32_t call; // VMCALL_* number
+  uint32_t reserved;
+  uint64_t args[4]; // RCX, RDX, R8, R9
+} HCRING_SQE;
+
+typedef struct{
+  uint64_t user_data;
+  uint64_t status; // HC_* like RAX
+  uint64_t results[4]; // RCX, RDX, R8, R9 after the call
+} HCRING_CQE;
+
+void hcring_init(void);
+uint32_t hcring_process(HVM * hvm, uint32_t * left);
+void hcring_poll(HVM * hvm);
+void hcring_report(void);
+
+#endif
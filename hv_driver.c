@@ -13,6 +13,24 @@
 #include "string.h"
 #include "vm_setup.h"
 #include "realmode_emu.h"
+#include "cpuid.h"
+#include "bench.h"
+#include "vpid.h"
+#include "msr_bitmap.h"
+#include "tsc.h"
+#include "numa.h"
+#include "logring.h"
+#include "inval.h"
+#include "spinlock.h"
+#include "blog.h"
+#include "console.h"
+#include "telemetry.h"
+#include "latency.h"
+#include "hypercall.h"
+#include "hcring.h"
+#include "xstate.h"
+#include "profile.h"
+#include "dirty.h"
 
 
 CHAR16 magic[] = L"MAGIC_COMM_YOLO";
@@ -107,6 +125,18 @@ void setup_tss_descriptor(HVM * hvm){
   st->tr_sel = idx;
 }
 
+void set_idt_gate(uint64_t idt_base, uint8_t vec, uint64_t handler){
+  IDT_ENTRY * entry = (IDT_ENTRY*)(idt_base + (vec << 4));
+
+  entry->offset_0_15 = handler & 0xFFFF;
+  entry->offset_16_31 = (handler >> 16) & 0xFFFF;
+  entry->offset_32_63 = handler >> 32;
+  entry->segment_sel = get_cs() & 0xF8;
+  entry->attr = 0; // IST unused
+  entry->p_dpl_type = 0x8E; // present, DPL 0, 64-bit interrupt gate
+  entry->reserved = 0;
+}
+
 
 uint64_t copy_pt(uint64_t pt){
   EFI_STATUS st;
@@ -255,7 +285,7 @@ int prepare_shared_hvm_tables(HVM * hvm){
 
   st->idt_base = 0xFFFFFFFF;
 
-  err = BS->AllocatePages(AllocateMaxAddress, EfiRuntimeServicesData, 3, &st->idt_base);
+  err = BS->AllocatePages(AllocateMaxAddress, EfiRuntimeServicesData, 4, &st->idt_base);
   if(err != EFI_SUCCESS){
     return 0;
   }
@@ -264,6 +294,12 @@ int prepare_shared_hvm_tables(HVM * hvm){
   //print(L"IDT LIMIT: "); print_uint(limit); print(L"\r\n");
   st->idt_limit = limit;
 
+  // The host gets its own copy, NMIs in VMX root must not end up in the firmware handler
+  st->host_idt_base = st->idt_base + 3 * 4096;
+  ZeroMem((void*)st->host_idt_base, 4096);
+  CopyMem((void*)st->host_idt_base, (void*)base, limit + 1);
+  set_idt_gate(st->host_idt_base, NMI_VECTOR, (uint64_t)host_nmi_handler);
+
   // Copy GDT  
   get_gdt_base_limit(&base, &limit);
 
@@ -294,13 +330,6 @@ int prepare_shared_hvm_tables(HVM * hvm){
   }
   st->host_cr3 |= cr3 & 0xFFF;
 
-  err = BS->AllocatePages(AllocateAnyPages, EfiRuntimeServicesData, 1, &st->debug_area);
-  if(err != EFI_SUCCESS){
-    return 0;
-  }
-
-  ZeroMem((void*)st->debug_area, 4096);
-
   rax = 1;
   emu_cpuid(&rax, &rbx, &rcx, &rdx);
   //printf("CPUID.01H:EDX = %b\r\n", rdx);
@@ -325,23 +354,71 @@ int prepare_shared_hvm_tables(HVM * hvm){
     // TODO: Alloc and init classic 4 KB page tables
   }
 
-  //printf("Debug area: %x\r\n", st->debug_area);
-
   return 1;
 }
 
 HVM * bsp_hvm;
-HVM * ap_hvm;
+HVM ** cpu_hvm;
+
+/*
+  Everything a CPU touches on each VM exit sits in one block allocated from the memory of its
+  NUMA domain: VMXON region, VMCS, MSR bitmap, CPUID table, 64 KB host stack, the HVM itself
+  its text and binary log rings, its telemetry page, its exit latency histograms, the XSAVE
+  area for the guest's extended state, its profiler samples and its page modification log.
+*/
+int alloc_cpu_state(int cpu, SharedTables * shared){
+  EFI_PHYSICAL_ADDRESS block;
+  HVM * hvm;
+  uint32_t domain = cpu_domain ? cpu_domain[cpu] : NUMA_NO_DOMAIN;
+
+  if(numa_alloc_pages(domain, CPU_STATE_PAGES, &block) != EFI_SUCCESS){
+    return 0;
+  }
+  ZeroMem((void*)block, CPU_STATE_PAGES * 4096);
+
+  hvm = (HVM*)(block + CPU_PAGE_HVM * 4096);
+  hvm->cpu_id = cpu;
+  hvm->st = shared;
+  hvm->vmxon_region = block + CPU_PAGE_VMXON * 4096;
+  hvm->vmcs = block + CPU_PAGE_VMCS * 4096;
+  hvm->msr_bitmap = block + CPU_PAGE_MSR_BITMAP * 4096;
+  hvm->cpuid_table = (CPUID_TABLE*)(block + CPU_PAGE_CPUID * 4096);
+  hvm->host_stack = block + CPU_PAGE_STACK * 4096;
+  hvm->log_ring = (LOGRING*)(block + CPU_PAGE_LOG * 4096);
+  logring_init(hvm->log_ring, LOGRING_PAGES * 4096);
+  hvm->blog_ring = (LOGRING*)(block + CPU_PAGE_BLOG * 4096);
+  logring_init(hvm->blog_ring, BLOG_RING_PAGES * 4096);
+  hvm->blog_ring->overwrite = true;
+  telemetry_cpu_init(hvm, (TELEMETRY_CPU*)(block + CPU_PAGE_TELEMETRY * 4096));
+  latency_init(hvm, (LATENCY_TABLE*)(block + CPU_PAGE_LATENCY * 4096));
+  xstate_init(hvm, (XSTATE*)(block + CPU_PAGE_XSTATE * 4096));
+  profile_cpu_init(hvm, (PROFILE_RING*)(block + CPU_PAGE_PROFILE * 4096));
+  hvm->pml_buffer = (uint64_t*)(block + CPU_PAGE_PML * 4096);
+  cpu_hvm[cpu] = hvm;
+
+  if(domain == NUMA_NO_DOMAIN){
+    printf("%u: APIC ID %u, no NUMA domain, state at %x\r\n", (uint64_t)cpu, (uint64_t)Proc_x2APIC_IDs[cpu], block);
+  }
+  else{
+    printf("%u: APIC ID %u, domain %u, state at %x in domain %u\r\n", (uint64_t)cpu, (uint64_t)Proc_x2APIC_IDs[cpu],
+      (uint64_t)domain, block, (uint64_t)numa_addr_domain(block));
+  }
+
+  return 1;
+}
 
 EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE * sys_table)
 {
     uint32_t vmx_rev, struct_size;
     EFI_STATUS st = EFI_SUCCESS;
     EFI_LOADED_IMAGE * loaded_image;
+    SharedTables * shared_tables;
     int i;
 
     init(image, sys_table);
+    console_init();
     init_smp();
+    tsc_calibrate();
 
     /*GetVariableOrig = RT->GetVariable;
     RT->GetVariable = GetVariableHook;*/
@@ -375,6 +452,9 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE * sys_table)
     if(vmx_vpid_supported()){
         printf("VMX VPID supported!\r\n");
         features.vpid = true;
+        if(get_msr(MSR_IA32_VMX_EPT_VPID_CAP) & VPID_CAP_INVVPID){
+          features.invvpid_types = (get_msr(MSR_IA32_VMX_EPT_VPID_CAP) >> VPID_CAP_INVVPID_TYPES_SHIFT) & 0xF;
+        }
     }
     else{
         features.vpid = false;
@@ -398,46 +478,35 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE * sys_table)
     print(L"\r\n");
 
     // Prepare runtime memory for HVM
-    st = BS->AllocatePool(EfiRuntimeServicesData, sizeof(HVM), (void**)&bsp_hvm);
+    st = BS->AllocatePool(EfiRuntimeServicesData, sizeof(SharedTables), (void**)&shared_tables);
     if(st != EFI_SUCCESS){
       goto epilog;
     }
 
-    //bsp_hvm->magic = 0xBEAF1BAF;
-    bsp_hvm->st = (SharedTables*)((uint64_t)bsp_hvm + sizeof(HVM));
-    //printf("HVM + ST size: %u\r\n", sizeof(HVM)+sizeof(SharedTables));
-
-    st = BS->AllocatePool(EfiRuntimeServicesData, CPU_count * sizeof(HVM), (void**)&ap_hvm);
+    st = BS->AllocatePool(EfiRuntimeServicesData, CPU_count * sizeof(HVM*), (void**)&cpu_hvm);
     if(st != EFI_SUCCESS){
-      print(L"ap_hvm allocation error\r\n");
-      goto epilog;
-    }
-    
-    st = BS->AllocatePages(AllocateAnyPages, EfiRuntimeServicesData, CPU_count, &bsp_hvm->vmxon_region);
-    if(st != EFI_SUCCESS){
-      print(L"vmcs allocation error\r\n");
+      print(L"cpu_hvm allocation error\r\n");
       goto epilog;
     }
 
-    st = BS->AllocatePages(AllocateAnyPages, EfiRuntimeServicesData, CPU_count, &bsp_hvm->vmcs);
-    if(st != EFI_SUCCESS){
+    if(!telemetry_init()){
+      print(L"Telemetry directory allocation error\r\n");
       goto epilog;
     }
 
-    st = BS->AllocatePages(AllocateAnyPages, EfiRuntimeServicesData, 16 * CPU_count, &bsp_hvm->host_stack);
-    if(st != EFI_SUCCESS){
-      print(L"host stack allocation error\r\n");
-      goto epilog;
+    for(i = 0; i < CPU_count; ++i){
+      if(!alloc_cpu_state(i, shared_tables)){
+        printf("Error allocating the state of CPU %u\r\n", (uint64_t)i);
+        goto epilog;
+      }
     }
+    numa_report();
 
-    bsp_hvm->cpu_id = 0;
-    for(i = 1; i < CPU_count; ++i){
-      ap_hvm[i].cpu_id = i;
-      ap_hvm[i].st = bsp_hvm->st;
-      ap_hvm[i].vmxon_region = (uint64_t)bsp_hvm->vmxon_region + i * 4096;
-      ap_hvm[i].vmcs = (uint64_t)bsp_hvm->vmcs + i * 4096;
-      ap_hvm[i].host_stack = (uint64_t)bsp_hvm->host_stack + i * 65536;
+    if(smp_cpu_index(get_apic_id()) < 0){
+      print(L"The BSP is missing from the MADT\r\n");
+      goto epilog;
     }
+    bsp_hvm = cpu_hvm[smp_cpu_index(get_apic_id())];
 
     if(!prepare_shared_hvm_tables(bsp_hvm)){
       print(L"Error preparing shared hvm tables.\r\n");
@@ -454,6 +523,22 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE * sys_table)
 
     //migrate_image(loaded_image);
 
+    init_exit_handlers();
+    hypercall_init();
+    hcring_init();
+    profile_init();
+    blog_init();
+    inval_init();
+
+#if EPT_ENABLED
+    // Before any vmcs_init(), they all point the EPTP at the shared tables
+    if(features.ept && !ept_init(bsp_hvm)){
+      print(L"EPT setup failed, continuing without EPT.\r\n");
+      features.ept = false;
+    }
+    dirty_init();
+#endif
+
     // Start the rest of CPUs
     start_smp();
 
@@ -499,17 +584,35 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE * sys_table)
     }*/
 
     vmcs_init(bsp_hvm);
-#if EPT_ENABLED
-    if(features.ept){
-      ept_init(bsp_hvm);
-    }
-#endif
     //print(L"GUEST_CR3: "); print_uintx(vmx_read(GUEST_CR3)); print(L"\r\n");
     /*bsp_printf("Press a key to start VM.\r\n");
     wait_for_key();*/
     bsp_printf("Starting VM...\r\n");
     vm_start();
     print(L"Hello from the Guest VM!\r\n");
+    profile_calibrate(bsp_hvm);
+#if BENCH_ENABLED
+    bench_exit_roundtrip(bsp_hvm);
+    bench_tlb_refill(bsp_hvm);
+    bench_xstate(bsp_hvm);
+#endif
+    latency_report(bsp_hvm);
+    xstate_report(bsp_hvm);
+    for(i = 0; i < CPU_count; ++i){
+      if(!cpu_online(i)) continue;
+      msr_bitmap_report(cpu_hvm[i]);
+      vpid_report(cpu_hvm[i]);
+      inval_report(cpu_hvm[i]);
+    }
+    hypercall_report();
+    hcring_report();
+    profile_report();
+    dirty_report();
+    console_report();
+#if LOCK_STATS_ENABLED
+    lock_stats_report();
+#endif
+    blog_save(loaded_image->DeviceHandle);
     //print(L"GUEST_CR3: "); print_uintx(get_cr3()); print(L"\r\n");
 
     //vmx_enable_a20_line();
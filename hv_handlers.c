@@ -6,6 +6,19 @@
 #include "string.h"
 #include "smp.h"
 #include "realmode_emu.h"
+#include "vmcs_cache.h"
+#include "cpuid.h"
+#include "vpid.h"
+#include "vm_setup.h"
+#include "inval.h"
+#include "blog.h"
+#include "console.h"
+#include "telemetry.h"
+#include "hypercall.h"
+#include "hcring.h"
+#include "xstate.h"
+#include "profile.h"
+#include "dirty.h"
 
 CHAR16 *reg_str[] = 
 {
@@ -32,37 +45,53 @@ CHAR16 *reg_str[] =
 }*/
 
 void handle_mov_to_cr(GUEST_REGS * regs, uint8_t cr_num, uint8_t gp_reg){
+  uint64_t value = ((uint64_t*)regs)[gp_reg];
+
   switch(cr_num){
     case 0:
+      // The emulated write doesn't flush the guest TLB like the real one would
+      if((regs->hvm->guest_CR0 ^ value) & (X86_CR0_PG | X86_CR0_WP)){
+        vpid_flush_context(regs->hvm);
+      }
       /*if(!( ((uint64_t*)regs)[gp_reg] & X86_CR0_PG )){
         handle_disable_paging();
       }*/
       regs->hvm->guest_CR0 = ((uint64_t*)regs)[gp_reg];
       if(regs->hvm->guest_CR0 & X86_CR0_PG){
-        vmx_write(GUEST_CR3, regs->hvm->guest_CR3);
+        vmcs_write(regs->hvm, GUEST_CR3, regs->hvm->guest_CR3);
         if(regs->hvm->guest_EFER & EFER_LME){
           regs->hvm->guest_EFER |= EFER_LMA;
-          vmx_write(VM_ENTRY_CONTROLS, vmx_read(VM_ENTRY_CONTROLS) | VM_ENTRY_IA32E_MODE);
+          vmcs_write(regs->hvm, VM_ENTRY_CONTROLS, vmcs_read(regs->hvm, VM_ENTRY_CONTROLS) | VM_ENTRY_IA32E_MODE);
         }
         else{
           regs->hvm->guest_EFER &= ~EFER_LMA;
-          vmx_write(VM_ENTRY_CONTROLS, vmx_read(VM_ENTRY_CONTROLS) & ~VM_ENTRY_IA32E_MODE);
+          vmcs_write(regs->hvm, VM_ENTRY_CONTROLS, vmcs_read(regs->hvm, VM_ENTRY_CONTROLS) & ~VM_ENTRY_IA32E_MODE);
         }
       }
 
-      vmx_write(CR0_READ_SHADOW, ((uint64_t*)regs)[gp_reg] & X86_CR0_PG);
+      vmcs_write(regs->hvm, CR0_READ_SHADOW, ((uint64_t*)regs)[gp_reg] & X86_CR0_PG);
       break;
     case 3:
-      regs->hvm->guest_CR3 = ((uint64_t*)regs)[gp_reg];
+      // Bit 63 with CR4.PCIDE set: keep the TLB entries of the new PCID, the bit itself isn't part of CR3
+      if((regs->hvm->guest_CR4 & X86_CR4_PCIDE) && (value & CR3_NO_FLUSH)){
+        value &= ~CR3_NO_FLUSH;
+      }
+      else{
+        vpid_flush_context_nonglobal(regs->hvm);
+      }
+      regs->hvm->guest_CR3 = value;
       if(regs->hvm->guest_CR0 & X86_CR0_PG){
-        vmx_write(GUEST_CR3, ((uint64_t*)regs)[gp_reg]);
+        vmcs_write(regs->hvm, GUEST_CR3, value);
       }
       break;
     case 4:
       mov_to_cr4:
-      vmx_write(CR4_READ_SHADOW, ((uint64_t*)regs)[gp_reg] & X86_CR4_VMXE);
+      if((regs->hvm->guest_CR4 ^ value) & CR4_TLB_FLUSH_BITS){
+        vpid_flush_context(regs->hvm);
+      }
+      vmcs_write(regs->hvm, CR4_READ_SHADOW, ((uint64_t*)regs)[gp_reg] & X86_CR4_VMXE);
       regs->hvm->guest_CR4 = ((uint64_t*)regs)[gp_reg];
-      vmx_write(GUEST_CR4, ((uint64_t*)regs)[gp_reg] | X86_CR4_VMXE);
+      vmcs_write(regs->hvm, GUEST_CR4, ((uint64_t*)regs)[gp_reg] | X86_CR4_VMXE);
       break;
     default:;
   }
@@ -71,7 +100,7 @@ void handle_mov_to_cr(GUEST_REGS * regs, uint8_t cr_num, uint8_t gp_reg){
 void handle_mov_from_cr(GUEST_REGS * regs, uint8_t cr_num, uint8_t gp_reg){
   switch(cr_num){
     case 0:
-      ((uint64_t*)regs)[gp_reg] = vmx_read(GUEST_CR0);
+      ((uint64_t*)regs)[gp_reg] = vmcs_read(regs->hvm, GUEST_CR0);
       break;
     case 3:
       //((uint64_t*)regs)[gp_reg] = vmx_read(GUEST_CR3);
@@ -93,8 +122,8 @@ void handle_lmsw(GUEST_REGS * regs){
   //print(L"LMSW");
 }
 
-void handle_cr_access(GUEST_REGS * regs){
-  uint64_t exit_qualification = vmx_read(EXIT_QUALIFICATION);
+int handle_cr_access(GUEST_REGS * regs, uint64_t exit_reason){
+  uint64_t exit_qualification = vmcs_read(regs->hvm, EXIT_QUALIFICATION);
   uint8_t cr_num = exit_qualification & 0xF;
   uint8_t access_type = (exit_qualification >> 4) & 3;
   uint8_t gp_reg = (exit_qualification >> 8) & 0xF;
@@ -122,71 +151,80 @@ void handle_cr_access(GUEST_REGS * regs){
   /*if(access_type < 2){
     print(reg_str[gp_reg]); print(L"\r\n");
   }*/
+
+  return EXIT_ADVANCE_RIP;
 }
 
-void handle_msr_read(GUEST_REGS * regs){
+int handle_msr_read(GUEST_REGS * regs, uint64_t exit_reason){
   uint64_t guest_param;
 
+  ++regs->hvm->msr_read_exits;
+
   switch(regs->rcx & 0xFFFFFFFF){
     case MSR_IA32_SYSENTER_CS:
-      guest_param = vmx_read(GUEST_SYSENTER_CS);
+      guest_param = vmcs_read(regs->hvm, GUEST_SYSENTER_CS);
       break;
     case MSR_IA32_SYSENTER_ESP:
-      guest_param = vmx_read(GUEST_SYSENTER_ESP);
+      guest_param = vmcs_read(regs->hvm, GUEST_SYSENTER_ESP);
       break;
     case MSR_IA32_SYSENTER_EIP:
-      guest_param = vmx_read(GUEST_SYSENTER_EIP);
+      guest_param = vmcs_read(regs->hvm, GUEST_SYSENTER_EIP);
       break;
     case MSR_FS_BASE:
-      guest_param = vmx_read(GUEST_FS_BASE);
+      guest_param = vmcs_read(regs->hvm, GUEST_FS_BASE);
       break;
     case MSR_GS_BASE:
-      guest_param = vmx_read(GUEST_GS_BASE);
+      guest_param = vmcs_read(regs->hvm, GUEST_GS_BASE);
       break;
     case MSR_EFER:
       guest_param = regs->hvm->guest_EFER;
       break;
     default:
       emu_rdmsr(regs->rcx, &regs->rdx, &regs->rax);
-      return;
+      return EXIT_ADVANCE_RIP;
   }
 
   regs->rax = guest_param & 0xFFFFFFFF;
   regs->rdx = guest_param >> 32;
+
+  return EXIT_ADVANCE_RIP;
 }
 
 void handle_msr_break(uint64_t rdx, uint64_t rax){
 
 }
 
-void handle_msr_write(GUEST_REGS * regs){
+int handle_msr_write(GUEST_REGS * regs, uint64_t exit_reason){
   uint64_t guest_param = (regs->rax & 0xFFFFFFFF) | (regs->rdx << 32);
 
+  ++regs->hvm->msr_write_exits;
+
   switch(regs->rcx & 0xFFFFFFFF){
     case MSR_IA32_SYSENTER_CS:
-      vmx_write(GUEST_SYSENTER_CS, guest_param);
+      vmcs_write(regs->hvm, GUEST_SYSENTER_CS, guest_param);
       break;
     case MSR_IA32_SYSENTER_ESP:
-      vmx_write(GUEST_SYSENTER_ESP, guest_param);
+      vmcs_write(regs->hvm, GUEST_SYSENTER_ESP, guest_param);
       break;
     case MSR_IA32_SYSENTER_EIP:
-      vmx_write(GUEST_SYSENTER_EIP, guest_param);
+      vmcs_write(regs->hvm, GUEST_SYSENTER_EIP, guest_param);
       break;
     case MSR_FS_BASE:
-      vmx_write(GUEST_FS_BASE, guest_param);
+      vmcs_write(regs->hvm, GUEST_FS_BASE, guest_param);
       break;
     case MSR_GS_BASE:
-      vmx_write(GUEST_GS_BASE, guest_param);
+      vmcs_write(regs->hvm, GUEST_GS_BASE, guest_param);
       break;
     case MSR_EFER:
       regs->hvm->guest_EFER = (regs->rax & 0xFFFFFFFF) | (regs->rdx << 32);
       //emu_wrmsr(regs->rcx, regs->rdx, (regs->rax & 0xFFFFFFFF) | EFER_LME);
-      vmx_write(GUEST_IA32_EFER, regs->hvm->guest_EFER);
+      vmcs_write(regs->hvm, GUEST_IA32_EFER, regs->hvm->guest_EFER);
       break;
     default:
       emu_wrmsr(regs->rcx, regs->rdx, (regs->rax & 0xFFFFFFFF));
   }
-  
+
+  return EXIT_ADVANCE_RIP;
 }
 
 void debug_print(GUEST_REGS * regs){
@@ -221,9 +259,105 @@ void unknown_exit(uint64_t exit_reason){
   bsp_printf("Exit qualification: %u\r\n", exit_qualification);
 }
 
-void handle_ept_misconfiguration(GUEST_REGS * regs){
-  uint64_t guest_phys_addr = vmx_read(GUEST_PHYS_ADDR);
-  //bsp_printf("EPT misconfiguration accessing address 0x%x\r\n", guest_phys_addr);
+int handle_unknown_exit(GUEST_REGS * regs, uint64_t exit_reason){
+  telemetry_error(regs->hvm, TELEMETRY_ERR_UNKNOWN_EXIT, exit_reason);
+  unknown_exit(exit_reason & 0xFFFF);
+  return EXIT_ADVANCE_RIP;
+}
+
+// EPT exits have no instruction length to skip by, the guest gets a fault on the access instead
+void inject_gp(HVM * hvm){
+  vmcs_write(hvm, VM_ENTRY_EXCEPTION_ERROR_CODE, 0);
+  vmcs_write(hvm, VM_ENTRY_INTR_INFO_FIELD,
+    INTR_INFO_VALID | INTR_INFO_DELIVER_CODE | (INTR_TYPE_HARD_EXCEPTION << 8) | GP_VECTOR);
+}
+
+int handle_ept_misconfiguration(GUEST_REGS * regs, uint64_t exit_reason){
+  uint64_t guest_phys_addr = vmcs_read(regs->hvm, GUEST_PHYS_ADDR);
+  BLOG_HVM(regs->hvm, BLOG_WARN, BLOG_CAT_EPT, "EPT misconfiguration accessing address %x", guest_phys_addr);
+  inject_gp(regs->hvm);
+  return EXIT_KEEP_RIP;
+}
+
+int handle_exception_nmi(GUEST_REGS * regs, uint64_t exit_reason){
+  uint32_t intr_info = vmcs_read(regs->hvm, VM_EXIT_INTR_INFO);
+
+  // Kicks from inval_commit() are done once inval_sync() runs, real NMIs go back to the guest
+  if(INTR_INFO_TYPE(intr_info) == INTR_TYPE_NMI && !inval_nmi_kick(regs->hvm)){
+    ++regs->hvm->nmi_pending;
+  }
+
+  return EXIT_KEEP_RIP;
+}
+
+// The guest can take an NMI now, nmi_sync() injects it
+int handle_nmi_window(GUEST_REGS * regs, uint64_t exit_reason){
+  return EXIT_KEEP_RIP;
+}
+
+// Whether VM entry can inject an NMI without breaking the guest's own blocking
+bool nmi_injectable(HVM * hvm){
+  uint64_t activity = vmcs_read(hvm, GUEST_ACTIVITY_STATE);
+
+  if(vmcs_read(hvm, VM_ENTRY_INTR_INFO_FIELD) & INTR_INFO_VALID){
+    return false; // The handler injects an event already
+  }
+  if(activity == STATE_SHUTDOWN || activity == STATE_WAIT_FOR_SIPI){
+    return false;
+  }
+
+  return !(vmcs_read(hvm, GUEST_INTERRUPTIBILITY_INFO) &
+    (GUEST_INTR_STATE_STI | GUEST_INTR_STATE_MOV_SS | GUEST_INTR_STATE_NMI));
+}
+
+// Sorts the NMIs host_nmi_handler took in root into kicks and guest NMIs and injects one pending
+// NMI if the guest can take it. Otherwise NMI-window exiting brings the CPU back once it can.
+// Called on every exit before inval_sync(), see inval_nmi_kick().
+void nmi_sync(HVM * hvm){
+  uint64_t ctls, window;
+
+  do{
+    while(hvm->root_nmis_seen != hvm->root_nmis){
+      ++hvm->root_nmis_seen;
+      if(!inval_nmi_kick(hvm)){
+        ++hvm->nmi_pending;
+      }
+    }
+
+    if(hvm->nmi_pending && nmi_injectable(hvm)){
+      vmcs_write(hvm, VM_ENTRY_INTR_INFO_FIELD, INTR_INFO_VALID | (INTR_TYPE_NMI << 8) | NMI_VECTOR);
+      --hvm->nmi_pending;
+      ++hvm->nmi_injected;
+    }
+
+    // Without virtual NMIs there are no NMI-window exits, pending NMIs wait for the next exit
+    window = hvm->nmi_pending ? hvm->nmi_window_exiting : 0;
+    ctls = vmx_read(PRIMARY_CPU_BASED_VM_EXEC_CONTROL);
+    if((ctls & CPU_BASED_NMI_WINDOW_EXITING) != window){
+      vmx_write(PRIMARY_CPU_BASED_VM_EXEC_CONTROL, (ctls & ~CPU_BASED_NMI_WINDOW_EXITING) | window);
+    }
+  } while(hvm->root_nmis_seen != hvm->root_nmis); // host_nmi_handler sets the bit again after this
+}
+
+int handle_ept_violation(GUEST_REGS * regs, uint64_t exit_reason){
+  uint64_t guest_phys_addr = vmcs_read(regs->hvm, GUEST_PHYS_ADDR);
+  uint64_t exit_qualification = vmcs_read(regs->hvm, EXIT_QUALIFICATION);
+
+  // A faulting IRET already unblocked NMIs, they stay blocked until it runs again
+  if(exit_qualification & INTR_INFO_UNBLOCK_NMI){
+    vmcs_write(regs->hvm, GUEST_INTERRUPTIBILITY_INFO,
+      vmcs_read(regs->hvm, GUEST_INTERRUPTIBILITY_INFO) | GUEST_INTR_STATE_NMI);
+  }
+
+  if(ept_handle_violation(regs->hvm, guest_phys_addr, exit_qualification)){
+    return EXIT_KEEP_RIP; // Retry the access
+  }
+
+  BLOG_HVM(regs->hvm, BLOG_WARN, BLOG_CAT_EPT, "Unhandled EPT violation at %x", guest_phys_addr);
+  unknown_exit(exit_reason & 0xFFFF);
+  telemetry_error(regs->hvm, TELEMETRY_ERR_EPT_VIOLATION, exit_reason);
+  inject_gp(regs->hvm);
+  return EXIT_KEEP_RIP;
 }
 
 void handle_failed_vmentry(uint64_t exit_reason){
@@ -236,22 +370,34 @@ void handle_failed_vmentry(uint64_t exit_reason){
   bsp_printf("Exit qualification: %u\r\n", exit_qualification);
 }
 
-void handle_vmcall(GUEST_REGS * regs){
-  regs->rax = 0x47415753; // "SWAG"
+// Leaves not taken by the vmx_exit fast path, answered from the per-CPU table where possible
+int handle_cpuid(GUEST_REGS * regs, uint64_t exit_reason){
+  CPUID_LEAF leaf;
+
+  if(!cpuid_lookup(regs->hvm, regs->rax, regs->rcx, &leaf)){
+    emu_cpuid(&regs->rax, &regs->rbx, &regs->rcx, &regs->rdx);
+    return EXIT_ADVANCE_RIP;
+  }
+
+  regs->rax = leaf.eax;
+  regs->rbx = leaf.ebx;
+  regs->rcx = leaf.ecx;
+  regs->rdx = leaf.edx;
+  return EXIT_ADVANCE_RIP;
 }
 
-void handle_sipi(GUEST_REGS * regs){
-  uint64_t exit_qualification = vmx_read(EXIT_QUALIFICATION);
+int handle_sipi(GUEST_REGS * regs, uint64_t exit_reason){
+  uint64_t exit_qualification = vmcs_read(regs->hvm, EXIT_QUALIFICATION);
   uint64_t seg = exit_qualification << 8;
   uint8_t * eip;
-  uint32_t magic = 0x1BAF2BAF;
 
-  //CopyMem((void*)regs->hvm->st->debug_area, &magic, 4);
-  //CopyMem((void*)(regs->hvm->st->debug_area + 4 * regs->hvm->cpu_id), &seg, 4);
+  // inval_commit() waits for this CPU from here on, inval_sync() runs before the guest does
+  __atomic_store_n(&regs->hvm->wait_for_sipi, false, __ATOMIC_SEQ_CST);
 
   if(!seg){ // VMware bug - EXIT_QUALIFICATION is always zero
     seg = 0x100; // Windows 8 trampoline code starts at 0x1000
   }
+  BLOG_HVM(regs->hvm, BLOG_INFO, BLOG_CAT_SMP, "SIPI, start segment %x, EXIT_QUALIFICATION %x", seg, exit_qualification);
 
   /*eip = (uint8_t*)(seg << 4);
 
@@ -267,69 +413,122 @@ void handle_sipi(GUEST_REGS * regs){
   }
 
   vmx_write(GUEST_EIP, (uint64_t)eip);*/
-  vmx_write(GUEST_ESP, (uint64_t)ap_stacks + regs->hvm->cpu_id * 4096);
+  vmcs_write(regs->hvm, GUEST_ESP, (uint64_t)ap_stacks + regs->hvm->cpu_id * 4096);
 
-  vmx_write(GUEST_CS_SELECTOR, seg);
-  vmx_write(GUEST_CS_BASE, seg << 4);
-  vmx_write(GUEST_CS_LIMIT, 0xFFFF);
-  vmx_write(GUEST_EIP, 0);
-  vmx_write(VM_ENTRY_CONTROLS, vmx_read(VM_ENTRY_CONTROLS) & ~VM_ENTRY_IA32E_MODE);
+  vmcs_write(regs->hvm, GUEST_CS_SELECTOR, seg);
+  vmcs_write(regs->hvm, GUEST_CS_BASE, seg << 4);
+  vmcs_write(regs->hvm, GUEST_CS_LIMIT, 0xFFFF);
+  vmcs_write(regs->hvm, GUEST_EIP, 0);
+  vmcs_write(regs->hvm, VM_ENTRY_CONTROLS, vmcs_read(regs->hvm, VM_ENTRY_CONTROLS) & ~VM_ENTRY_IA32E_MODE);
   regs->hvm->guest_EFER = ~(EFER_LME | EFER_LMA); // Disable long mode
-  vmx_write(GUEST_IA32_EFER, regs->hvm->guest_EFER);
-  vmx_write(GUEST_CR4, regs->hvm->guest_CR4); // Disable PAE, enable PSE (if supported)
-  vmx_write(GUEST_CR0, regs->hvm->guest_CR0); // Disable PE, PG - enter real mode
+  vmcs_write(regs->hvm, GUEST_IA32_EFER, regs->hvm->guest_EFER);
+  vmcs_write(regs->hvm, GUEST_CR4, regs->hvm->guest_CR4); // Disable PAE, enable PSE (if supported)
+  vmcs_write(regs->hvm, GUEST_CR0, regs->hvm->guest_CR0); // Disable PE, PG - enter real mode
+  vpid_flush_context(regs->hvm);
 
   // Inject brakpoint
   //*(uint8_t*)0x16B1 = 0xCC;
   //*(uint64_t*)0x16B2 = 0x90;
 
   resume_ap:
-  vmx_write(GUEST_ACTIVITY_STATE, STATE_HLT);
+  vmcs_write(regs->hvm, GUEST_ACTIVITY_STATE, STATE_HLT);
   //vmx_write(GUEST_ACTIVITY_STATE, STATE_ACTIVE);
+
+  return EXIT_KEEP_RIP;
+}
+
+// Indexed by the basic exit reason, filled in by init_exit_handlers() before any CPU enters the guest
+exit_handler_func exit_handlers[VMX_EXIT_REASON_COUNT];
+
+exit_handler_func register_exit_handler(uint32_t exit_reason, exit_handler_func handler){
+  exit_handler_func prev;
+
+  if(exit_reason >= VMX_EXIT_REASON_COUNT){
+    return NULL;
+  }
+  if(!handler){
+    handler = handle_unknown_exit;
+  }
+
+  prev = exit_handlers[exit_reason];
+  exit_handlers[exit_reason] = handler;
+
+  return prev;
+}
+
+void init_exit_handlers(void){
+  uint32_t i;
+
+  for(i = 0; i < VMX_EXIT_REASON_COUNT; ++i){
+    exit_handlers[i] = handle_unknown_exit;
+  }
+
+  register_exit_handler(EXIT_REASON_MSR_READ, handle_msr_read);
+  register_exit_handler(EXIT_REASON_MSR_WRITE, handle_msr_write);
+  register_exit_handler(EXIT_REASON_CR_ACCESS, handle_cr_access);
+  register_exit_handler(EXIT_REASON_CPUID, handle_cpuid);
+  register_exit_handler(EXIT_REASON_VMCALL, handle_vmcall);
+  register_exit_handler(EXIT_REASON_XSETBV, handle_xsetbv);
+  register_exit_handler(EXIT_REASON_PREEMPTION_TIMER, handle_preemption_timer);
+  register_exit_handler(EXIT_REASON_PML_FULL, handle_pml_full);
+  register_exit_handler(EXIT_REASON_SIPI, handle_sipi);
+  register_exit_handler(EXIT_REASON_EPT_MISCONFIGURATION, handle_ept_misconfiguration);
+  register_exit_handler(EXIT_REASON_EPT_VIOLATION, handle_ept_violation);
+  register_exit_handler(EXIT_REASON_EXCEPTION_NMI, handle_exception_nmi);
+  register_exit_handler(EXIT_REASON_NMI_WINDOW, handle_nmi_window);
 }
 
 void vmexit_handler(GUEST_REGS * regs){
   // CPUID, GETSEC, INVD, MOV from/to CR3
   // VMCALL, VMCLEAR, VMLAUNCH, VMPTRLD, VMPTRST, VMREAD, VMRESUME, VMWRITE, VMXOFF, VMXON
-  uint64_t exit_reason = vmx_read(VM_EXIT_REASON);
+  HVM * hvm = regs->hvm;
+  TELEMETRY_CPU * telemetry = hvm->telemetry;
+  uint64_t start_tsc = get_tsc();
+  uint64_t exit_reason;
+  uint32_t basic_reason;
   uint64_t guest_rip, instr_len;
-  uint64_t debug_msg = exit_reason & 0xFFFF;
+  exit_handler_func handler;
+
+  vmcs_cache_reset(hvm);
+  exit_reason = vmcs_read(hvm, VM_EXIT_REASON);
+  basic_reason = exit_reason & 0xFFFF;
 
   //debug_print(regs);
-  CopyMem((void*)(regs->hvm->st->debug_area + 4 * regs->hvm->cpu_id), &debug_msg, 4);
+  telemetry->prev_exit_reason = telemetry->last_exit_reason;
+  telemetry->last_exit_reason = exit_reason;
+  telemetry->last_exit_tsc = start_tsc;
+  ++telemetry->exits;
+
+  BLOG_HVM(hvm, BLOG_DEBUG, BLOG_CAT_EXIT, "VM exit %u", basic_reason);
 
   if(exit_reason & VMX_EXIT_REASONS_FAILED_VMENTRY){
+    BLOG_HVM(hvm, BLOG_ERROR, BLOG_CAT_EXIT, "VM entry failed, exit reason %x", exit_reason);
+    telemetry_error(hvm, TELEMETRY_ERR_FAILED_VMENTRY, exit_reason);
     handle_failed_vmentry(exit_reason);
-    return;
+    goto resume;
   }
 
-  switch(exit_reason){
-    case EXIT_REASON_MSR_READ:
-      handle_msr_read(regs);
-      break;
-    case EXIT_REASON_MSR_WRITE:
-      handle_msr_write(regs);
-      break;
-    case EXIT_REASON_CR_ACCESS:
-      handle_cr_access(regs);
-      break;
-    case EXIT_REASON_CPUID:
-      emu_cpuid(&regs->rax, &regs->rbx, &regs->rcx, &regs->rdx);
-      break;
-    case EXIT_REASON_VMCALL:
-      handle_vmcall(regs);
-      break;
-    case EXIT_REASON_SIPI:
-      handle_sipi(regs);
-      return;
-    case EXIT_REASON_EPT_MISCONFIGURATION:
-      handle_ept_misconfiguration(regs);
-      break;
-    default:;
-      unknown_exit(exit_reason & 0xFFFF);
+  if(basic_reason < VMX_EXIT_REASON_COUNT){
+    ++telemetry->exit_hits[basic_reason];
+    handler = exit_handlers[basic_reason];
+  }
+  else{
+    handler = handle_unknown_exit;
+  }
+
+  if(handler(regs, exit_reason) == EXIT_ADVANCE_RIP){
+    guest_rip = vmcs_read(hvm, GUEST_EIP);
+    instr_len = vmcs_read(hvm, VM_EXIT_INSTRUCTION_LEN);
+    vmcs_write(hvm, GUEST_EIP, guest_rip + instr_len);
   }
 
-  guest_rip = vmx_read(GUEST_EIP);
-  instr_len = vmx_read(VM_EXIT_INSTRUCTION_LEN);
-  vmx_write(GUEST_EIP, guest_rip + instr_len);
+  resume:
+  dirty_sync(hvm); // drains the PML log before inval_sync() tells inval_commit() this CPU is done
+  nmi_sync(hvm);
+  inval_sync(hvm);
+  hcring_poll(hvm);
+  profile_sync(hvm);
+  console_poll();
+  vmcs_cache_flush(hvm);
+  telemetry->root_cycles += get_tsc() - start_tsc;
 }
\ No newline at end of file
@@ -7,6 +7,12 @@ typedef void (*vmx_exit_func)(void);
 typedef void (*unknown_exit_func)(uint64_t exit_reason);
 typedef void (*handle_msr_break_func)(uint64_t rdx, uint64_t rax);
 
+// Return values of exit handlers
+#define EXIT_KEEP_RIP 0 // RIP is left as is (re-execute or already set by the handler)
+#define EXIT_ADVANCE_RIP 1 // skip the instruction that caused the exit
+
+typedef int (*exit_handler_func)(GUEST_REGS * regs, uint64_t exit_reason);
+
 vmexit_handler_func ptr_vmexit_handler;
 vmx_exit_func ptr_vmx_exit;
 unknown_exit_func ptr_unknown_exit;
@@ -17,4 +23,8 @@ void vmx_exit(void);
 void unknown_exit(uint64_t exit_reason);
 void handle_msr_break(uint64_t rdx, uint64_t rax);
 
+void init_exit_handlers(void);
+exit_handler_func register_exit_handler(uint32_t exit_reason, exit_handler_func handler);
+void inject_gp(HVM * hvm);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,151 @@
+#include "lib_uefi.h"
+#include "vmx_api.h"
+#include "vm_setup.h"
+#include "vmcs_cache.h"
+#include "regs.h"
+#include "hv_handlers.h"
+#include "string.h"
+#include "smp.h"
+#include "telemetry.h"
+#include "latency.h"
+#include "hypercall.h"
+
+/*
+
+Hypercall dispatcher
+
+handle_vmcall() is the EXIT_REASON_VMCALL handler. It looks the call number up in
+hypercall_table, checks the caller's CPL against the call's flags and times the handler, so
+each call costs one exit and a table lookup. Calls queued in the shared rings of hcring.c go
+through the same hypercall_dispatch(), many per exit. The counts and cycles go to the CPU's telemetry
+block where the guest can read them.
+
+*/
+
+#define CS_AR_DPL(ar) (((ar) >> 5) & 3) // CS.DPL is the CPL outside of real and virtual-8086 mode
+#define RFLAGS_VM (1 << 17)
+
+HYPERCALL hypercall_table[VMCALL_MAX];
+
+bool register_hypercall(uint32_t number, hypercall_func handler, uint32_t flags, const char * name){
+  if(number >= VMCALL_MAX){
+    return false;
+  }
+
+  hypercall_table[number].handler = handler;
+  hypercall_table[number].flags = flags;
+  hypercall_table[number].name = name;
+
+  return true;
+}
+
+uint64_t hc_ping(GUEST_REGS * regs){
+  return VMCALL_PING_REPLY;
+}
+
+uint64_t hc_get_version(GUEST_REGS * regs){
+  regs->rcx = HYPERCALL_ABI_VERSION;
+  regs->rdx = VMCALL_COUNT;
+  regs->r8 = HYPERCALL_SIGNATURE;
+  return HC_SUCCESS;
+}
+
+uint64_t hc_get_telemetry(GUEST_REGS * regs){
+  if(!telemetry_directory){
+    return HC_ERR_UNKNOWN_CALL;
+  }
+
+  regs->rcx = (uint64_t)telemetry_directory;
+  regs->rdx = telemetry_directory_size();
+  return HC_SUCCESS;
+}
+
+uint64_t hc_latency_snapshot(GUEST_REGS * regs){
+  uint64_t addr = regs->rcx;
+
+  regs->rcx = latency_snapshot_size();
+  return latency_snapshot(regs->hvm, addr, regs->rdx);
+}
+
+void hypercall_init(void){
+  register_hypercall(VMCALL_PING, hc_ping, 0, "ping");
+  register_hypercall(VMCALL_GET_VERSION, hc_get_version, 0, "get_version");
+  register_hypercall(VMCALL_GET_TELEMETRY, hc_get_telemetry, HC_KERNEL, "get_telemetry");
+  register_hypercall(VMCALL_LATENCY_SNAPSHOT, hc_latency_snapshot, HC_KERNEL, "latency_snapshot");
+}
+
+// CPL of the guest, real mode runs at 0 and virtual-8086 mode at 3
+uint32_t guest_cpl(HVM * hvm){
+  if(!(vmcs_read(hvm, GUEST_CR0) & X86_CR0_PE)){
+    return 0;
+  }
+  if(vmcs_read(hvm, GUEST_EFLAGS) & RFLAGS_VM){
+    return 3;
+  }
+
+  return CS_AR_DPL(vmcs_read(hvm, GUEST_CS_AR_BYTES));
+}
+
+// Runs the call in regs->rax, ring entries were queued by the CPL 0 code that registered the ring
+// and rang the doorbell, in kernel only memory
+uint64_t hypercall_dispatch(GUEST_REGS * regs, bool from_ring){
+  TELEMETRY_CPU * telemetry = regs->hvm->telemetry;
+  uint64_t number = regs->rax;
+  uint64_t start, status;
+  HYPERCALL * call;
+
+  if(number >= VMCALL_MAX || !hypercall_table[number].handler){
+    status = HC_ERR_UNKNOWN_CALL;
+  }
+  else{
+    call = &hypercall_table[number];
+    if(from_ring && (call->flags & HC_NO_RING)){
+      status = HC_ERR_INVALID_ARG;
+    }
+    else if(!from_ring && (call->flags & HC_KERNEL) && guest_cpl(regs->hvm) != 0){
+      status = HC_ERR_PRIVILEGE;
+    }
+    else{
+      start = get_tsc();
+      status = call->handler(regs);
+      telemetry->hypercall_cycles[number] += get_tsc() - start;
+    }
+    ++telemetry->hypercalls[number];
+  }
+
+  if(HC_IS_ERROR(status)){
+    ++telemetry->hypercall_errors;
+  }
+
+  return status;
+}
+
+int handle_vmcall(GUEST_REGS * regs, uint64_t exit_reason){
+  regs->rax = hypercall_dispatch(regs, false);
+
+  return EXIT_ADVANCE_RIP;
+}
+
+void hypercall_report(void){
+  uint64_t calls, cycles, errors = 0;
+  uint32_t number;
+  int cpu;
+
+  for(cpu = 0; cpu < CPU_count; ++cpu){
+    errors += cpu_hvm[cpu]->telemetry->hypercall_errors;
+  }
+  printf("Hypercalls: ABI version %u, %u errors\r\n", (uint64_t)HYPERCALL_ABI_VERSION, errors);
+
+  for(number = 0; number < VMCALL_MAX; ++number){
+    if(!hypercall_table[number].handler) continue;
+
+    calls = cycles = 0;
+    for(cpu = 0; cpu < CPU_count; ++cpu){
+      calls += cpu_hvm[cpu]->telemetry->hypercalls[number];
+      cycles += cpu_hvm[cpu]->telemetry->hypercall_cycles[number];
+    }
+    if(calls){
+      printf("  %s: %u calls, %u cycles per call\r\n", hypercall_table[number].name, calls, cycles / calls);
+    }
+  }
+}
@@ -0,0 +1,68 @@
+#ifndef _HYPERCALL_
+#define _HYPERCALL_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmx_api.h"
+#include "regs.h"
+#include "telemetry.h"
+
+/*
+  Hypercall ABI, version HYPERCALL_ABI_VERSION
+
+  VMCALL with the call number in RAX and up to four arguments in RCX, RDX, R8 and R9. On return
+  RAX holds a HC_* status and RCX, RDX, R8 and R9 the results the call defines; other registers
+  are preserved. VMCALL_PING is the exception, it only puts VMCALL_PING_REPLY in RAX and is
+  answered by the vmx_exit fast path.
+
+  Calls marked kernel only fail with HC_ERR_PRIVILEGE unless the guest runs at CPL 0.
+*/
+#define HYPERCALL_ABI_VERSION 1
+#define HYPERCALL_SIGNATURE 0x0044524745554C42ULL // "BLUEGRD"
+
+// Call numbers (RAX)
+#define VMCALL_PING 0 // RAX: VMCALL_PING_REPLY
+#define VMCALL_PING_REPLY 0x47415753 // "SWAG"
+#define VMCALL_GET_VERSION 1 // RCX: HYPERCALL_ABI_VERSION, RDX: VMCALL_COUNT, R8: HYPERCALL_SIGNATURE
+#define VMCALL_GET_TELEMETRY 2 // RCX: TELEMETRY_DIRECTORY address, RDX: its size in bytes
+#define VMCALL_LATENCY_SNAPSHOT 3 // in RCX: buffer address, RDX: its size. RCX: bytes needed
+#define VMCALL_RING_REGISTER 4 // in RCX: submission ring, RDX: completion ring, R8: entries, R9: HCRING_* flags, see hcring.h
+#define VMCALL_RING_DOORBELL 5 // RCX: entries completed, RDX: entries left for lack of completion space
+#define VMCALL_PROFILE_CONTROL 6 // in RCX: samples per second and CPU, 0 stops. RCX: rate applied
+#define VMCALL_PROFILE_DUMP 7 // in RCX: buffer address, RDX: its size. RCX: bytes written, RDX: samples lost
+#define VMCALL_DIRTY_CONTROL 8 // in RCX: 1 starts, 0 stops tracking. RCX: DIRTY_MODE_*, RDX: bitmap size in bytes
+#define VMCALL_DIRTY_HARVEST 9 // in RCX: bitmap address, RDX: its size. RCX: bitmap size, RDX: dirty pages
+#define VMCALL_BLOG_DUMP 10 // in RCX: buffer address, RDX: its size. RCX: bytes needed, see blog.h
+#define VMCALL_COUNT 11
+#define VMCALL_MAX TELEMETRY_HYPERCALLS // size of the dispatch table
+
+// Status codes (RAX)
+#define HC_SUCCESS 0
+#define HC_ERR_UNKNOWN_CALL ((uint64_t)-1)
+#define HC_ERR_PRIVILEGE ((uint64_t)-2)
+#define HC_ERR_INVALID_ARG ((uint64_t)-3)
+#define HC_ERR_BUFFER_TOO_SMALL ((uint64_t)-4)
+#define HC_ERR_ACCESS ((uint64_t)-5) // a guest buffer the guest itself can't write
+#define HC_ERR_BUSY ((uint64_t)-6) // another CPU is in the same call, retry
+#define HC_IS_ERROR(status) ((status) >= HC_ERR_BUSY)
+
+// Call flags
+#define HC_KERNEL 0x1 // CPL 0 only
+#define HC_NO_RING 0x2 // VMCALL only, HC_ERR_INVALID_ARG from a submission ring
+
+typedef uint64_t (*hypercall_func)(GUEST_REGS * regs);
+
+typedef struct{
+  hypercall_func handler; // NULL: HC_ERR_UNKNOWN_CALL
+  uint32_t flags;
+  const char * name;
+} HYPERCALL;
+
+void hypercall_init(void);
+bool register_hypercall(uint32_t number, hypercall_func handler, uint32_t flags, const char * name);
+uint32_t guest_cpl(HVM * hvm);
+uint64_t hypercall_dispatch(GUEST_REGS * regs, bool from_ring);
+int handle_vmcall(GUEST_REGS * regs, uint64_t exit_reason);
+void hypercall_report(void);
+
+#endif
@@ -0,0 +1,179 @@
+#include "lib_uefi.h"
+#include "vmx_api.h"
+#include "vm_setup.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "regs.h"
+#include "tsc.h"
+#include "vpid.h"
+#include "inval.h"
+#include "blog.h"
+#include "dirty.h"
+
+/*
+
+EPT/VPID invalidation manager
+
+Changes to the shared EPT (or to guest mappings behind a VPID) are queued with inval_queue() and
+published together by inval_commit() as one new generation. Every CPU compares its generation
+with inval_generation at the end of each exit and catches up with one INVEPT/INVVPID per scope,
+no matter how many generations it missed - the skipped ones are counted as coalesced.
+
+A CPU running the guest only notices a new generation on its next exit. Commits that must be
+visible before they return (permissions taken away) kick the other CPUs with an NMI, which exits
+with NMI exiting on, or reaches host_nmi_handler in VMX root. A CPU has at most one kick in flight:
+inval_commit() only sends one when nmi_kick_generation equals nmi_kick_taken, and the first NMI
+the CPU takes after that is counted as the kick by inval_nmi_kick(). Every other NMI, and a kick
+that arrives late after the CPU already caught up on an ordinary exit, stays real and goes to the
+guest through nmi_sync().
+
+CPUs the hypervisor doesn't run on yet and guest CPUs still waiting for their SIPI are neither
+kicked nor waited for, they sync on their first exit before the guest runs any code on them.
+
+*/
+
+volatile uint64_t inval_generation;
+INVAL_STATE inval;
+LOCK_STATS inval_lock_stats = {"inval"};
+ticket_lock_t inval_lock = {0, 0, &inval_lock_stats};
+
+void inval_init(void){
+  lock_stats_register(&inval_lock_stats);
+}
+
+void inval_queue(uint32_t scope){
+  ticket_lock(&inval_lock);
+  inval.pending |= 1 << scope;
+  ++inval.queued;
+  ticket_unlock(&inval_lock);
+}
+
+// Catches up with inval_generation, called by vmexit_handler() before every VM entry
+void inval_sync(HVM * hvm){
+  uint64_t generation = inval_generation;
+  uint64_t seen = hvm->inval_generation;
+  INVEPT_DESCRIPTOR desc;
+
+  if(seen == generation){
+    return;
+  }
+
+  if(features.ept && hvm->st->ept_area){
+    desc.eptp = ept_pointer(hvm);
+    desc.reserved = 0;
+    if(inval.scope_generation[INVAL_EPT_ALL] > seen){
+      vmx_invept(INVEPT_ALL_CONTEXT, &desc);
+      ++hvm->inval_flushes;
+      if(inval.scope_generation[INVAL_EPT_SINGLE] > seen){
+        ++hvm->inval_coalesced; // Covered by the all-context flush
+      }
+    }
+    else if(inval.scope_generation[INVAL_EPT_SINGLE] > seen){
+      vmx_invept(INVEPT_SINGLE_CONTEXT, &desc);
+      ++hvm->inval_flushes;
+    }
+  }
+  if(inval.scope_generation[INVAL_VPID] > seen){
+    vpid_flush_context(hvm);
+    ++hvm->inval_flushes;
+  }
+
+  hvm->inval_coalesced += generation - seen - 1;
+  hvm->inval_generation = generation;
+}
+
+// Whether inval_commit() has to kick and wait for the CPU, see above
+bool inval_cpu_running(int cpu){
+  return cpu_online(cpu) && !cpu_hvm[cpu]->wait_for_sipi;
+}
+
+// Publishes the queued scopes as a new generation and flushes the current CPU. With sync the
+// other CPUs are kicked and waited for, so no stale translation survives the return.
+void inval_commit(HVM * hvm, bool sync){
+  uint64_t generation, deadline;
+  uint64_t taken;
+  HVM * other;
+  int cpu, scope, waiting;
+
+  ticket_lock(&inval_lock);
+  if(!inval.pending){
+    ticket_unlock(&inval_lock);
+    return;
+  }
+
+  generation = inval_generation + 1;
+  for(scope = 0; scope < INVAL_SCOPES; ++scope){
+    if(inval.pending & (1 << scope)){
+      inval.scope_generation[scope] = generation;
+    }
+  }
+  inval.pending = 0;
+  ++inval.commits;
+  inval_generation = generation; // Published after the scopes
+  ticket_unlock(&inval_lock);
+
+  inval_sync(hvm);
+  if(!sync){
+    return;
+  }
+
+  // Pairs with handle_sipi(): either it sees the generation or it is kicked and waited for
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  for(cpu = 0; cpu < CPU_count; ++cpu){
+    other = cpu_hvm[cpu];
+    if(other == hvm || other->inval_generation >= generation || !inval_cpu_running(cpu)) continue;
+    // A kick still in flight makes the CPU exit and catch up with this generation as well
+    taken = other->nmi_kick_taken;
+    if(__atomic_compare_exchange_n(&other->nmi_kick_generation, &taken, generation, false,
+      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+      send_ipi(other->apic_id, DM_NMI);
+      ++inval.kicks;
+    }
+  }
+
+  // CPUs in VMX root catch up before their next VM entry. One of them may be waiting here for a
+  // commit of its own, so this CPU keeps catching up with theirs, draining its log first as on exit.
+  deadline = get_tsc() + tsc_khz * INVAL_SYNC_TIMEOUT_US / 1000;
+  while(true){
+    waiting = 0;
+    for(cpu = 0; cpu < CPU_count; ++cpu){
+      if(cpu_hvm[cpu]->inval_generation < generation && inval_cpu_running(cpu)) ++waiting;
+    }
+    if(!waiting){
+      break;
+    }
+
+    dirty_sync(hvm);
+    inval_sync(hvm);
+    if(deadline && get_tsc() >= deadline){
+      deadline = 0; // Reported once, the stale translations may still be in use
+      ++inval.kick_timeouts;
+      BLOG_HVM(hvm, BLOG_WARN, BLOG_CAT_INVAL, "still waiting for %u CPUs to reach invalidation generation %u",
+        waiting, generation);
+    }
+  }
+}
+
+// True if an NMI this CPU took is the kick inval_commit() has in flight. Called before inval_sync()
+// on the same exit: either inval_commit() sees the kick taken and sends a new one, or inval_sync()
+// sees the generation it was sent for.
+bool inval_nmi_kick(HVM * hvm){
+  uint64_t kick = hvm->nmi_kick_generation;
+
+  if(kick == hvm->nmi_kick_taken){
+    return false;
+  }
+
+  __atomic_store_n(&hvm->nmi_kick_taken, kick, __ATOMIC_SEQ_CST);
+  return true;
+}
+
+void inval_report(HVM * hvm){
+  bsp_printf("%u: invalidation generation %u, %u flushes issued, %u coalesced, %u NMIs injected\r\n",
+    (uint64_t)hvm->cpu_id, hvm->inval_generation, hvm->inval_flushes, hvm->inval_coalesced, hvm->nmi_injected);
+  if(hvm == bsp_hvm){
+    bsp_printf("Invalidations: %u queued, %u commits, %u NMI kicks, %u timeouts, %u NMIs in root\r\n",
+      inval.queued, inval.commits, inval.kicks, inval.kick_timeouts, host_nmi_count);
+  }
+}
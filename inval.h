@@ -0,0 +1,38 @@
+#ifndef _INVAL_
+#define _INVAL_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmx_api.h"
+#include "spinlock.h"
+
+// Invalidation scopes for inval_queue()
+#define INVAL_EPT_SINGLE 0 // mappings derived from the shared EPT (INVEPT single-context)
+#define INVAL_EPT_ALL 1    // mappings of every EPTP (INVEPT all-context)
+#define INVAL_VPID 2       // guest linear mappings of every CPU's VPID
+#define INVAL_SCOPES 3
+
+#define INVAL_SYNC_TIMEOUT_US 1000 // inval_commit() logs CPUs it waits for longer, and keeps waiting
+
+typedef struct{
+  uint32_t pending; // bit n: scope n queued since the last commit
+  uint64_t scope_generation[INVAL_SCOPES]; // last generation that requested scope n
+  uint64_t queued;  // inval_queue() calls
+  uint64_t commits; // generations published
+  uint64_t kicks;   // NMIs sent for synchronous commits
+  uint64_t kick_timeouts; // commits that waited longer than INVAL_SYNC_TIMEOUT_US
+} INVAL_STATE;
+
+extern volatile uint64_t inval_generation; // also compared by the vmx_exit fast path
+extern INVAL_STATE inval;
+extern ticket_lock_t inval_lock;
+extern volatile uint64_t host_nmi_count;
+
+void inval_init(void);
+void inval_queue(uint32_t scope);
+void inval_commit(HVM * hvm, bool sync);
+void inval_sync(HVM * hvm);
+bool inval_nmi_kick(HVM * hvm);
+void inval_report(HVM * hvm);
+
+#endif
@@ -0,0 +1,144 @@
+#include "lib_uefi.h"
+#include "vmx_api.h"
+#include "vmx_emu.h"
+#include "string.h"
+#include "smp.h"
+#include "tsc.h"
+#include "spinlock.h"
+#include "telemetry.h"
+#include "vm_setup.h"
+#include "hypercall.h"
+#include "latency.h"
+
+/*
+
+VM exit latency histograms
+
+vmx_exit reads RDTSCP once all guest registers are saved and again after vmexit_handler()
+returns, then calls latency_record() with the second reading. Each CPU keeps a log2 histogram
+plus count, sum, min and max per basic exit reason in its state block: no locks, no allocations.
+Exits answered by the vmx_exit fast path aren't timed.
+
+A snapshot copies and zeroes every CPU's histograms. Per CPU it is atomic, every exit lands
+either in the snapshot or in the histograms that start afterwards.
+
+*/
+
+ticket_lock_t latency_lock = {0, 0, NULL}; // one snapshot at a time, never taken by latency_record()
+
+// table is zeroed, without RDTSCP the CPU isn't timed
+void latency_init(HVM * hvm, LATENCY_TABLE * table){
+  uint64_t rax = 0x80000001, rbx, rcx = 0, rdx;
+
+  hvm->latency = NULL;
+#if LATENCY_ENABLED
+  emu_cpuid(&rax, &rbx, &rcx, &rdx);
+  if(rdx & CPUID_EXT_RDTSCP){
+    hvm->latency = table;
+  }
+#endif
+}
+
+void latency_record(HVM * hvm, uint64_t end_tsc){
+  LATENCY_TABLE * table = hvm->latency;
+  uint32_t reason = hvm->telemetry->last_exit_reason & 0xFFFF;
+  uint64_t cycles = end_tsc - hvm->exit_start_tsc;
+  LATENCY_HIST * hist;
+  int bucket;
+
+  if(reason >= VMX_EXIT_REASON_COUNT){
+    return;
+  }
+
+  // Full barrier: either latency_snapshot() sees busy or this sees the new active set
+  __atomic_store_n(&table->busy, 1, __ATOMIC_SEQ_CST);
+  hist = &table->sets[table->active][reason];
+
+  ++hist->count;
+  hist->sum += cycles;
+  if(hist->count == 1 || cycles < hist->min){
+    hist->min = cycles;
+  }
+  if(cycles > hist->max){
+    hist->max = cycles;
+  }
+  bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+  ++hist->buckets[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1];
+
+  __atomic_store_n(&table->busy, 0, __ATOMIC_RELEASE);
+}
+
+uint64_t latency_snapshot_size(void){
+  return sizeof(LATENCY_SNAPSHOT_HEADER) + CPU_count * VMX_EXIT_REASON_COUNT * sizeof(LATENCY_HIST);
+}
+
+/*
+  Fills latency_snapshot_size() bytes of the guest buffer at gpa and starts every CPU over. The
+  buffer is checked here, not by the callers: it must be large enough and writable by the guest.
+  Returns a HC_* status. VMCALL_LATENCY_SNAPSHOT is kernel only, see hypercall_init().
+*/
+uint64_t latency_snapshot(HVM * hvm, uint64_t gpa, uint64_t size){
+  LATENCY_SNAPSHOT_HEADER * hdr = (LATENCY_SNAPSHOT_HEADER*)gpa;
+  LATENCY_HIST * out = (LATENCY_HIST*)(hdr + 1);
+  LATENCY_TABLE * table;
+  uint64_t old;
+  int cpu;
+
+  if(size < latency_snapshot_size()){
+    return HC_ERR_BUFFER_TOO_SMALL;
+  }
+  size = latency_snapshot_size();
+  if(!ept_guest_writable(hvm, gpa, size)){
+    return HC_ERR_ACCESS;
+  }
+
+  ticket_lock(&latency_lock);
+
+  hdr->magic = LATENCY_MAGIC;
+  hdr->cpu_count = CPU_count;
+  hdr->reasons = VMX_EXIT_REASON_COUNT;
+  hdr->buckets = LATENCY_BUCKETS;
+  hdr->reserved = 0;
+  hdr->tsc_khz = tsc_khz;
+
+  for(cpu = 0; cpu < CPU_count; ++cpu, out += VMX_EXIT_REASON_COUNT){
+    table = cpu_hvm[cpu]->latency;
+    if(!table){
+      ZeroMem(out, VMX_EXIT_REASON_COUNT * sizeof(LATENCY_HIST));
+      continue;
+    }
+
+    old = table->active;
+    __atomic_store_n(&table->active, old ^ 1, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(&table->busy, __ATOMIC_ACQUIRE)){
+      __builtin_ia32_pause();
+    }
+
+    CopyMem(out, table->sets[old], VMX_EXIT_REASON_COUNT * sizeof(LATENCY_HIST));
+    ZeroMem(table->sets[old], VMX_EXIT_REASON_COUNT * sizeof(LATENCY_HIST));
+    ++table->snapshots;
+  }
+
+  ticket_unlock(&latency_lock);
+  ept_guest_written(gpa, size);
+
+  return HC_SUCCESS;
+}
+
+// Reads the active set without stopping the CPU, good enough for a report
+void latency_report(HVM * hvm){
+  LATENCY_HIST * hist;
+  uint32_t reason;
+
+  if(!hvm->latency){
+    bsp_printf("%u: exits aren't timed\r\n", (uint64_t)hvm->cpu_id);
+    return;
+  }
+
+  for(reason = 0; reason < VMX_EXIT_REASON_COUNT; ++reason){
+    hist = &hvm->latency->sets[hvm->latency->active][reason];
+    if(!hist->count) continue;
+    bsp_printf("%u: exit %u: %u exits, cycles min %u avg %u max %u\r\n", (uint64_t)hvm->cpu_id,
+      (uint64_t)reason, hist->count, hist->min, hist->sum / hist->count, hist->max);
+  }
+}
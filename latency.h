@@ -0,0 +1,50 @@
+#ifndef _LATENCY_
+#define _LATENCY_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmx_api.h"
+
+#define LATENCY_ENABLED 1 // time every exit through vmexit_handler()
+#define LATENCY_BUCKETS 32 // bucket i counts [2^i, 2^(i+1)) cycles, the last one everything longer
+#define LATENCY_MAGIC 0x5954434E544C4742ULL // "BGLTNCY"
+
+#define CPUID_EXT_RDTSCP (1 << 27) // CPUID.80000001H:EDX
+
+typedef struct{
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[LATENCY_BUCKETS];
+} LATENCY_HIST;
+
+/*
+  Written only by the owning CPU. latency_snapshot() switches the CPU to the other set and waits
+  for busy to clear, after that the old set is quiescent and can be copied and zeroed.
+*/
+typedef struct _LATENCY_TABLE{
+  volatile uint64_t active; // set being written
+  volatile uint64_t busy;   // a record is being added to the active set
+  uint64_t snapshots;
+  uint64_t reserved[5];
+  LATENCY_HIST sets[2][VMX_EXIT_REASON_COUNT];
+} LATENCY_TABLE;
+
+// Written by VMCALL_LATENCY_SNAPSHOT, followed by LATENCY_HIST[reasons] for every CPU in MADT order
+typedef struct{
+  uint64_t magic;
+  uint32_t cpu_count;
+  uint32_t reasons;
+  uint32_t buckets;
+  uint32_t reserved;
+  uint64_t tsc_khz;
+} LATENCY_SNAPSHOT_HEADER;
+
+void latency_init(HVM * hvm, LATENCY_TABLE * table);
+void latency_record(HVM * hvm, uint64_t end_tsc);
+uint64_t latency_snapshot_size(void);
+uint64_t latency_snapshot(HVM * hvm, uint64_t gpa, uint64_t size);
+void latency_report(HVM * hvm);
+
+#endif
@@ -0,0 +1,118 @@
+#include "lib_uefi.h"
+#include "string.h"
+#include "logring.h"
+#include "console.h"
+
+/*
+
+Per-CPU log rings
+
+Every CPU but the BSP logs into its own ring, so APs never wait for each other or for the BSP.
+Records are variable length (header plus payload, 8-byte aligned) and never wrap: a record that
+doesn't fit before the end of data is preceded by a LOGRING_PAD record filling the rest.
+
+When the ring is full the new record is dropped and counted, the producer never blocks. Rings
+nobody drains (the binary log) are marked overwrite and lose their oldest records instead. The
+consumer reads everything up to the head it saw and then moves tail once for the whole batch.
+
+*/
+
+// Keeps the compiler from moving the payload stores past the head update, x86 keeps store order
+#define LOGRING_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+void logring_init(LOGRING * ring, uint64_t bytes){
+  ZeroMem(ring, sizeof(LOGRING));
+  ring->size = (bytes - sizeof(LOGRING)) & ~7ULL;
+}
+
+// Only for overwrite rings, where the producer owns tail as well
+void logring_discard(LOGRING * ring){
+  LOGRING_RECORD * rec = (LOGRING_RECORD*)(ring->data + ring->tail % ring->size);
+
+  if(rec->type != LOGRING_PAD){
+    ++ring->drops;
+  }
+  ring->tail += LOGRING_ALIGN(sizeof(LOGRING_RECORD) + rec->len);
+}
+
+bool logring_write(LOGRING * ring, uint16_t type, const void * payload, uint32_t len){
+  uint64_t head = ring->head;
+  uint64_t offset, need, contiguous, pad;
+  LOGRING_RECORD * rec;
+
+  if(len > LOGRING_RECORD_MAX){
+    len = LOGRING_RECORD_MAX;
+    ++ring->truncated;
+  }
+
+  need = LOGRING_ALIGN(sizeof(LOGRING_RECORD) + len);
+  offset = head % ring->size;
+  contiguous = ring->size - offset;
+  pad = contiguous < need ? contiguous : 0;
+
+  while(head + pad + need - ring->tail > ring->size){
+    if(!ring->overwrite){
+      ++ring->drops;
+      return false;
+    }
+    logring_discard(ring);
+  }
+
+  if(pad){
+    rec = (LOGRING_RECORD*)(ring->data + offset);
+    rec->type = LOGRING_PAD;
+    rec->len = pad - sizeof(LOGRING_RECORD);
+    head += pad;
+    offset = 0;
+  }
+
+  rec = (LOGRING_RECORD*)(ring->data + offset);
+  rec->type = type;
+  rec->len = len;
+  rec->reserved = 0;
+  if(len){
+    CopyMem(rec + 1, (void*)payload, len);
+  }
+
+  LOGRING_BARRIER();
+  ring->head = head + need;
+  ++ring->records;
+
+  return true;
+}
+
+// Prints every record written so far, returns the number of records consumed
+uint32_t logring_drain(LOGRING * ring){
+  uint64_t head = ring->head;
+  uint64_t tail = ring->tail;
+  LOGRING_RECORD * rec;
+  uint32_t count = 0;
+
+  LOGRING_BARRIER();
+  while(tail < head){
+    rec = (LOGRING_RECORD*)(ring->data + tail % ring->size);
+
+    if(rec->type == LOGRING_TEXT){
+      console_write((char*)(rec + 1), rec->len);
+    }
+    else if(rec->type == LOGRING_END){
+      ring->ended = true;
+    }
+    if(rec->type != LOGRING_PAD){
+      ++count;
+    }
+
+    tail += LOGRING_ALIGN(sizeof(LOGRING_RECORD) + rec->len);
+  }
+
+  LOGRING_BARRIER();
+  ring->tail = tail;
+  ring->drained += count;
+
+  return count;
+}
+
+void logring_report(LOGRING * ring, uint32_t cpu){
+  printf("%u: log ring %u records, %u drained, %u dropped, %u truncated\r\n",
+    (uint64_t)cpu, ring->records, ring->drained, ring->drops, ring->truncated);
+}
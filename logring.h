@@ -0,0 +1,50 @@
+#ifndef _LOGRING_
+#define _LOGRING_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define LOGRING_PAGES 4 // per CPU, header included
+#define LOGRING_RECORD_MAX 512 // longer messages are truncated and counted
+
+// Record types
+#define LOGRING_TEXT 1
+#define LOGRING_END 2 // the AP is done starting up
+#define LOGRING_PAD 3 // filler up to the end of the ring, skipped by the reader
+#define LOGRING_BINARY 4 // BLOG_RECORD, decoded offline by tools/blogdec
+
+#define LOGRING_ALIGN(n) (((n) + 7) & ~7ULL)
+
+typedef struct{
+  uint16_t type;
+  uint16_t len; // payload bytes following the header
+  uint32_t reserved;
+} LOGRING_RECORD;
+
+/*
+  Single producer (the owning CPU), single consumer (the BSP). head and tail count bytes since the
+  start and only grow, the offset into data is head % size. They sit on separate cache lines so the
+  producer and the consumer don't share one.
+*/
+typedef struct _LOGRING{
+  volatile uint64_t head; // written by the producer only
+  uint64_t records;  // records written
+  uint64_t drops;    // records lost to a full ring
+  uint64_t truncated; // records cut to LOGRING_RECORD_MAX
+  uint64_t size;     // bytes in data
+  bool overwrite;    // no consumer, a full ring drops its oldest records instead of the new one
+  uint64_t reserved1[2];
+  volatile uint64_t tail; // written by the consumer only
+  uint64_t drained;  // records read
+  bool ended;        // LOGRING_END seen by the consumer
+  uint64_t reserved2[5];
+  uint8_t data[];
+} LOGRING;
+
+void logring_init(LOGRING * ring, uint64_t bytes);
+void logring_discard(LOGRING * ring);
+bool logring_write(LOGRING * ring, uint16_t type, const void * payload, uint32_t len);
+uint32_t logring_drain(LOGRING * ring);
+void logring_report(LOGRING * ring, uint32_t cpu);
+
+#endif
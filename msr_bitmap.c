@@ -0,0 +1,135 @@
+#include "lib_uefi.h"
+#include "vmx_api.h"
+#include "msr_bitmap.h"
+#include "smp.h"
+
+/*
+
+MSR bitmap layout (Intel SDM 24.6.9)
+
+0x000 - 0x3FF  read bitmap for MSRs 0x00000000 - 0x00001FFF
+0x400 - 0x7FF  read bitmap for MSRs 0xC0000000 - 0xC0001FFF
+0x800 - 0xBFF  write bitmap for MSRs 0x00000000 - 0x00001FFF
+0xC00 - 0xFFF  write bitmap for MSRs 0xC0000000 - 0xC0001FFF
+
+A set bit causes a VM exit, a clear bit lets RDMSR/WRMSR go straight to the hardware.
+MSRs outside of both ranges always cause a VM exit.
+
+*/
+
+// MSRs virtualized by handle_msr_read()/handle_msr_write()
+uint32_t default_msr_intercepts[] = {
+  MSR_IA32_SYSENTER_CS,
+  MSR_IA32_SYSENTER_ESP,
+  MSR_IA32_SYSENTER_EIP,
+  MSR_EFER,
+  MSR_FS_BASE,
+  MSR_GS_BASE
+};
+
+uint8_t * msr_bitmap_byte(HVM * hvm, uint32_t msr, int write, uint8_t * bit){
+  uint64_t offset = write ? 0x800 : 0;
+
+  if(msr >= MSR_HIGH_FIRST && msr <= MSR_HIGH_LAST){
+    offset += 0x400;
+    msr -= MSR_HIGH_FIRST;
+  }
+  else if(msr > MSR_LOW_LAST){
+    return NULL;
+  }
+
+  *bit = 1 << (msr & 7);
+  return (uint8_t*)(hvm->msr_bitmap + offset + (msr >> 3));
+}
+
+int msr_bitmap_update(HVM * hvm, uint32_t msr, int access, bool intercept){
+  uint8_t * byte;
+  uint8_t bit;
+  int write;
+
+  for(write = 0; write < 2; ++write){
+    if(!(access & (write ? MSR_WRITE : MSR_READ))) continue;
+
+    byte = msr_bitmap_byte(hvm, msr, write, &bit);
+    if(!byte){
+      return 0; // Not covered by the bitmap, always intercepted
+    }
+
+    if(intercept && !(*byte & bit)){
+      *byte |= bit;
+      ++hvm->msr_intercepts;
+    }
+    else if(!intercept && (*byte & bit)){
+      *byte &= ~bit;
+      --hvm->msr_intercepts;
+    }
+  }
+
+  return 1;
+}
+
+int msr_intercept(HVM * hvm, uint32_t msr, int access){
+  return msr_bitmap_update(hvm, msr, access, true);
+}
+
+int msr_passthrough(HVM * hvm, uint32_t msr, int access){
+  return msr_bitmap_update(hvm, msr, access, false);
+}
+
+int msr_intercept_range(HVM * hvm, uint32_t first, uint32_t last, int access){
+  uint32_t msr;
+
+  for(msr = first; msr <= last && msr >= first; ++msr){
+    if(!msr_bitmap_update(hvm, msr, access, true)) return 0;
+  }
+
+  return 1;
+}
+
+int msr_passthrough_range(HVM * hvm, uint32_t first, uint32_t last, int access){
+  uint32_t msr;
+
+  for(msr = first; msr <= last && msr >= first; ++msr){
+    if(!msr_bitmap_update(hvm, msr, access, false)) return 0;
+  }
+
+  return 1;
+}
+
+bool msr_intercepted(HVM * hvm, uint32_t msr, int access){
+  uint8_t * byte;
+  uint8_t bit;
+
+  if(access & MSR_READ){
+    byte = msr_bitmap_byte(hvm, msr, 0, &bit);
+    if(!byte || (*byte & bit)) return true;
+  }
+  if(access & MSR_WRITE){
+    byte = msr_bitmap_byte(hvm, msr, 1, &bit);
+    if(!byte || (*byte & bit)) return true;
+  }
+
+  return false;
+}
+
+// Must be called on the CPU owning the currently active VMCS
+void msr_bitmap_init(HVM * hvm){
+  uint32_t i;
+
+  ZeroMem((void*)hvm->msr_bitmap, 4096);
+  hvm->msr_intercepts = 0;
+  hvm->msr_read_exits = 0;
+  hvm->msr_write_exits = 0;
+
+  for(i = 0; i < sizeof(default_msr_intercepts) / sizeof(default_msr_intercepts[0]); ++i){
+    msr_intercept(hvm, default_msr_intercepts[i], MSR_RW);
+  }
+
+  vmx_write(MSR_BITMAP, hvm->msr_bitmap & 0xFFFFFFFF);
+  vmx_write(MSR_BITMAP_HIGH, hvm->msr_bitmap >> 32);
+}
+
+void msr_bitmap_report(HVM * hvm){
+  bsp_printf("%u: MSR bitmap at %x, %u intercepts, exits: %u RDMSR / %u WRMSR\r\n",
+    (uint64_t)hvm->cpu_id, hvm->msr_bitmap, (uint64_t)hvm->msr_intercepts, hvm->msr_read_exits, hvm->msr_write_exits);
+}
@@ -0,0 +1,27 @@
+#ifndef _MSR_BITMAP_
+#define _MSR_BITMAP_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmx_api.h"
+
+// Access types for msr_intercept()/msr_passthrough()
+#define MSR_READ 1
+#define MSR_WRITE 2
+#define MSR_RW (MSR_READ | MSR_WRITE)
+
+// The 4 KB MSR bitmap covers two MSR ranges, everything else always exits
+#define MSR_LOW_FIRST 0x00000000
+#define MSR_LOW_LAST 0x00001FFF
+#define MSR_HIGH_FIRST 0xC0000000
+#define MSR_HIGH_LAST 0xC0001FFF
+
+void msr_bitmap_init(HVM * hvm);
+int msr_intercept(HVM * hvm, uint32_t msr, int access);
+int msr_passthrough(HVM * hvm, uint32_t msr, int access);
+int msr_intercept_range(HVM * hvm, uint32_t first, uint32_t last, int access);
+int msr_passthrough_range(HVM * hvm, uint32_t first, uint32_t last, int access);
+bool msr_intercepted(HVM * hvm, uint32_t msr, int access);
+void msr_bitmap_report(HVM * hvm);
+
+#endif
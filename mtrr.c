@@ -0,0 +1,120 @@
+#include "regs.h"
+#include "mtrr.h"
+
+/*
+
+MTRR memory type resolver for EPT
+
+The EPT memory type replaces the MTRR type for guest accesses, so every EPT leaf gets the type
+the MTRRs assign to its range (Intel SDM 11.11). mtrr_range_type() only works on MTRR_STATE,
+which is filled in from the MSRs by mtrr_read() or by hand with a synthetic MTRR set.
+
+Ranges are naturally aligned powers of two (4 KB, 2 MB, 1 GB leaves). A range is uniform if every
+variable MTRR either matches all of it or none of it, and - below 1 MB with the fixed MTRRs
+enabled - if all of the overlapped fixed ranges have the same type.
+
+*/
+
+MTRR_STATE mtrr_state;
+
+void mtrr_read(MTRR_STATE * state){
+  uint64_t cap = get_msr(MSR_IA32_MTRRCAP);
+  uint64_t def_type = get_msr(MSR_IA32_MTRR_DEF_TYPE);
+  uint64_t fixed;
+  uint32_t i, j, msr;
+
+  state->enabled = def_type & MTRR_DEF_TYPE_E;
+  state->fixed_enabled = (cap & MTRRCAP_FIX) && (def_type & MTRR_DEF_TYPE_FE);
+  state->def_type = def_type & 0xFF;
+
+  state->var_count = cap & MTRRCAP_VCNT;
+  if(state->var_count > MTRR_MAX_VARIABLE){
+    state->var_count = MTRR_MAX_VARIABLE;
+  }
+  for(i = 0; i < state->var_count; ++i){
+    state->var[i].base = get_msr(MSR_IA32_MTRR_PHYSBASE0 + 2 * i);
+    state->var[i].mask = get_msr(MSR_IA32_MTRR_PHYSBASE0 + 2 * i + 1);
+  }
+
+  if(state->fixed_enabled){
+    // 1 x FIX64K, 2 x FIX16K, 8 x FIX4K, one type per byte
+    for(i = 0; i < MTRR_FIXED_RANGES / 8; ++i){
+      if(i == 0) msr = MSR_IA32_MTRR_FIX64K_00000;
+      else if(i < 3) msr = MSR_IA32_MTRR_FIX16K_80000 + i - 1;
+      else msr = MSR_IA32_MTRR_FIX4K_C0000 + i - 3;
+
+      fixed = get_msr(msr);
+      for(j = 0; j < 8; ++j){
+        state->fixed[i * 8 + j] = (fixed >> (j * 8)) & 0xFF;
+      }
+    }
+  }
+}
+
+// Index into MTRR_STATE.fixed for an address below 1 MB
+uint32_t mtrr_fixed_index(uint64_t addr){
+  if(addr < 0x80000) return addr >> 16;                   // 64 KB ranges
+  if(addr < 0xC0000) return 8 + ((addr - 0x80000) >> 14); // 16 KB ranges
+  return 24 + ((addr - 0xC0000) >> 12);                   // 4 KB ranges
+}
+
+// Type of the variable MTRRs for [base, base + size), or MTRR_TYPE_MIXED
+uint8_t mtrr_variable_type(MTRR_STATE * state, uint64_t base, uint64_t size){
+  uint8_t type = MTRR_TYPE_MIXED; // no match yet
+  uint8_t var_type;
+  uint64_t mask;
+  uint32_t i;
+
+  for(i = 0; i < state->var_count; ++i){
+    if(!(state->var[i].mask & MTRR_PHYSMASK_VALID)) continue;
+
+    mask = state->var[i].mask & ~0xFFFULL;
+    if((base ^ state->var[i].base) & mask & ~(size - 1)){
+      continue; // Matches no address in the range
+    }
+    if(mask & (size - 1)){
+      return MTRR_TYPE_MIXED; // Matches only part of the range
+    }
+
+    // Overlapping ranges: UC wins, WT wins over WB, anything else is undefined - use UC
+    var_type = state->var[i].base & 0xFF;
+    if(type == MTRR_TYPE_MIXED || type == var_type){
+      type = var_type;
+    }
+    else if((type == MTRR_TYPE_WT && var_type == MTRR_TYPE_WB) || (type == MTRR_TYPE_WB && var_type == MTRR_TYPE_WT)){
+      type = MTRR_TYPE_WT;
+    }
+    else{
+      type = MTRR_TYPE_UC;
+    }
+  }
+
+  return type == MTRR_TYPE_MIXED ? state->def_type : type;
+}
+
+uint8_t mtrr_range_type(MTRR_STATE * state, uint64_t base, uint64_t size){
+  uint64_t addr, end;
+  uint8_t type;
+
+  if(!state->enabled){
+    return MTRR_TYPE_UC;
+  }
+
+  // The fixed ranges take precedence over the variable ones below 1 MB
+  if(state->fixed_enabled && base < MTRR_FIXED_END){
+    type = state->fixed[mtrr_fixed_index(base)];
+    end = base + size < MTRR_FIXED_END ? base + size : MTRR_FIXED_END;
+    for(addr = base; addr < end; addr += 0x1000){
+      if(state->fixed[mtrr_fixed_index(addr)] != type){
+        return MTRR_TYPE_MIXED;
+      }
+    }
+    if(base + size <= MTRR_FIXED_END){
+      return type;
+    }
+    // Rest of a larger range is covered by the variable MTRRs
+    return mtrr_variable_type(state, base, size) == type ? type : MTRR_TYPE_MIXED;
+  }
+
+  return mtrr_variable_type(state, base, size);
+}
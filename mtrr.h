@@ -0,0 +1,52 @@
+#ifndef _MTRR_
+#define _MTRR_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MSR_IA32_MTRRCAP 0xFE
+#define MSR_IA32_MTRR_DEF_TYPE 0x2FF
+#define MSR_IA32_MTRR_PHYSBASE0 0x200 // PHYSBASEn = 0x200 + 2n, PHYSMASKn = 0x201 + 2n
+#define MSR_IA32_MTRR_FIX64K_00000 0x250
+#define MSR_IA32_MTRR_FIX16K_80000 0x258
+#define MSR_IA32_MTRR_FIX16K_A0000 0x259
+#define MSR_IA32_MTRR_FIX4K_C0000 0x268 // up to MSR_IA32_MTRR_FIX4K_F8000 0x26F
+
+#define MTRRCAP_VCNT 0xFF
+#define MTRRCAP_FIX (1 << 8)
+#define MTRR_DEF_TYPE_FE (1 << 10)
+#define MTRR_DEF_TYPE_E (1 << 11)
+#define MTRR_PHYSMASK_VALID (1 << 11)
+
+// Memory types, same encoding in MTRRs, PAT and EPT entries
+#define MTRR_TYPE_UC 0
+#define MTRR_TYPE_WC 1
+#define MTRR_TYPE_WT 4
+#define MTRR_TYPE_WP 5
+#define MTRR_TYPE_WB 6
+#define MTRR_TYPE_MIXED 0xFF // returned by mtrr_range_type() if the range has more than one type
+
+#define MTRR_MAX_VARIABLE 32
+#define MTRR_FIXED_RANGES 88 // 8 x 64 KB, 16 x 16 KB, 64 x 4 KB below 1 MB
+#define MTRR_FIXED_END 0x100000
+
+typedef struct{
+  uint64_t base; // PHYSBASE, type in 7:0
+  uint64_t mask; // PHYSMASK, valid in 11
+} MTRR_VARIABLE;
+
+typedef struct{
+  bool enabled;
+  bool fixed_enabled;
+  uint8_t def_type;
+  uint8_t fixed[MTRR_FIXED_RANGES];
+  uint32_t var_count;
+  MTRR_VARIABLE var[MTRR_MAX_VARIABLE];
+} MTRR_STATE;
+
+extern MTRR_STATE mtrr_state;
+
+void mtrr_read(MTRR_STATE * state);
+uint8_t mtrr_range_type(MTRR_STATE * state, uint64_t base, uint64_t size);
+
+#endif
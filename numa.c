@@ -0,0 +1,275 @@
+#include "lib_uefi.h"
+#include "string.h"
+#include "smp.h"
+#include "numa.h"
+
+/*
+
+NUMA placement from the ACPI SRAT and SLIT
+
+The SRAT assigns every processor (by APIC ID) and every memory range a proximity domain, the
+optional SLIT gives the relative distance between domains. numa_alloc_pages() takes pages from
+free memory of the requested domain and falls back to the nearest domain that has room, so per-CPU
+hypervisor state ends up next to the CPU that uses it on every VM exit.
+
+Without an SRAT every CPU is in NUMA_NO_DOMAIN and allocations behave like AllocateAnyPages.
+
+*/
+
+#define NUMA_REMOTE_DISTANCE 20 // assumed between domains when there is no SLIT
+#define NUMA_LOW_MEMORY 0x100000 // leave the first MB to the AP trampoline and legacy users
+
+uint32_t * cpu_domain;
+NUMA_RANGE * numa_ranges;
+uint64_t numa_locality_count;
+uint8_t * numa_distances;
+NUMA_STATS numa_stats;
+
+// Returns the number of enabled memory ranges, with fill set the CPU and memory tables are filled in
+uint32_t numa_read_srat(SRAT * srat, bool fill){
+  uint8_t * ptr = (uint8_t*)&srat->entries[0];
+  uint8_t * end = (uint8_t*)srat + srat->h.Length;
+  uint32_t ranges = 0;
+  int cpu;
+
+  while(ptr < end){
+    APICStructHeader * hdr = (APICStructHeader*)ptr;
+
+    if(hdr->Length == 0){
+      break;
+    }
+
+    if(hdr->Type == TypeSratProcLocalAPIC){
+      EntrySratProcLocalAPIC * entry = (EntrySratProcLocalAPIC*)hdr;
+
+      cpu = smp_cpu_index(entry->APIC_ID);
+      if(fill && (entry->Flags & SRAT_ENABLED) && cpu >= 0){
+        cpu_domain[cpu] = entry->ProximityDomainLow | (entry->ProximityDomainHigh[0] << 8) |
+          (entry->ProximityDomainHigh[1] << 16) | ((uint32_t)entry->ProximityDomainHigh[2] << 24);
+      }
+    }
+    else if(hdr->Type == TypeSratProcLocal_x2APIC){
+      EntrySratProcLocal_x2APIC * entry = (EntrySratProcLocal_x2APIC*)hdr;
+
+      cpu = smp_cpu_index(entry->x2APIC_ID);
+      if(fill && (entry->Flags & SRAT_ENABLED) && cpu >= 0){
+        cpu_domain[cpu] = entry->ProximityDomain;
+      }
+    }
+    else if(hdr->Type == TypeSratMemory){
+      EntrySratMemory * entry = (EntrySratMemory*)hdr;
+
+      if((entry->Flags & SRAT_ENABLED) && entry->Length){
+        if(fill){
+          numa_ranges[ranges].start = entry->Base;
+          numa_ranges[ranges].end = entry->Base + entry->Length;
+          numa_ranges[ranges].domain = entry->ProximityDomain;
+        }
+        ++ranges;
+      }
+    }
+
+    ptr += hdr->Length;
+  }
+
+  return ranges;
+}
+
+int numa_init(SRAT * srat, SLIT * slit){
+  EFI_STATUS st;
+  uint32_t i, j;
+  UINTN size;
+
+  st = BS->AllocatePool(EfiRuntimeServicesData, CPU_count * sizeof(uint32_t), (void**)&cpu_domain);
+  if(st != EFI_SUCCESS){
+    cpu_domain = NULL;
+    return 0;
+  }
+  for(i = 0; i < CPU_count; ++i){
+    cpu_domain[i] = NUMA_NO_DOMAIN;
+  }
+
+  if(!srat){
+    return 1;
+  }
+
+  numa_stats.ranges = numa_read_srat(srat, false);
+  if(numa_stats.ranges){
+    st = BS->AllocatePool(EfiRuntimeServicesData, numa_stats.ranges * sizeof(NUMA_RANGE), (void**)&numa_ranges);
+    if(st != EFI_SUCCESS){
+      numa_stats.ranges = 0;
+      return 0;
+    }
+  }
+  numa_read_srat(srat, true);
+
+  for(i = 0; i < numa_stats.ranges; ++i){
+    for(j = 0; j < i && numa_ranges[j].domain != numa_ranges[i].domain; ++j);
+    if(j == i){
+      ++numa_stats.domains;
+    }
+  }
+
+  // The SLIT lives in ACPI memory the OS may reclaim, keep a copy
+  if(slit && slit->Localities && slit->Localities <= 0xFFFF){
+    size = slit->Localities * slit->Localities;
+    if(sizeof(SDTHeader) + 8 + size <= slit->h.Length &&
+       BS->AllocatePool(EfiRuntimeServicesData, size, (void**)&numa_distances) == EFI_SUCCESS){
+      CopyMem(numa_distances, slit->Entry, size);
+      numa_locality_count = slit->Localities;
+    }
+    else{
+      numa_distances = NULL;
+    }
+  }
+
+  return 1;
+}
+
+uint32_t numa_addr_domain(uint64_t addr){
+  uint32_t i;
+
+  for(i = 0; i < numa_stats.ranges; ++i){
+    if(addr >= numa_ranges[i].start && addr < numa_ranges[i].end){
+      return numa_ranges[i].domain;
+    }
+  }
+
+  return NUMA_NO_DOMAIN;
+}
+
+uint32_t numa_distance(uint32_t from, uint32_t to){
+  if(from == to){
+    return NUMA_LOCAL_DISTANCE;
+  }
+  if(numa_distances && from < numa_locality_count && to < numa_locality_count){
+    return numa_distances[from * numa_locality_count + to];
+  }
+
+  return NUMA_REMOTE_DISTANCE;
+}
+
+// Allocates at the top of the first free stretch of domain memory that fits
+EFI_STATUS numa_alloc_in_domain(uint32_t domain, UINTN pages, EFI_PHYSICAL_ADDRESS * addr){
+  UINTN mem_map_size = 0;
+  UINTN map_key, desc_size;
+  UINT32 desc_version;
+  EFI_MEMORY_DESCRIPTOR * mem_map = NULL;
+  EFI_MEMORY_DESCRIPTOR * desc;
+  EFI_STATUS st;
+  EFI_PHYSICAL_ADDRESS candidate;
+  uint64_t start, end;
+  uint32_t i;
+
+  BS->GetMemoryMap(&mem_map_size, mem_map, &map_key, &desc_size, &desc_version);
+  mem_map_size += 4 * desc_size; // Room for the descriptors our own pool allocation adds
+  if(BS->AllocatePool(EfiBootServicesData, mem_map_size, (void**)&mem_map) != EFI_SUCCESS){
+    return EFI_OUT_OF_RESOURCES;
+  }
+  st = BS->GetMemoryMap(&mem_map_size, mem_map, &map_key, &desc_size, &desc_version);
+  if(st != EFI_SUCCESS){
+    BS->FreePool(mem_map);
+    return st;
+  }
+
+  st = EFI_NOT_FOUND;
+  for(desc = mem_map; (uint8_t*)desc < (uint8_t*)mem_map + mem_map_size && st != EFI_SUCCESS;
+      desc = (EFI_MEMORY_DESCRIPTOR*)((uint8_t*)desc + desc_size)){
+    if(desc->Type != EfiConventionalMemory) continue;
+
+    for(i = 0; i < numa_stats.ranges; ++i){
+      if(numa_ranges[i].domain != domain) continue;
+
+      start = desc->PhysicalStart > numa_ranges[i].start ? desc->PhysicalStart : numa_ranges[i].start;
+      if(start < NUMA_LOW_MEMORY){
+        start = NUMA_LOW_MEMORY;
+      }
+      end = desc->PhysicalStart + desc->NumberOfPages * 4096;
+      if(end > numa_ranges[i].end){
+        end = numa_ranges[i].end & ~0xFFFULL;
+      }
+      if(end <= start || end - start < pages * 4096) continue;
+
+      candidate = end - pages * 4096;
+      if(BS->AllocatePages(AllocateAddress, EfiRuntimeServicesData, pages, &candidate) == EFI_SUCCESS){
+        *addr = candidate;
+        st = EFI_SUCCESS;
+        break;
+      }
+    }
+  }
+
+  BS->FreePool(mem_map);
+  return st;
+}
+
+/*
+  Tries the domains in order of their distance from the requested one (ties by domain number),
+  the requested domain itself comes first with NUMA_LOCAL_DISTANCE.
+*/
+EFI_STATUS numa_alloc_pages(uint32_t domain, UINTN pages, EFI_PHYSICAL_ADDRESS * addr){
+  uint32_t last_dist = 0, last_dom = 0;
+  uint32_t best_dist, best_dom, dist, i;
+  bool first = true;
+
+  if(domain != NUMA_NO_DOMAIN){
+    while(true){
+      best_dist = 0xFFFFFFFF;
+      best_dom = NUMA_NO_DOMAIN;
+      for(i = 0; i < numa_stats.ranges; ++i){
+        dist = numa_distance(domain, numa_ranges[i].domain);
+        if(!first && (dist < last_dist || (dist == last_dist && numa_ranges[i].domain <= last_dom))) continue;
+        if(dist < best_dist || (dist == best_dist && numa_ranges[i].domain < best_dom)){
+          best_dist = dist;
+          best_dom = numa_ranges[i].domain;
+        }
+      }
+      if(best_dom == NUMA_NO_DOMAIN){
+        break;
+      }
+
+      if(numa_alloc_in_domain(best_dom, pages, addr) == EFI_SUCCESS){
+        if(best_dom == domain){
+          ++numa_stats.local_allocs;
+        }
+        else{
+          ++numa_stats.near_allocs;
+        }
+        return EFI_SUCCESS;
+      }
+
+      first = false;
+      last_dist = best_dist;
+      last_dom = best_dom;
+    }
+  }
+
+  ++numa_stats.any_allocs;
+  return BS->AllocatePages(AllocateAnyPages, EfiRuntimeServicesData, pages, addr);
+}
+
+void numa_report(void){
+  uint32_t i, j;
+
+  printf("NUMA: %u proximity domains, %u memory ranges\r\n", (uint64_t)numa_stats.domains, (uint64_t)numa_stats.ranges);
+  for(i = 0; i < numa_stats.ranges; ++i){
+    printf("  domain %u: %x - %x\r\n", (uint64_t)numa_ranges[i].domain, numa_ranges[i].start, numa_ranges[i].end);
+  }
+
+  if(numa_distances && numa_locality_count <= 8){
+    printf("  SLIT:\r\n");
+    for(i = 0; i < numa_locality_count; ++i){
+      printf("   ");
+      for(j = 0; j < numa_locality_count; ++j){
+        printf(" %u", (uint64_t)numa_distance(i, j));
+      }
+      printf("\r\n");
+    }
+  }
+  else if(numa_distances){
+    printf("  SLIT: %u localities\r\n", numa_locality_count);
+  }
+
+  printf("  per-CPU allocations: %u local, %u nearest remote, %u anywhere\r\n",
+    numa_stats.local_allocs, numa_stats.near_allocs, numa_stats.any_allocs);
+}
@@ -0,0 +1,92 @@
+#ifndef _NUMA_
+#define _NUMA_
+
+#include <efi.h>
+#include <efilib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "smp.h"
+
+#define NUMA_NO_DOMAIN 0xFFFFFFFF
+#define NUMA_LOCAL_DISTANCE 10 // SLIT distance of a domain to itself
+
+// SRAT structure types (ACPI 6.x 5.2.16)
+enum{
+  TypeSratProcLocalAPIC,
+  TypeSratMemory,
+  TypeSratProcLocal_x2APIC
+};
+
+#define SRAT_ENABLED 1 // flags bit 0 of all three structures
+
+typedef struct _SRAT{
+  SDTHeader h;
+  uint32_t reserved1;
+  uint64_t reserved2;
+  APICStructHeader entries[1];
+} __attribute__((packed)) SRAT;
+
+typedef struct _EntrySratProcLocalAPIC{
+  APICStructHeader h;
+  uint8_t ProximityDomainLow;
+  uint8_t APIC_ID;
+  uint32_t Flags;
+  uint8_t LocalSAPIC_EID;
+  uint8_t ProximityDomainHigh[3];
+  uint32_t ClockDomain;
+} __attribute__((packed)) EntrySratProcLocalAPIC;
+
+typedef struct _EntrySratMemory{
+  APICStructHeader h;
+  uint32_t ProximityDomain;
+  uint16_t reserved1;
+  uint64_t Base;
+  uint64_t Length;
+  uint32_t reserved2;
+  uint32_t Flags;
+  uint64_t reserved3;
+} __attribute__((packed)) EntrySratMemory;
+
+typedef struct _EntrySratProcLocal_x2APIC{
+  APICStructHeader h;
+  uint16_t reserved1;
+  uint32_t ProximityDomain;
+  uint32_t x2APIC_ID;
+  uint32_t Flags;
+  uint32_t ClockDomain;
+  uint32_t reserved2;
+} __attribute__((packed)) EntrySratProcLocal_x2APIC;
+
+typedef struct _SLIT{
+  SDTHeader h;
+  uint64_t Localities;
+  uint8_t Entry[1]; // Localities * Localities distances
+} __attribute__((packed)) SLIT;
+
+typedef struct{
+  uint64_t start;
+  uint64_t end;
+  uint32_t domain;
+} NUMA_RANGE;
+
+typedef struct{
+  uint32_t ranges;
+  uint32_t domains; // distinct proximity domains owning memory
+  uint64_t local_allocs; // numa_alloc_pages() served by the requested domain
+  uint64_t near_allocs;  // served by the nearest other domain
+  uint64_t any_allocs;   // no domain had room, AllocateAnyPages
+} NUMA_STATS;
+
+extern uint32_t * cpu_domain; // proximity domain per CPU (MADT order), NUMA_NO_DOMAIN without SRAT
+extern NUMA_RANGE * numa_ranges;
+extern uint64_t numa_locality_count;
+extern uint8_t * numa_distances; // SLIT matrix, NULL without SLIT
+extern NUMA_STATS numa_stats;
+
+int numa_init(SRAT * srat, SLIT * slit);
+uint32_t numa_addr_domain(uint64_t addr);
+uint32_t numa_distance(uint32_t from, uint32_t to);
+EFI_STATUS numa_alloc_pages(uint32_t domain, UINTN pages, EFI_PHYSICAL_ADDRESS * addr);
+void numa_report(void);
+
+#endif
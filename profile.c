@@ -0,0 +1,300 @@
+#include "lib_uefi.h"
+#include "vmx_api.h"
+#include "vm_setup.h"
+#include "vmcs_cache.h"
+#include "regs.h"
+#include "hv_handlers.h"
+#include "string.h"
+#include "smp.h"
+#include "tsc.h"
+#include "spinlock.h"
+#include "telemetry.h"
+#include "hypercall.h"
+#include "profile.h"
+
+/*
+
+Guest sampling profiler
+
+The VMX-preemption timer counts down while the guest runs and exits when it reaches zero. With
+"save VMX-preemption timer value" on, the count carries over other exits, so a sample is taken
+every period of guest time no matter how often the guest exits otherwise. Each sample records
+guest RIP, CR3, CPL and mode and what the guest exited for before, into a ring of the CPU.
+
+VMCALL_PROFILE_CONTROL sets the rate, every CPU picks it up in profile_sync() on its next exit
+through vmexit_handler(). VMCALL_PROFILE_DUMP drains the rings into a guest buffer, tools/proffold
+turns dumps into folded stacks for flame graphs.
+
+The cost of a sample is the time in profile_sample() plus the exit itself, which
+profile_calibrate() measures from the guest once the BSP runs it. Every PROFILE_ADJUST_SAMPLES
+samples a CPU checks the cost against PROFILE_MAX_OVERHEAD and stretches its period if needed.
+
+*/
+
+volatile uint64_t profile_generation = PROFILE_DEFAULT_HZ != 0; // bumped whenever profile_hz changes
+uint32_t profile_hz = PROFILE_DEFAULT_HZ;
+uint32_t profile_timer_shift; // TSC cycles per timer tick are 1 << profile_timer_shift
+ticket_lock_t profile_lock = {0, 0, NULL}; // one dump at a time
+uint64_t profile_exit_cycles; // VM exit and entry around profile_sample(), 0 until calibrated
+
+// ring is zeroed, without a preemption timer that can be saved on exits the CPU isn't sampled
+void profile_cpu_init(HVM * hvm, PROFILE_RING * ring){
+  uint64_t pin = get_msr(MSR_IA32_VMX_PINBASED_CTLS);
+  uint64_t exit_ctls = get_msr(MSR_IA32_VMX_EXIT_CTLS);
+
+  hvm->profile = NULL;
+#if PROFILE_ENABLED
+  if(!((pin >> 32) & PIN_BASED_PREEMPTION_TIMER) || !((exit_ctls >> 32) & VM_EXIT_SAVE_PREEMPTION_TIMER)){
+    return;
+  }
+
+  profile_timer_shift = get_msr(MSR_IA32_VMX_MISC) & 0x1F;
+  hvm->profile = ring;
+#endif
+}
+
+/*
+  Runs in guest mode on the BSP right after vm_start(), like the benchmarks in bench.c: times
+  VMCALL_PING with the vmx_exit fast path off, a full exit through vmexit_handler() and back.
+  Until then, and without a profiler, sampling is bound by profile_sample() alone.
+*/
+void profile_calibrate(HVM * hvm){
+  bool fast_exit_enabled = hvm->fast_exit_enabled;
+  uint64_t start, end;
+  uint32_t i;
+
+  if(!hvm->profile){
+    return;
+  }
+
+  hvm->fast_exit_enabled = false;
+  start = get_tsc();
+  for(i = 0; i < PROFILE_CALIBRATE_EXITS; ++i){
+    vmx_vmcall(VMCALL_PING);
+  }
+  end = get_tsc();
+  hvm->fast_exit_enabled = fast_exit_enabled;
+
+  profile_exit_cycles = (end - start) / PROFILE_CALIBRATE_EXITS;
+}
+
+void profile_set_period(PROFILE_RING * ring, uint64_t period){
+  uint64_t ticks = period >> profile_timer_shift;
+
+  ring->period = period;
+  ring->timer_value = ticks > 0xFFFFFFFF ? 0xFFFFFFFF : (ticks ? ticks : 1);
+}
+
+// Applies a new profile_hz, on the CPU the ring belongs to
+void profile_sync(HVM * hvm){
+  PROFILE_RING * ring = hvm->profile;
+  uint64_t generation;
+  uint32_t hz;
+
+  if(!ring || ring->generation == profile_generation){
+    return;
+  }
+
+  generation = profile_generation;
+  hz = profile_hz;
+  if(hz){
+    profile_set_period(ring, tsc_khz * 1000 / hz);
+    ring->last_exits = hvm->telemetry->exits;
+    vmcs_write(hvm, VMX_PREEMPTION_TIMER_VALUE, ring->timer_value);
+    vmcs_write(hvm, PIN_BASED_VM_EXEC_CONTROL, vmcs_read(hvm, PIN_BASED_VM_EXEC_CONTROL) | PIN_BASED_PREEMPTION_TIMER);
+    vmcs_write(hvm, VM_EXIT_CONTROLS, vmcs_read(hvm, VM_EXIT_CONTROLS) | VM_EXIT_SAVE_PREEMPTION_TIMER);
+  }
+  else{
+    ring->period = 0;
+    vmcs_write(hvm, PIN_BASED_VM_EXEC_CONTROL, vmcs_read(hvm, PIN_BASED_VM_EXEC_CONTROL) & ~PIN_BASED_PREEMPTION_TIMER);
+    vmcs_write(hvm, VM_EXIT_CONTROLS, vmcs_read(hvm, VM_EXIT_CONTROLS) & ~VM_EXIT_SAVE_PREEMPTION_TIMER);
+  }
+  ring->generation = generation;
+}
+
+void profile_sample(HVM * hvm, uint64_t start){
+  PROFILE_RING * ring = hvm->profile;
+  TELEMETRY_CPU * telemetry = hvm->telemetry;
+  PROFILE_SAMPLE * sample = &ring->samples[ring->written % PROFILE_SAMPLES];
+  uint64_t exits = telemetry->exits - ring->last_exits - 1;
+
+  sample->tsc = start;
+  sample->rip = vmcs_read(hvm, GUEST_EIP);
+  sample->cr3 = vmcs_read(hvm, GUEST_CR3);
+  sample->cpu = hvm->cpu_id;
+  sample->cpl = guest_cpl(hvm);
+  if(!(vmcs_read(hvm, GUEST_CR0) & X86_CR0_PE)){
+    sample->mode = PROFILE_MODE_REAL;
+  }
+  else if(vmcs_read(hvm, GUEST_CS_AR_BYTES) & CS_AR_L){
+    sample->mode = PROFILE_MODE_LONG;
+  }
+  else{
+    sample->mode = PROFILE_MODE_PROTECTED;
+  }
+  sample->prev_exit_reason = telemetry->prev_exit_reason & 0xFFFF;
+  sample->exits = exits > 0xFFFF ? 0xFFFF : exits;
+  ring->last_exits = telemetry->exits;
+
+  // The slot is complete before profile_dump() can see it
+  __atomic_store_n(&ring->written, ring->written + 1, __ATOMIC_RELEASE);
+}
+
+// Stretches the period if the samples so far cost more than PROFILE_MAX_OVERHEAD of guest time
+void profile_bound(PROFILE_RING * ring){
+  uint64_t cost = ring->sample_cycles / ring->written + profile_exit_cycles;
+  uint64_t min_period = cost * 1000 / PROFILE_MAX_OVERHEAD;
+
+  if(ring->period < min_period){
+    profile_set_period(ring, min_period);
+    ++ring->throttled;
+  }
+}
+
+int handle_preemption_timer(GUEST_REGS * regs, uint64_t exit_reason){
+  HVM * hvm = regs->hvm;
+  PROFILE_RING * ring = hvm->profile;
+  uint64_t start = get_tsc();
+
+  // A late exit after sampling was switched off, profile_sync() already cleared the control
+  if(!ring || !ring->period){
+    return EXIT_KEEP_RIP;
+  }
+
+  profile_sample(hvm, start);
+  if(ring->written % PROFILE_ADJUST_SAMPLES == 0){
+    profile_bound(ring);
+  }
+
+  // The saved value is 0 now, start the next period
+  vmcs_write(hvm, VMX_PREEMPTION_TIMER_VALUE, ring->timer_value);
+  ring->sample_cycles += get_tsc() - start;
+
+  return EXIT_KEEP_RIP;
+}
+
+uint64_t hc_profile_control(GUEST_REGS * regs){
+  uint64_t hz = regs->rcx;
+
+  if(!bsp_hvm->profile){
+    return HC_ERR_UNKNOWN_CALL;
+  }
+  if(hz > PROFILE_MAX_HZ){
+    hz = PROFILE_MAX_HZ;
+  }
+
+  profile_hz = hz;
+  __atomic_add_fetch(&profile_generation, 1, __ATOMIC_RELEASE);
+  profile_sync(regs->hvm);
+
+  regs->rcx = hz;
+  return HC_SUCCESS;
+}
+
+// Copies up to max samples of ring from ring->read on, returns how many are valid
+uint32_t profile_drain(PROFILE_RING * ring, PROFILE_SAMPLE * out, uint32_t max){
+  uint64_t written = __atomic_load_n(&ring->written, __ATOMIC_ACQUIRE);
+  uint64_t first, count, i, overwritten;
+
+  if(written - ring->read > PROFILE_SAMPLES){
+    ring->lost += written - PROFILE_SAMPLES - ring->read;
+    ring->read = written - PROFILE_SAMPLES;
+  }
+  first = ring->read;
+  count = written - first < max ? written - first : max;
+
+  for(i = 0; i < count; ++i){
+    CopyMem(&out[i], &ring->samples[(first + i) % PROFILE_SAMPLES], sizeof(PROFILE_SAMPLE));
+  }
+
+  // Slots the CPU reused while they were copied are garbage
+  written = __atomic_load_n(&ring->written, __ATOMIC_ACQUIRE);
+  overwritten = written > PROFILE_SAMPLES && written - PROFILE_SAMPLES > first ? written - PROFILE_SAMPLES - first : 0;
+  if(overwritten > count){
+    overwritten = count;
+  }
+  if(overwritten){
+    CopyMem(out, &out[overwritten], (count - overwritten) * sizeof(PROFILE_SAMPLE));
+    ring->lost += overwritten;
+  }
+
+  ring->read = first + count;
+  return count - overwritten;
+}
+
+uint64_t hc_profile_dump(GUEST_REGS * regs){
+  PROFILE_DUMP_HEADER * hdr = (PROFILE_DUMP_HEADER*)regs->rcx;
+  PROFILE_SAMPLE * out = (PROFILE_SAMPLE*)(hdr + 1);
+  uint64_t size = regs->rdx;
+  uint64_t max_size = sizeof(PROFILE_DUMP_HEADER) + CPU_count * PROFILE_SAMPLES * sizeof(PROFILE_SAMPLE);
+  uint64_t lost = 0;
+  uint32_t room;
+  uint32_t samples = 0;
+  PROFILE_RING * ring;
+  int cpu;
+
+  if(!bsp_hvm->profile){
+    return HC_ERR_UNKNOWN_CALL;
+  }
+  if(size < sizeof(PROFILE_DUMP_HEADER)){
+    regs->rcx = sizeof(PROFILE_DUMP_HEADER);
+    return HC_ERR_BUFFER_TOO_SMALL;
+  }
+  if(size > max_size){
+    size = max_size;
+  }
+  if(!ept_guest_writable(regs->hvm, regs->rcx, size)){
+    return HC_ERR_ACCESS;
+  }
+  room = (size - sizeof(PROFILE_DUMP_HEADER)) / sizeof(PROFILE_SAMPLE);
+
+  ticket_lock(&profile_lock);
+  for(cpu = 0; cpu < CPU_count; ++cpu){
+    ring = cpu_hvm[cpu]->profile;
+    samples += profile_drain(ring, out + samples, room - samples);
+    lost += ring->lost;
+    ring->lost = 0;
+  }
+  ticket_unlock(&profile_lock);
+
+  hdr->magic = PROFILE_MAGIC;
+  hdr->cpu_count = CPU_count;
+  hdr->hz = profile_hz;
+  hdr->tsc_khz = tsc_khz;
+  hdr->samples = samples;
+  hdr->lost = lost;
+
+  regs->rcx = sizeof(PROFILE_DUMP_HEADER) + samples * sizeof(PROFILE_SAMPLE);
+  ept_guest_written((uint64_t)hdr, regs->rcx);
+  regs->rdx = lost;
+  return HC_SUCCESS;
+}
+
+// Registers the calls if the CPUs can be sampled, after hypercall_init() and alloc_cpu_state()
+bool profile_init(void){
+  if(!bsp_hvm->profile){
+    return false;
+  }
+  register_hypercall(VMCALL_PROFILE_CONTROL, hc_profile_control, HC_KERNEL, "profile_control");
+  register_hypercall(VMCALL_PROFILE_DUMP, hc_profile_dump, HC_KERNEL, "profile_dump");
+  return true;
+}
+
+void profile_report(void){
+  PROFILE_RING * ring;
+  int cpu;
+
+  if(!bsp_hvm->profile){
+    bsp_printf("Profiler: no VMX-preemption timer\r\n");
+    return;
+  }
+
+  bsp_printf("Profiler: %u cycles per exit\r\n", profile_exit_cycles);
+  for(cpu = 0; cpu < CPU_count; ++cpu){
+    ring = cpu_hvm[cpu]->profile;
+    if(!ring->written) continue;
+    bsp_printf("%u: %u samples, %u lost, %u cycles per sample, period %u cycles, throttled %u times\r\n",
+      (uint64_t)cpu, ring->written, ring->lost, ring->sample_cycles / ring->written, ring->period,
+      (uint64_t)ring->throttled);
+  }
+}
@@ -0,0 +1,71 @@
+#ifndef _PROFILE_
+#define _PROFILE_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmx_api.h"
+#include "regs.h"
+
+#define PROFILE_ENABLED 1 // sample the guest with the VMX-preemption timer
+#define PROFILE_DEFAULT_HZ 0 // rate at start, VMCALL_PROFILE_CONTROL changes it
+#define PROFILE_MAX_HZ 10000
+#define PROFILE_SAMPLES 1024 // per CPU, the oldest are overwritten
+#define PROFILE_MAX_OVERHEAD 10 // per mille of guest time spent taking samples
+#define PROFILE_CALIBRATE_EXITS 256 // VMCALLs timed by profile_calibrate()
+#define PROFILE_ADJUST_SAMPLES 64 // samples between overhead checks
+#define PROFILE_MAGIC 0x464F525047424221ULL // "!BGPROF"
+
+// PROFILE_SAMPLE.mode
+#define PROFILE_MODE_REAL 0
+#define PROFILE_MODE_PROTECTED 1 // 16 or 32-bit
+#define PROFILE_MODE_LONG 2 // 64-bit code
+
+#define CS_AR_L (1 << 13)
+
+typedef struct{
+  uint64_t tsc;
+  uint64_t rip;
+  uint64_t cr3;
+  uint16_t cpu;
+  uint8_t cpl;
+  uint8_t mode;
+  uint16_t prev_exit_reason; // basic reason of the exit before the timer expired
+  uint16_t exits; // other exits since the previous sample, saturated
+} PROFILE_SAMPLE;
+
+/*
+  Written only by the owning CPU: a sample goes to samples[written % PROFILE_SAMPLES], then written
+  is incremented. profile_dump() copies from read on and afterwards drops what written shows was
+  overwritten meanwhile.
+*/
+typedef struct _PROFILE_RING{
+  volatile uint64_t written;
+  uint64_t read; // next sample for profile_dump()
+  uint64_t lost; // overwritten before profile_dump() got them
+  uint64_t generation; // of profile_hz in effect on this CPU
+  uint64_t period; // TSC cycles of guest time between samples, 0: off
+  uint32_t timer_value; // preemption timer ticks for period
+  uint32_t throttled; // times the period was stretched to stay within PROFILE_MAX_OVERHEAD
+  uint64_t sample_cycles; // TSC cycles in profile_sample()
+  uint64_t last_exits; // telemetry exits at the previous sample
+  PROFILE_SAMPLE samples[PROFILE_SAMPLES];
+} PROFILE_RING;
+
+// VMCALL_PROFILE_DUMP output, followed by the samples of all CPUs
+typedef struct{
+  uint64_t magic;
+  uint32_t cpu_count;
+  uint32_t hz; // requested rate
+  uint64_t tsc_khz;
+  uint32_t samples;
+  uint32_t lost; // since the previous dump
+} PROFILE_DUMP_HEADER;
+
+bool profile_init(void);
+void profile_cpu_init(HVM * hvm, PROFILE_RING * ring);
+void profile_calibrate(HVM * hvm);
+void profile_sync(HVM * hvm);
+int handle_preemption_timer(GUEST_REGS * regs, uint64_t exit_reason);
+void profile_report(void);
+
+#endif
@@ -19,6 +19,16 @@ global get_msr
 global set_msr
 global set_tr
 global set_gdt_base_limit
+global get_tsc
+global get_xcr0
+global set_xcr0
+global get_xinuse
+global xsave_area
+global xsaveopt_area
+global xrstor_area
+global store_mxcsr
+global io_in8
+global io_out8
 
 section .text
 
@@ -133,3 +143,69 @@ set_gdt_base_limit:
 	sti
 	add rsp,10
 	ret
+
+get_tsc:
+	lfence
+	rdtsc
+	shl rdx,32
+	or rax,rdx
+	ret
+
+get_xcr0:
+	xor ecx,ecx
+	xgetbv
+	shl rdx,32
+	or rax,rdx
+	ret
+
+set_xcr0:
+	mov rax,rcx
+	mov rdx,rcx
+	shr rdx,32
+	xor ecx,ecx
+	xsetbv
+	ret
+
+; Components not in their init state, needs CPUID.(EAX=0DH,ECX=1):EAX[2]
+get_xinuse:
+	mov ecx,1
+	xgetbv
+	shl rdx,32
+	or rax,rdx
+	ret
+
+; RCX: 64-byte aligned area, RDX: requested-feature bitmap
+xsave_area:
+	mov rax,rdx
+	shr rdx,32
+	xsave64 [rcx]
+	ret
+
+xsaveopt_area:
+	mov rax,rdx
+	shr rdx,32
+	xsaveopt64 [rcx]
+	ret
+
+xrstor_area:
+	mov rax,rdx
+	shr rdx,32
+	xrstor64 [rcx]
+	ret
+
+; RCX: 4 bytes for MXCSR
+store_mxcsr:
+	stmxcsr [rcx]
+	ret
+
+io_in8:
+	mov edx,ecx
+	in al,dx
+	movzx eax,al
+	ret
+
+io_out8:
+	mov eax,edx
+	mov edx,ecx
+	out dx,al
+	ret
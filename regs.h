@@ -81,6 +81,16 @@ void get_idt_base_limit(uint64_t * base, uint16_t * limit);
 uint64_t get_ldtr(void);
 uint64_t get_msr(uint64_t index);
 uint64_t set_msr(uint64_t index, uint64_t value);
+uint64_t get_tsc(void);
+uint64_t get_xcr0(void);
+void set_xcr0(uint64_t xcr0);
+uint64_t get_xinuse(void);
+void xsave_area(void * area, uint64_t rfbm);
+void xsaveopt_area(void * area, uint64_t rfbm);
+void xrstor_area(void * area, uint64_t rfbm);
+void store_mxcsr(void * dest);
+uint8_t io_in8(uint16_t port);
+void io_out8(uint16_t port, uint8_t value);
 
 void set_tr(uint64_t sel);
 void set_gdt_base_limit(uint64_t base, uint64_t limit);
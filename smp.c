@@ -11,14 +11,21 @@
 #include "vm_setup.h"
 #include "vmx_emu.h"
 #include "pic.h"
+#include "tsc.h"
+#include "numa.h"
+#include "logring.h"
+#include "console.h"
 
 int CPU_count = 0;
 volatile int * CPUs_activated;
 volatile int CPU_notified;
 uint64_t LAPIC_addr;
-uint8_t ProcAPIC_IDs[256];
-uint32_t Proc_x2APIC_IDs[256];
+uint32_t * Proc_x2APIC_IDs;
+uint32_t * apic_id_map;
+uint32_t apic_id_max;
 bool x2APIC_enabled = false;
+volatile uint64_t * CPUs_online;
+uint64_t smp_startup_us;
 
 void * ap_stacks;
 
@@ -40,12 +47,27 @@ int verify_checksum(void * table, int len){
 	return 1;
 }
 
+// Adds an enabled CPU unless the MADT already listed its APIC ID
+void add_cpu(uint32_t apic_id){
+	int i;
+
+	for(i = 0; i < CPU_count; ++i){
+		if(Proc_x2APIC_IDs[i] == apic_id) return;
+	}
+
+	Proc_x2APIC_IDs[CPU_count++] = apic_id;
+	if(apic_id > apic_id_max){
+		apic_id_max = apic_id;
+	}
+}
+
+// Called twice: with Proc_x2APIC_IDs == NULL it only counts the processor entries
 int read_apic_table(MADT * madt){
 	uint8_t * apic_struct_ptr = (uint8_t*)&madt->APICStructs[0];
 	uint8_t * apic_struct_end = (uint8_t*)((uint64_t)madt + madt->h.Length);
+	int entries = 0;
 
 	LAPIC_addr = madt->LocalControllerAddress;
-	print(L"LAPIC is at 0x"); print_uintx(LAPIC_addr); print(L"\r\n");
 
 	while(apic_struct_ptr < apic_struct_end){
 		APICStructHeader * hdr = (APICStructHeader*)apic_struct_ptr;
@@ -53,25 +75,89 @@ int read_apic_table(MADT * madt){
 			EntryProcLocalAPIC * lapic = (EntryProcLocalAPIC*)hdr;
 
 			if(lapic->Flags & PROC_ENABLED){
-				print(L"Detected CPU "); print_uint(lapic->ProcID); print(L" with APIC ID "); print_uint(lapic->APIC_ID); print(L"\r\n");
-				ProcAPIC_IDs[CPU_count] = lapic->APIC_ID;
-				Proc_x2APIC_IDs[CPU_count++] = lapic->APIC_ID;
+				++entries;
+				if(Proc_x2APIC_IDs){
+					printf("Detected CPU %u with APIC ID %u\r\n", (uint64_t)lapic->ProcID, (uint64_t)lapic->APIC_ID);
+					add_cpu(lapic->APIC_ID);
+				}
 			}
 		}
 		else if(hdr->Type == TypeProcLocal_x2APIC){
 			EntryProcLocal_x2APIC * lapic = (EntryProcLocal_x2APIC*)hdr;
-			printf("Detected CPU with x2APIC ID %u\r\n", lapic->x2APIC_ID);
-			Proc_x2APIC_IDs[CPU_count++] = lapic->x2APIC_ID;
+
+			if(lapic->Flags & PROC_ENABLED){
+				++entries;
+				if(Proc_x2APIC_IDs){
+					printf("Detected CPU %u with x2APIC ID %u\r\n", (uint64_t)lapic->ProcUID, (uint64_t)lapic->x2APIC_ID);
+					add_cpu(lapic->x2APIC_ID);
+				}
+			}
 		}
 
 		apic_struct_ptr += hdr->Length;
 	}
 
+	return entries;
+}
+
+/*
+
+The CPU tables are sized from the MADT: Proc_x2APIC_IDs holds the 32-bit APIC ID of every enabled
+processor, apic_id_map is indexed by APIC ID so exit handlers can find a CPU without a search, and
+CPUs_online has one bit per CPU. All of them are runtime data, the hypervisor keeps using them after
+ExitBootServices().
+
+*/
+int alloc_cpu_tables(MADT * madt){
+	EFI_STATUS st;
+	int entries = read_apic_table(madt);
+	uint32_t i;
+
+	if(!entries){
+		return 0;
+	}
+
+	st = BS->AllocatePool(EfiRuntimeServicesData, entries * sizeof(uint32_t), (void**)&Proc_x2APIC_IDs);
+	if(st != EFI_SUCCESS){
+		return 0;
+	}
+
+	st = BS->AllocatePool(EfiRuntimeServicesData, (entries + 63) / 64 * 8, (void**)&CPUs_online);
+	if(st != EFI_SUCCESS){
+		return 0;
+	}
+	ZeroMem((void*)CPUs_online, (entries + 63) / 64 * 8);
+
+	CPU_count = 0;
+	apic_id_max = 0;
+	print(L"LAPIC is at 0x"); print_uintx(LAPIC_addr); print(L"\r\n");
+	read_apic_table(madt);
+
+	if(apic_id_max >= SMP_APIC_MAP_MAX){
+		printf("APIC IDs up to %u, APIC ID lookups will search the CPU table\r\n", (uint64_t)apic_id_max);
+		return 1;
+	}
+
+	st = BS->AllocatePool(EfiRuntimeServicesData, (apic_id_max + 1) * sizeof(uint32_t), (void**)&apic_id_map);
+	if(st != EFI_SUCCESS){
+		apic_id_map = NULL;
+		return 1;
+	}
+
+	for(i = 0; i <= apic_id_max; ++i){
+		apic_id_map[i] = SMP_NO_CPU;
+	}
+	for(i = 0; i < CPU_count; ++i){
+		apic_id_map[Proc_x2APIC_IDs[i]] = i;
+	}
+
 	return 1;
 }
 
 int read_acpi2_tables(RSDP * rsdp){
 	XSDT * xsdt;
+	SRAT * srat = NULL;
+	SLIT * slit = NULL;
 	int sdt_ptr_count, i;
 	CHAR16 signature[16] = {0};
 
@@ -102,10 +188,24 @@ int read_acpi2_tables(RSDP * rsdp){
 			if(!verify_checksum(madt, madt->h.Length)){
 				return 0;
 			}
-			read_apic_table((MADT*)madt);
+			if(!alloc_cpu_tables(madt)){
+				print(L"Error allocating the CPU tables.\r\n");
+				return 0;
+			}
+		}
+		else if(!strncmp(sdt_hdr->Signature, "SRAT", 4) && verify_checksum(sdt_hdr, sdt_hdr->Length)){
+			srat = (SRAT*)sdt_hdr;
+		}
+		else if(!strncmp(sdt_hdr->Signature, "SLIT", 4) && verify_checksum(sdt_hdr, sdt_hdr->Length)){
+			slit = (SLIT*)sdt_hdr;
 		}
 	}
 
+	// The SRAT refers to CPUs by APIC ID, so it is read once the MADT built the CPU tables
+	if(CPU_count && !numa_init(srat, slit)){
+		print(L"Error reading the NUMA tables.\r\n");
+	}
+
 	return 1;
 }
 
@@ -131,66 +231,101 @@ inline void write_lapic_reg(uint32_t offset, uint32_t value){
 	*(uint32_t*)(LAPIC_addr + offset) = value;
 }
 
-void send_sipi(uint64_t tramp_addr, int i){
-	printf("About to send SIPI to %u\r\n", ProcAPIC_IDs[i]);
+void send_ipi(uint32_t apic_id, uint32_t icr_low){
+	uint32_t icr_high;
+
 	if(x2APIC_enabled){
-		set_msr(MSR_INT_COMMAND_REG, ((uint64_t)Proc_x2APIC_IDs[i] << 32) | DM_STARTUP | LVL_ASSERT | (tramp_addr >> 12));
-		printf("Wrote ICR\r\n");
+		// One MSR write sends the IPI, x2APIC has no delivery status to poll
+		set_msr(MSR_INT_COMMAND_REG, ((uint64_t)apic_id << 32) | icr_low);
 	}
 	else{
-		write_lapic_reg(INT_COMMAND_REG_HIGH, (uint32_t)ProcAPIC_IDs[i] << 24); // Set destination
-		printf("Wrote ICR_HIGH\r\n");
-		// Entry point must be a 4 KB aligned address below 1 MB. It is coded as 8-bit vector with a value of entry_addr >> 12.
-		write_lapic_reg(INT_COMMAND_REG_LOW, DM_STARTUP | LVL_ASSERT | (tramp_addr >> 12)); // Set interrupt type and entry point
-		printf("Wrote ICR_LOW\r\n");
+		// The guest drives the same LAPIC and may have exited between its ICR_HIGH and ICR_LOW writes
+		icr_high = read_lapic_reg(INT_COMMAND_REG_HIGH);
+		write_lapic_reg(INT_COMMAND_REG_HIGH, apic_id << 24); // Set destination
+		write_lapic_reg(INT_COMMAND_REG_LOW, icr_low);
+		while(read_lapic_reg(INT_COMMAND_REG_LOW) & DLV_STATUS); // Wait for completion
+		write_lapic_reg(INT_COMMAND_REG_HIGH, icr_high);
 	}
+}
 
-	//print(L"SIPI send to CPU "); print_uint(i); print(L"\r\n");
-	if(!x2APIC_enabled){
-		while(read_lapic_reg(INT_COMMAND_REG_LOW) & DLV_STATUS); // Wait for completion
+uint32_t get_apic_id(void){
+	if(x2APIC_enabled){
+		return (uint32_t)get_msr(MSR_LAPIC_ID_REG);
 	}
-	printf("Completed SIPI\r\n");
+	return read_lapic_reg(LAPIC_ID_REG) >> 24; // xAPIC ID is in bits 31:24
 }
 
-int activate_APs(uint64_t tramp_addr){
-	uint8_t bspLAPIC_ID;
-	int i, t;
-	uint8_t tmp;
-	//uint32_t * ap_cr0 = (uint32_t*)(tramp_addr + tramp_size - 4);
+// Position of a CPU in the MADT-ordered tables, -1 if it isn't listed
+int smp_cpu_index(uint32_t apic_id){
+	int i;
 
-	if(x2APIC_enabled){
-		bspLAPIC_ID = (uint8_t)get_msr(MSR_LAPIC_ID_REG);
+	if(apic_id_map){
+		if(apic_id > apic_id_max || apic_id_map[apic_id] == SMP_NO_CPU) return -1;
+		return apic_id_map[apic_id];
 	}
-	else{
-		bspLAPIC_ID = (uint8_t)read_lapic_reg(LAPIC_ID_REG);
+
+	for(i = 0; i < CPU_count; ++i){
+		if(Proc_x2APIC_IDs[i] == apic_id) return i;
+	}
+
+	return -1;
+}
+
+bool cpu_online(int i){
+	return (CPUs_online[i >> 6] >> (i & 63)) & 1;
+}
+
+// xAPIC IPIs carry an 8-bit destination and 0xFF is the broadcast ID, larger IDs need x2APIC mode
+bool smp_ipi_reachable(int i){
+	return x2APIC_enabled || Proc_x2APIC_IDs[i] < 0xFF;
+}
+
+int smp_online_count(void){
+	int i, cnt = 0;
+
+	for(i = 0; i < CPU_count; ++i){
+		if(cpu_online(i)) ++cnt;
 	}
 
+	return cnt;
+}
+
+void send_sipi(uint64_t tramp_addr, int i){
+	printf("About to send SIPI to %u\r\n", (uint64_t)Proc_x2APIC_IDs[i]);
+	// Entry point must be a 4 KB aligned address below 1 MB. It is coded as 8-bit vector with a value of entry_addr >> 12.
+	send_ipi(Proc_x2APIC_IDs[i], DM_STARTUP | LVL_ASSERT | (tramp_addr >> 12));
+	printf("Completed SIPI\r\n");
+}
+
+// Wakes the APs one at a time, also used for the APs the parallel path couldn't start
+int activate_APs_serial(uint64_t tramp_addr){
+	uint32_t bspLAPIC_ID = get_apic_id();
+	int i, t;
+	int tmp;
+	//uint32_t * ap_cr0 = (uint32_t*)(tramp_addr + tramp_size - 4);
+
+#if SMP_SERIAL_KEY_WAIT
 	print(L"Press a key to activate APs...\r\n");
 
 	wait_for_key();
+#endif
 
 	//print(L"BSP LAPIC ID: "); print_uint(bspLAPIC_ID); print(L"\r\n");
 
 	for(i = 0; i < CPU_count; ++i){
-		if(ProcAPIC_IDs[i] == bspLAPIC_ID) continue; // We won't be sending IPIs to ourselves
+		if(Proc_x2APIC_IDs[i] == bspLAPIC_ID) continue; // We won't be sending IPIs to ourselves
+		if(cpu_online(i)) continue; // Already running, an INIT would reset it
+		if(!smp_ipi_reachable(i)){
+			printf("APIC ID %u needs x2APIC mode, CPU not started\r\n", (uint64_t)Proc_x2APIC_IDs[i]);
+			continue;
+		}
 		//CPU_notified = 0;
 
 		tmp = *CPUs_activated;
 
 		// Send INIT
-		printf("About to send INIT to %u\r\n", ProcAPIC_IDs[i]);
-		if(x2APIC_enabled){
-			set_msr(MSR_INT_COMMAND_REG, ((uint64_t)Proc_x2APIC_IDs[i] << 32) | DM_INIT | LVL_ASSERT);
-		}
-		else{
-			write_lapic_reg(INT_COMMAND_REG_HIGH, (uint32_t)ProcAPIC_IDs[i] << 24); // Set destination
-			write_lapic_reg(INT_COMMAND_REG_LOW, DM_INIT | LVL_ASSERT); // Set interrupt type
-		}
-
-		//print(L"INIT send to CPU "); print_uint(i); print(L"\r\n");
-		if(!x2APIC_enabled){
-			while(read_lapic_reg(INT_COMMAND_REG_LOW) & DLV_STATUS); // Wait for completion
-		}
+		printf("About to send INIT to %u\r\n", (uint64_t)Proc_x2APIC_IDs[i]);
+		send_ipi(Proc_x2APIC_IDs[i], DM_INIT | LVL_ASSERT);
 
 		BS->Stall(10 * 1000); // Wait 10 ms
 
@@ -229,12 +364,65 @@ int activate_APs(uint64_t tramp_addr){
 	return 1;
 }
 
+/*
+
+Parallel bring-up: the INITs go out back to back, followed by a single INIT delay for all
+APs, then one round of SIPIs and a second SIPI round for the APs that aren't online yet.
+Completion is tracked per CPU in CPUs_online, which lets a failed startup fall back to
+the serial path for the missing APs only. The all-excluding-self shorthand is not used
+since it would also wake processors the MADT lists as disabled, which have no HVM slot.
+
+*/
+int activate_APs_parallel(uint64_t tramp_addr){
+	uint32_t bsp_id = get_apic_id();
+	uint64_t start = get_tsc();
+	uint64_t elapsed;
+	int i, t, online, expected = 0;
+
+	// APs whose IDs don't fit xAPIC mode are left to activate_APs_serial(), which reports them
+	for(i = 0; i < CPU_count; ++i){
+		if(!smp_ipi_reachable(i)) continue;
+		++expected;
+		if(Proc_x2APIC_IDs[i] == bsp_id) continue;
+		send_ipi(Proc_x2APIC_IDs[i], DM_INIT | LVL_ASSERT);
+	}
+
+	BS->Stall(SMP_INIT_DELAY_US);
+
+	for(i = 0; i < CPU_count; ++i){
+		if(Proc_x2APIC_IDs[i] == bsp_id || !smp_ipi_reachable(i)) continue;
+		send_ipi(Proc_x2APIC_IDs[i], DM_STARTUP | LVL_ASSERT | (tramp_addr >> 12));
+	}
+
+	BS->Stall(SMP_SIPI_DELAY_US);
+
+	// An AP already past the first SIPI ignores the second one
+	for(i = 0; i < CPU_count; ++i){
+		if(Proc_x2APIC_IDs[i] == bsp_id || cpu_online(i) || !smp_ipi_reachable(i)) continue;
+		send_ipi(Proc_x2APIC_IDs[i], DM_STARTUP | LVL_ASSERT | (tramp_addr >> 12));
+	}
+
+	for(t = 0; (online = smp_online_count()) < expected && t < SMP_STARTUP_TIMEOUT_US; t += 10){
+		BS->Stall(10);
+	}
+	elapsed = tsc_to_us(get_tsc() - start);
+
+	if(online < CPU_count){
+		printf("Parallel AP startup: only %u of %u CPUs online after %u us\r\n", (uint64_t)online, (uint64_t)CPU_count, elapsed);
+		return 0;
+	}
+
+	smp_startup_us = elapsed;
+	printf("Parallel AP startup: %u CPUs online after %u us\r\n", (uint64_t)online, elapsed);
+	return 1;
+}
+
 int init_smp(void){
 	EFI_CONFIGURATION_TABLE * CT = ST->ConfigurationTable;
 	int i;
 	int acpi1_idx = -1;
 	int acpi2_idx = -1;
-	//uint64_t rax, rbx, rcx, rdx;
+	uint64_t rax, rbx, rcx, rdx;
 	uint64_t apic_base_msr = get_msr(MSR_IA32_APIC_BASE);
 
 	disable_pic();
@@ -249,20 +437,23 @@ int init_smp(void){
 		}
 	}
 
-	/*rax = 1;
+	rax = 1;
 	emu_cpuid(&rax, &rbx, &rcx, &rdx);
-	if(rcx & (1 << 21)){ // x2APIC supported
-		// Enable x2APIC
+	if(apic_base_msr & APIC_X2APIC_MODE){ // The firmware already switched to x2APIC
+		x2APIC_enabled = true;
+		printf("x2APIC enabled by the firmware\r\n");
+	}
+	else if(SMP_X2APIC && (rcx & CPUID_X2APIC) && (apic_base_msr & APIC_ENABLED)){
 		x2APIC_enabled = true;
 		printf("x2APIC supported!\r\n");
 
-		// Enable x2APIC
-		apic_base_msr |= 3ULL << 10;
+		// Enable x2APIC, the APs switch in ap_tramp64
+		apic_base_msr |= APIC_X2APIC_MODE;
 		set_msr(MSR_IA32_APIC_BASE, apic_base_msr);
 	}
 	else{
 		printf("x2APIC not supported\r\n");
-	}*/
+	}
 
 	if(acpi2_idx >= 0){
 		print(L"Found ACPI 2 GUID\r\n");
@@ -273,6 +464,10 @@ int init_smp(void){
 		// ACPI 1 Support not implemented
 	}
 
+	if(!x2APIC_enabled && apic_id_max > 0xFE){
+		printf("APIC IDs above 254 need x2APIC mode, some CPUs can't be started\r\n");
+	}
+
 	return 1;
 }
 
@@ -299,10 +494,12 @@ void print_idt_entry(uint64_t base, uint8_t vec){
 
 int start_smp(void){
 	EFI_PHYSICAL_ADDRESS ap_init_code = 0xFFFF;
+	EFI_PHYSICAL_ADDRESS stacks;
 	EFI_STATUS st;
 	uint64_t apic_base_msr = get_msr(MSR_IA32_APIC_BASE);
 	uint64_t base;
 	uint16_t limit;
+	int i, t;
 
 	if(!(apic_base_msr & APIC_ENABLED)){
 		// TODO enable APIC manually
@@ -354,10 +551,15 @@ int start_smp(void){
 	
 	//print(L"JMP_64_PTR: "); print_uintx(JMP_64_PTR.addr); print(L"\r\n");
 
-	/*BS->AllocatePages(AllocateAnyPages, EfiRuntimeServicesData, CPU_count, (EFI_PHYSICAL_ADDRESS*)&ap_stacks);
-	for(i = 1; i < CPU_count; ++i){
-		ap_hvm[i].ap_guest_stack = ((uint64_t)ap_stacks + i * 4096);
-	}*/
+	// One page per CPU number handed out by the trampoline, CPU n uses the page below ap_stacks + n * 4096
+	stacks = 0xFFFFFFFF;
+	st = BS->AllocatePages(AllocateMaxAddress, EfiRuntimeServicesData, CPU_count, &stacks);
+	if(st != EFI_SUCCESS){
+		print(L"Error allocating AP stacks.\r\n");
+		BS->FreePages(ap_init_code, 1);
+		return 0;
+	}
+	ap_stacks = (void*)stacks;
 
 	// Copy the trampoline code in place
 	CopyMem((void*)ap_init_code, (void*)init_tramp, tramp_size);
@@ -369,74 +571,95 @@ int start_smp(void){
 
 
 	*CPUs_activated = 1;
-	activate_APs((uint64_t)ap_init_code);
-
-	char str[128];
-	int msg_sources = CPU_count - 1;
-	while(msg_sources){
-		recv_msg(str);
-		if(!strcmp(str, "MSG_END")){
-			--msg_sources;
+	if(smp_cpu_index(get_apic_id()) >= 0){
+		atomic_set_bit(CPUs_online, smp_cpu_index(get_apic_id()));
+	}
+#if SMP_PARALLEL_STARTUP
+	if(!activate_APs_parallel((uint64_t)ap_init_code)){
+		activate_APs_serial((uint64_t)ap_init_code);
+	}
+#else
+	activate_APs_serial((uint64_t)ap_init_code);
+#endif
+
+	// Drain the AP rings in batches until every AP that came online is done starting up
+	int pending = smp_online_count() - 1; // APs that never came online won't log LOGRING_END
+	for(t = 0; pending > 0 && t < SMP_AP_INIT_TIMEOUT_US; t += 100){
+		pending = smp_online_count() - 1;
+		for(i = 0; i < CPU_count; ++i){
+			if(cpu_hvm[i] == bsp_hvm) continue;
+			logring_drain(cpu_hvm[i]->log_ring);
+			if(cpu_hvm[i]->log_ring->ended) --pending;
 		}
-		else{
-			printf("%s", str);
+		if(pending > 0){
+			BS->Stall(100);
 		}
 	}
 
-	BS->FreePages(ap_init_code, 1);
-	return 1;
-}
-
-lock_t wait_for_send = 1;
-lock_t wait_for_recv = 0;
-
-char msg_buffer[128];
-
-void recv_msg(char * str){
-	acquire_lock(&wait_for_send);
-	
-	CopyMem(str, msg_buffer, strlen(msg_buffer) + 1);
-
-	release_lock(&wait_for_recv);
-}
-
-void send_msg(char * str){
-	acquire_lock(&wait_for_recv);
+	for(i = 0; i < CPU_count; ++i){
+		if(cpu_hvm[i] != bsp_hvm && cpu_online(i)){
+			logring_report(cpu_hvm[i]->log_ring, i);
+		}
+	}
 
-	CopyMem(msg_buffer, str, strlen(str) + 1);
+	if(pending > 0){
+		printf("%u APs didn't finish starting up, keeping the trampoline\r\n", (uint64_t)pending);
+		return 1;
+	}
 
-	release_lock(&wait_for_send);
+	BS->FreePages(ap_init_code, 1);
+	return 1;
 }
 
 int bsp_printf(const char * format, ...){
-	int ret;
-	char str[256];
+	int ret, cpu = -1;
+	bool to_console = true;
+	char str[LOGRING_RECORD_MAX + 1];
 	va_list params;
 	va_start(params, format);
 	
-	ret = vsprintf(str, format, params);
+	ret = vsnprintf(str, sizeof(str), format, params);
 
-	uint64_t apic_base_msr = get_msr(MSR_IA32_APIC_BASE);
-	if(apic_base_msr & IS_BSP){
-		printf("%s", str);
+	// Until ExitBootServices() only the BSP writes to the console, APs log into their ring.
+	// The APs don't run before bsp_hvm is set.
+	if(cpu_hvm && bsp_hvm && !console_shared()){
+		cpu = smp_cpu_index(get_apic_id());
+		to_console = cpu >= 0 && cpu_hvm[cpu] == bsp_hvm;
 	}
-	else{
-		send_msg(str);
+
+	if(to_console){
+		console_write(str, ret < sizeof(str) ? ret : sizeof(str) - 1);
+	}
+	else if(cpu >= 0 && cpu_hvm[cpu]->log_ring){
+		// A length over LOGRING_RECORD_MAX is counted as truncated
+		logring_write(cpu_hvm[cpu]->log_ring, LOGRING_TEXT, str, ret);
 	}
 
 	va_end(params);
 	return ret;
 }
 
-void ap_entry64(uint8_t cpu){
+// start_no is the trampoline's CPU number (it picks the boot stack, numbers from CPU_count on are
+// parked there), the HVM is picked by APIC ID
+void ap_entry64(uint32_t start_no){
 	uint32_t vmx_rev, struct_size;
 	uint64_t apic_base_msr = get_msr(MSR_IA32_APIC_BASE);
+	int cpu = smp_cpu_index(get_apic_id());
+	HVM * hvm;
+
+	if(cpu < 0){
+		return; // A CPU missing from the MADT, there is no HVM for it
+	}
+
+	hvm = cpu_hvm[cpu];
+	hvm->wait_for_sipi = true; // The guest starts in wait-for-SIPI state below, inval_commit() skips it until then
+	atomic_set_bit(CPUs_online, cpu);
 	bsp_printf("%u: MSR_IA32_APIC_BASE: %x\r\n", cpu, apic_base_msr);
 
-	/*bsp_printf("%u: VMXON-region = %x\r\n", cpu, ap_hvm[cpu].vmxon_region);
-	bsp_printf("%u: VMCS = %x\r\n", cpu, ap_hvm[cpu].vmcs);
-	bsp_printf("%u: Host stack = %x\r\n", cpu, ap_hvm[cpu].host_stack);
-	bsp_printf("%u: GDT base = %x\r\n", cpu, ap_hvm[cpu].st->gdt_base);*/
+	/*bsp_printf("%u: VMXON-region = %x\r\n", cpu, hvm->vmxon_region);
+	bsp_printf("%u: VMCS = %x\r\n", cpu, hvm->vmcs);
+	bsp_printf("%u: Host stack = %x\r\n", cpu, hvm->host_stack);
+	bsp_printf("%u: GDT base = %x\r\n", cpu, hvm->st->gdt_base);*/
 
 	if(vmx_supported()){
 		bsp_printf("%u: VMX is supported!\r\n", cpu);
@@ -452,10 +675,10 @@ void ap_entry64(uint8_t cpu){
 	bsp_printf("%u: Struct size: %u\r\n", cpu, struct_size);
 
 	// Write revision ID at the start of VMXON-region
-	*(uint32_t*)ap_hvm[cpu].vmxon_region = vmx_rev;
+	*(uint32_t*)hvm->vmxon_region = vmx_rev;
 	vmx_enable(); // Set bit 13 of CR4 to 1 to enable the VMX operations
 
-	if(vmx_switch_to_root_op((void*)ap_hvm[cpu].vmxon_region)){
+	if(vmx_switch_to_root_op((void*)hvm->vmxon_region)){
 		bsp_printf("%u: Switched to VMX-root-operation mode!\r\n", cpu);
 	}
 	else{
@@ -463,8 +686,8 @@ void ap_entry64(uint8_t cpu){
 		goto msg_end;
 	}
 
-	*(uint32_t*)ap_hvm[cpu].vmcs = vmx_rev;
-	if(vmx_vmcs_activate((void*)ap_hvm[cpu].vmcs)){
+	*(uint32_t*)hvm->vmcs = vmx_rev;
+	if(vmx_vmcs_activate((void*)hvm->vmcs)){
 		bsp_printf("%u: Activated VMCS!\r\n", cpu);
 	}
 	else{
@@ -472,18 +695,17 @@ void ap_entry64(uint8_t cpu){
 		goto msg_end;
 	}
 
-	bsp_printf("%u: Debug area: %x\r\n", cpu, ap_hvm[cpu].st->debug_area);
 
-	vmcs_init(&ap_hvm[cpu]);
-	/*ap_hvm[cpu].guest_CR0 &= ~(X86_CR0_PE | X86_CR0_PG);
-	ap_hvm[cpu].guest_CR4 &= ~X86_CR4_PAE;
+	vmcs_init(hvm);
+	/*hvm->guest_CR0 &= ~(X86_CR0_PE | X86_CR0_PG);
+	hvm->guest_CR4 &= ~X86_CR4_PAE;
 	if(features.pse){
-		ap_hvm[cpu].guest_CR4 |= X86_CR4_PSE;
+		hvm->guest_CR4 |= X86_CR4_PSE;
 	}
-	ap_hvm[cpu].guest_realmode = true;
-	ap_hvm[cpu].guest_realsegment = true;
+	hvm->guest_realmode = true;
+	hvm->guest_realsegment = true;
 
-	vmx_write(GUEST_CR3, ap_hvm[cpu].st->host_cr3);*/
+	vmx_write(GUEST_CR3, hvm->st->host_cr3);*/
 
 	/*vmx_write(GUEST_ES_SELECTOR, 0);
 	vmx_write(GUEST_CS_SELECTOR, 0);
@@ -514,7 +736,7 @@ void ap_entry64(uint8_t cpu){
 
 	vmx_write(GUEST_ACTIVITY_STATE, STATE_WAIT_FOR_SIPI);
 
-	send_msg("MSG_END");
+	logring_write(hvm->log_ring, LOGRING_END, NULL, 0);
 	vm_start();
 	return;
 	/*uint64_t error_code;
@@ -528,5 +750,5 @@ void ap_entry64(uint8_t cpu){
 	bsp_printf("VMLAUNCH failed.\r\nError code: %u\r\n", error_code);*/
 
 	msg_end:
-	send_msg("MSG_END");
+	logring_write(hvm->log_ring, LOGRING_END, NULL, 0);
 }
\ No newline at end of file
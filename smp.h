@@ -4,16 +4,35 @@
 #include <efi.h>
 #include <efilib.h>
 #include <stdarg.h>
+#include <stdbool.h>
 
 #define MSR_IA32_APIC_BASE 0x1B
 // IA32_APIC_BASE flags:
 #define APIC_ENABLED 1 << 11
+#define APIC_X2APIC_MODE 1 << 10
 #define IS_BSP 1 << 8
 
+#define CPUID_X2APIC 1 << 21 // CPUID.01H:ECX
+
+#define SMP_X2APIC 1 // switch to x2APIC mode when supported
+
+// AP bring-up
+#define SMP_PARALLEL_STARTUP 1 // 0: wake the APs one at a time
+#define SMP_SERIAL_KEY_WAIT 0 // debugging: wait for a key press before the serial bring-up
+#define SMP_INIT_DELAY_US 10000 // INIT to SIPI delay, paid once for all APs
+#define SMP_SIPI_DELAY_US 200 // delay before the second SIPI
+#define SMP_STARTUP_TIMEOUT_US 100000 // how long to wait for all APs to come online
+#define SMP_AP_INIT_TIMEOUT_US 5000000 // how long the BSP waits for the APs to finish ap_entry64()
+#define SMP_APIC_MAP_MAX 0x100000 // larger APIC IDs fall back to a linear search
+#define SMP_NO_CPU 0xFFFFFFFF
+
 extern volatile int * CPUs_activated;
 extern volatile int CPU_notified;
 extern int CPU_count;
 extern uint64_t LAPIC_addr;
+extern bool x2APIC_enabled;
+extern volatile uint64_t * CPUs_online; // bit n: CPU n (MADT order) reached ap_entry64()
+extern uint64_t smp_startup_us; // time from the first INIT until every AP was online
 
 extern void * ap_stacks;
 
@@ -33,9 +52,11 @@ extern void * ap_stacks;
 #define LVL_ASSERT 1 << 14
 #define DM_INIT 5 << 8
 #define DM_STARTUP 6 << 8
+#define DM_NMI 4 << 8
 
-extern uint8_t ProcAPIC_IDs[256];
-extern uint32_t Proc_x2APIC_IDs[256];
+extern uint32_t * Proc_x2APIC_IDs; // APIC IDs of the enabled CPUs in MADT order, CPU_count entries
+extern uint32_t * apic_id_map; // APIC ID -> index into Proc_x2APIC_IDs, SMP_NO_CPU if unused
+extern uint32_t apic_id_max;
 
 typedef struct _RSDP{
 	// In ACPI >= 1
@@ -107,9 +128,13 @@ typedef struct _EntryProcLocal_x2APIC{
 
 int init_smp(void);
 int start_smp(void);
-void ap_entry64(uint8_t cpu);
-void recv_msg(char * str);
-void send_msg(char * str);
+void ap_entry64(uint32_t start_no);
 int bsp_printf(const char * format, ...);
+void send_ipi(uint32_t apic_id, uint32_t icr_low);
+uint32_t get_apic_id(void);
+int smp_cpu_index(uint32_t apic_id);
+bool cpu_online(int i);
+bool smp_ipi_reachable(int i);
+int smp_online_count(void);
 
 #endif
\ No newline at end of file
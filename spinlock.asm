@@ -1,20 +1,119 @@
 global acquire_lock
 global release_lock
+global atomic_set_bit
+global ticket_acquire
+global ticket_try_acquire
+global ticket_release
+global mcs_acquire
+global mcs_try_acquire
+global mcs_release
+global irq_save
+global irq_restore
 
 section .text
 
+; Test-and-set lock
 acquire_lock:
 	mov eax,0
-	lock bts [ecx],eax
+	lock bts [rcx],eax
 	jc spin
 	ret
 
 spin:
 	pause
-	test dword [ecx],1
+	test dword [rcx],1
 	jnz spin
 	jmp acquire_lock
 
 release_lock:
-	mov dword [ecx],0
-	ret
\ No newline at end of file
+	mov dword [rcx],0
+	ret
+
+atomic_set_bit:
+	mov edx,edx
+	lock bts [rcx],rdx ; Bit offset may reach past the first qword
+	ret
+
+; Ticket lock, rcx = lock: dword next ticket, dword ticket being served
+ticket_acquire:
+	mov eax,1
+	lock xadd [rcx],eax ; Take a ticket
+ticket_spin:
+	cmp [rcx+4],eax
+	je ticket_acquired
+	pause
+	jmp ticket_spin
+ticket_acquired:
+	ret
+
+; Returns 1 if the lock was free and is now held, 0 otherwise
+ticket_try_acquire:
+	mov eax,[rcx+4]
+	lea edx,[rax+1]
+	lock cmpxchg [rcx],edx ; Take the next ticket only if it is the one being served
+	sete al
+	movzx eax,al
+	ret
+
+ticket_release:
+	inc dword [rcx+4] ; Only the holder writes the owner field
+	ret
+
+; MCS queue lock, rcx = lock (qword tail), rdx = node of the caller (qword next, dword locked)
+; Every waiter spins on its own node instead of the lock's cache line
+mcs_acquire:
+	mov qword [rdx],0
+	mov dword [rdx+8],1
+	mov rax,rdx
+	xchg [rcx],rax ; Become the new tail, rax = predecessor
+	test rax,rax
+	jz mcs_acquired
+	mov [rax],rdx ; Link behind the predecessor
+mcs_spin:
+	cmp dword [rdx+8],0
+	je mcs_acquired
+	pause
+	jmp mcs_spin
+mcs_acquired:
+	ret
+
+mcs_try_acquire:
+	mov qword [rdx],0
+	mov dword [rdx+8],1
+	xor eax,eax
+	lock cmpxchg [rcx],rdx ; Only succeeds with an empty queue
+	sete al
+	movzx eax,al
+	ret
+
+mcs_release:
+	mov rax,[rdx]
+	test rax,rax
+	jnz mcs_handoff
+	mov rax,rdx
+	xor r8,r8
+	lock cmpxchg [rcx],r8 ; No successor: empty the queue if we are still the tail
+	je mcs_released
+mcs_wait_link: ; A successor swapped the tail but hasn't linked itself yet
+	mov rax,[rdx]
+	test rax,rax
+	jnz mcs_handoff
+	pause
+	jmp mcs_wait_link
+mcs_handoff:
+	mov dword [rax+8],0
+mcs_released:
+	ret
+
+; Returns RFLAGS and disables interrupts
+irq_save:
+	pushfq
+	pop rax
+	cli
+	ret
+
+; rcx = RFLAGS from irq_save(), restores IF
+irq_restore:
+	push rcx
+	popfq
+	ret
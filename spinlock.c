@@ -0,0 +1,136 @@
+#include "lib_uefi.h"
+#include "regs.h"
+#include "string.h"
+#include "spinlock.h"
+
+/*
+
+Spinlocks with optional contention statistics
+
+Ticket locks hand the lock out in arrival order, MCS locks additionally let every waiter spin on
+its own node so a contended lock doesn't bounce one cache line between all waiters. Both take
+64-bit addresses. The uncontended path is a single try in spinlock.asm, the TSC is only read
+when the lock is already held.
+
+Statistics are updated while holding the lock, so they need no atomic operations. The _irqsave
+forms disable interrupts first; in VMX root they are already off since VM exits clear RFLAGS.IF.
+
+*/
+
+LOCK_STATS * lock_stats_list;
+
+void lock_stats_register(LOCK_STATS * stats){
+  stats->next = lock_stats_list;
+  lock_stats_list = stats;
+}
+
+void lock_stats_contended(LOCK_STATS * stats, uint64_t start){
+  uint64_t cycles = get_tsc() - start;
+
+  ++stats->contended;
+  stats->spin_cycles += cycles;
+  if(cycles > stats->max_spin_cycles){
+    stats->max_spin_cycles = cycles;
+  }
+}
+
+void ticket_lock(ticket_lock_t * lock){
+  uint64_t start;
+
+  if(ticket_try_acquire(lock)){
+#if LOCK_STATS_ENABLED
+    if(lock->stats) ++lock->stats->acquisitions;
+#endif
+    return;
+  }
+
+  start = get_tsc();
+  ticket_acquire(lock);
+#if LOCK_STATS_ENABLED
+  if(lock->stats){
+    ++lock->stats->acquisitions;
+    lock_stats_contended(lock->stats, start);
+  }
+#endif
+}
+
+bool ticket_trylock(ticket_lock_t * lock){
+  if(!ticket_try_acquire(lock)){
+    return false;
+  }
+#if LOCK_STATS_ENABLED
+  if(lock->stats) ++lock->stats->acquisitions;
+#endif
+  return true;
+}
+
+void ticket_unlock(ticket_lock_t * lock){
+  ticket_release(lock);
+}
+
+uint64_t ticket_lock_irqsave(ticket_lock_t * lock){
+  uint64_t rflags = irq_save();
+
+  ticket_lock(lock);
+  return rflags;
+}
+
+void ticket_unlock_irqrestore(ticket_lock_t * lock, uint64_t rflags){
+  ticket_release(lock);
+  irq_restore(rflags);
+}
+
+void mcs_lock(mcs_lock_t * lock, mcs_node_t * node){
+  uint64_t start;
+
+  if(mcs_try_acquire(lock, node)){
+#if LOCK_STATS_ENABLED
+    if(lock->stats) ++lock->stats->acquisitions;
+#endif
+    return;
+  }
+
+  start = get_tsc();
+  mcs_acquire(lock, node);
+#if LOCK_STATS_ENABLED
+  if(lock->stats){
+    ++lock->stats->acquisitions;
+    lock_stats_contended(lock->stats, start);
+  }
+#endif
+}
+
+bool mcs_trylock(mcs_lock_t * lock, mcs_node_t * node){
+  if(!mcs_try_acquire(lock, node)){
+    return false;
+  }
+#if LOCK_STATS_ENABLED
+  if(lock->stats) ++lock->stats->acquisitions;
+#endif
+  return true;
+}
+
+void mcs_unlock(mcs_lock_t * lock, mcs_node_t * node){
+  mcs_release(lock, node);
+}
+
+uint64_t mcs_lock_irqsave(mcs_lock_t * lock, mcs_node_t * node){
+  uint64_t rflags = irq_save();
+
+  mcs_lock(lock, node);
+  return rflags;
+}
+
+void mcs_unlock_irqrestore(mcs_lock_t * lock, mcs_node_t * node, uint64_t rflags){
+  mcs_release(lock, node);
+  irq_restore(rflags);
+}
+
+void lock_stats_report(void){
+  LOCK_STATS * stats;
+
+  for(stats = lock_stats_list; stats; stats = stats->next){
+    printf("Lock %s: %u acquisitions, %u contended, %u spin cycles (max %u)\r\n",
+      stats->name, stats->acquisitions, stats->contended, stats->spin_cycles, stats->max_spin_cycles);
+  }
+}
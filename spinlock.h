@@ -1,9 +1,68 @@
 #ifndef _SPINLOCK_
 #define _SPINLOCK_
 
+#include <stdint.h>
+#include <stdbool.h>
+
+#define LOCK_STATS_ENABLED 1 // count acquisitions and spin time of locks with a LOCK_STATS block
+
 typedef uint32_t lock_t;
 
+typedef struct _LOCK_STATS{
+	const char * name;
+	uint64_t acquisitions;
+	uint64_t contended; // acquisitions that had to wait
+	uint64_t spin_cycles; // TSC cycles spent waiting
+	uint64_t max_spin_cycles;
+	struct _LOCK_STATS * next; // registered blocks, see lock_stats_report()
+} LOCK_STATS;
+
+// FIFO ticket lock, the offsets of next and owner are used by spinlock.asm
+typedef struct{
+	volatile uint32_t next; // 0: next ticket handed out
+	volatile uint32_t owner; // 4: ticket allowed in
+	LOCK_STATS * stats; // NULL: not counted
+} ticket_lock_t;
+
+// MCS queue lock, each waiter brings its own node and spins on it
+typedef struct _mcs_node{
+	struct _mcs_node * volatile next; // 0
+	volatile uint32_t locked; // 8
+} mcs_node_t;
+
+typedef struct{
+	mcs_node_t * volatile tail; // 0: last waiter, NULL if free
+	LOCK_STATS * stats;
+} mcs_lock_t;
+
+// Test-and-set lock
 void acquire_lock(lock_t * lock);
 void release_lock(lock_t * lock);
+void atomic_set_bit(volatile uint64_t * bitmap, uint32_t bit);
+
+// Primitives in spinlock.asm, without statistics
+void ticket_acquire(ticket_lock_t * lock);
+int ticket_try_acquire(ticket_lock_t * lock);
+void ticket_release(ticket_lock_t * lock);
+void mcs_acquire(mcs_lock_t * lock, mcs_node_t * node);
+int mcs_try_acquire(mcs_lock_t * lock, mcs_node_t * node);
+void mcs_release(mcs_lock_t * lock, mcs_node_t * node);
+uint64_t irq_save(void);
+void irq_restore(uint64_t rflags);
+
+void ticket_lock(ticket_lock_t * lock);
+bool ticket_trylock(ticket_lock_t * lock);
+void ticket_unlock(ticket_lock_t * lock);
+uint64_t ticket_lock_irqsave(ticket_lock_t * lock);
+void ticket_unlock_irqrestore(ticket_lock_t * lock, uint64_t rflags);
+
+void mcs_lock(mcs_lock_t * lock, mcs_node_t * node);
+bool mcs_trylock(mcs_lock_t * lock, mcs_node_t * node);
+void mcs_unlock(mcs_lock_t * lock, mcs_node_t * node);
+uint64_t mcs_lock_irqsave(mcs_lock_t * lock, mcs_node_t * node);
+void mcs_unlock_irqrestore(mcs_lock_t * lock, mcs_node_t * node, uint64_t rflags);
+
+void lock_stats_register(LOCK_STATS * stats);
+void lock_stats_report(void);
 
-#endif
\ No newline at end of file
+#endif
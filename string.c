@@ -1,5 +1,6 @@
 #include <stdbool.h>
 #include "string.h"
+#include "console.h"
 
 int sprint_uintx(char * str, uint64_t n){
     char num_str[256];
@@ -66,13 +67,11 @@ int strlen(const char * str){
 int printf(const char * format, ...){
 	int ret;
 	char str[256];
-	CHAR16 wstr[256];
 	va_list params;
 	va_start(params, format);
 	
-	ret = vsprintf(str, format, params);
-	str2wstr(wstr, str, 256);
-	print(wstr);
+	ret = vsnprintf(str, sizeof(str), format, params);
+	console_write(str, ret < sizeof(str) ? ret : sizeof(str) - 1);
 
 	va_end(params);
 	return ret;
@@ -89,11 +88,23 @@ int sprintf(char * str, const char * format, ...){
 	return ret;
 }
 
-int vsprintf(char * str, const char * format, va_list params){
+// Copies what still fits into a buffer of size bytes, one byte is kept for the terminator
+void copy_bounded(char * str, int size, int written, const char * src, int len){
+	if(written + len > size - 1){
+		len = size - 1 - written;
+	}
+	if(len > 0){
+		CopyMem(str + written, (void*)src, len);
+	}
+}
+
+// Returns the length of the full output, which is >= size if it was truncated
+int vsnprintf(char * str, int size, const char * format, va_list params){
 	int written = 0;
 	int amount;
 	bool rejected_bad_specifier = false;
 	int base;
+	char num[72];
 
 	while(*format != 0){
 		if(*format != '%'){
@@ -102,9 +113,8 @@ int vsprintf(char * str, const char * format, va_list params){
 			while(format[amount] && format[amount] != '%'){
 				++amount;
 			}
-			CopyMem(str, format, amount);
+			copy_bounded(str, size, written, format, amount);
 			format += amount;
-			str += amount;
 			written += amount;
 			continue;
 		}
@@ -127,8 +137,7 @@ int vsprintf(char * str, const char * format, va_list params){
 			case 'c': {
 				++format;
 				char c = (char)va_arg(params, int);
-				CopyMem(str, &c, sizeof(c));
-				++str;
+				copy_bounded(str, size, written, &c, 1);
 				++written;
 				break;
 			}
@@ -136,8 +145,7 @@ int vsprintf(char * str, const char * format, va_list params){
 				++format;
 				const char * s = va_arg(params, const char*);
 				int len = strlen(s);
-				CopyMem(str, s, len);
-				str += len;
+				copy_bounded(str, size, written, s, len);
 				written += len;
 				break;
 			}
@@ -150,8 +158,8 @@ int vsprintf(char * str, const char * format, va_list params){
 				
 				++format;
 				uint64_t n = va_arg(params, uint64_t);
-				int len = sprint_uint(str, n, base);
-				str += len;
+				int len = sprint_uint(num, n, base);
+				copy_bounded(str, size, written, num, len);
 				written += len;
 				break;
 			default:
@@ -159,6 +167,12 @@ int vsprintf(char * str, const char * format, va_list params){
 		}
 	}
 
-	*str = 0;
+	if(size > 0){
+		str[written < size ? written : size - 1] = 0;
+	}
 	return written;
-}
\ No newline at end of file
+}
+
+int vsprintf(char * str, const char * format, va_list params){
+	return vsnprintf(str, 0x7FFFFFFF, format, params);
+}
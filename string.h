@@ -8,5 +8,6 @@ int strlen(const char * str);
 int printf(const char * format, ...);
 int sprintf(char * str, const char * format, ...);
 int vsprintf(char * str, const char * format, va_list params);
+int vsnprintf(char * str, int size, const char * format, va_list params);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,98 @@
+#include "lib_uefi.h"
+#include "vmx_api.h"
+#include "vm_setup.h"
+#include "vmcs_cache.h"
+#include "regs.h"
+#include "smp.h"
+#include "tsc.h"
+#include "telemetry.h"
+
+/*
+
+Per-CPU telemetry
+
+Every CPU counts its exits in its own page-aligned TELEMETRY_CPU inside its state block, so VM
+exits on different cores never write to a shared cache line. The directory lists the blocks;
+VMCALL_GET_TELEMETRY returns its address and a monitoring agent in the guest reads the blocks
+from then on without causing any exit.
+
+With EPT the directory and the blocks are mapped read-only into the guest. Without EPT the guest
+sees all physical memory and nothing keeps it from writing them.
+
+*/
+
+TELEMETRY_DIRECTORY * telemetry_directory;
+
+uint64_t telemetry_directory_size(void){
+  return sizeof(TELEMETRY_DIRECTORY) + CPU_count * sizeof(uint64_t);
+}
+
+int telemetry_init(void){
+  EFI_PHYSICAL_ADDRESS addr;
+  UINTN pages = EFI_SIZE_TO_PAGES(telemetry_directory_size());
+
+  if(BS->AllocatePages(AllocateAnyPages, EfiRuntimeServicesData, pages, &addr) != EFI_SUCCESS){
+    return 0;
+  }
+  ZeroMem((void*)addr, pages * 4096);
+
+  telemetry_directory = (TELEMETRY_DIRECTORY*)addr;
+  telemetry_directory->magic = TELEMETRY_MAGIC;
+  telemetry_directory->version = TELEMETRY_VERSION;
+  telemetry_directory->cpu_count = CPU_count;
+  telemetry_directory->tsc_khz = tsc_khz;
+  telemetry_directory->cpu_block_size = sizeof(TELEMETRY_CPU);
+
+  return 1;
+}
+
+// block is zeroed, page aligned and in the CPU's state block
+void telemetry_cpu_init(HVM * hvm, TELEMETRY_CPU * block){
+  block->magic = TELEMETRY_MAGIC;
+  block->cpu = hvm->cpu_id;
+  block->apic_id = Proc_x2APIC_IDs[hvm->cpu_id];
+  hvm->telemetry = block;
+
+  if(telemetry_directory){
+    telemetry_directory->cpu_blocks[hvm->cpu_id] = (uint64_t)block;
+  }
+}
+
+void telemetry_error(HVM * hvm, uint32_t code, uint64_t exit_reason){
+  TELEMETRY_ERROR * err = &hvm->telemetry->last_error;
+
+  err->tsc = get_tsc();
+  err->code = code;
+  err->exit_reason = exit_reason;
+  err->exit_qualification = vmcs_read(hvm, EXIT_QUALIFICATION);
+  err->guest_rip = vmcs_read(hvm, GUEST_EIP);
+  ++err->count;
+}
+
+// A lazily built EPT doesn't map the page yet, ept_map_range() leaves existing leaves alone
+void telemetry_ept_protect_page(uint64_t * pml4t, uint64_t page){
+  ept_map_range(pml4t, 4, page, page + 4096);
+  ept_change_page_access(pml4t, page, EPT_READ, NULL, NULL);
+}
+
+// Called by ept_init() while no CPU uses the tables yet, so nothing needs to be invalidated
+void telemetry_ept_protect(uint64_t * pml4t){
+  uint64_t pages, i;
+  uint32_t cpu;
+
+  if(!telemetry_directory){
+    return;
+  }
+
+  pages = EFI_SIZE_TO_PAGES(telemetry_directory_size());
+  for(i = 0; i < pages; ++i){
+    telemetry_ept_protect_page(pml4t, (uint64_t)telemetry_directory + i * 4096);
+  }
+
+  pages = EFI_SIZE_TO_PAGES(sizeof(TELEMETRY_CPU));
+  for(cpu = 0; cpu < CPU_count; ++cpu){
+    for(i = 0; i < pages && telemetry_directory->cpu_blocks[cpu]; ++i){
+      telemetry_ept_protect_page(pml4t, telemetry_directory->cpu_blocks[cpu] + i * 4096);
+    }
+  }
+}
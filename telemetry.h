@@ -0,0 +1,66 @@
+#ifndef _TELEMETRY_
+#define _TELEMETRY_
+
+#include <stdint.h>
+#include "vmx_api.h"
+
+#define TELEMETRY_MAGIC 0x4D454C4554474221ULL // "!BGTELEM"
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_HYPERCALLS 16 // call numbers counted, see hypercall.h
+
+// Last error codes
+#define TELEMETRY_ERR_NONE 0
+#define TELEMETRY_ERR_UNKNOWN_EXIT 1 // no handler for the exit reason
+#define TELEMETRY_ERR_FAILED_VMENTRY 2
+#define TELEMETRY_ERR_EPT_VIOLATION 3 // not resolved by ept_handle_violation()
+
+typedef struct{
+  uint64_t tsc;
+  uint32_t code; // TELEMETRY_ERR_*
+  uint32_t exit_reason;
+  uint64_t exit_qualification;
+  uint64_t guest_rip;
+  uint64_t count; // errors so far
+} TELEMETRY_ERROR;
+
+/*
+  Written only by the CPU it belongs to, read by the guest through a read-only EPT mapping. Each
+  field is updated with a single store, so readers see consistent fields but no consistent set of
+  them. Exits answered by the vmx_exit fast path (CPUID, VMCALL ping) aren't counted here.
+*/
+typedef struct _TELEMETRY_CPU{
+  uint64_t magic;
+  uint32_t cpu;
+  uint32_t apic_id;
+  uint64_t last_exit_reason;
+  uint64_t last_exit_tsc;
+  uint64_t exits;
+  uint64_t root_cycles; // TSC cycles spent in vmexit_handler()
+  uint64_t prev_exit_reason; // the exit before last_exit_reason
+  uint64_t reserved[1];
+  TELEMETRY_ERROR last_error;
+  uint64_t exit_hits[VMX_EXIT_REASON_COUNT]; // per basic exit reason
+  uint64_t hypercalls[TELEMETRY_HYPERCALLS]; // per call number, VMCALL_PING only off the fast path
+  uint64_t hypercall_cycles[TELEMETRY_HYPERCALLS]; // TSC cycles in the call's handler
+  uint64_t hypercall_errors; // calls answered with an HC_ERR_* status
+} __attribute__((aligned(64))) TELEMETRY_CPU;
+
+// Returned by VMCALL_GET_TELEMETRY, followed by the address of every CPU's block
+typedef struct{
+  uint64_t magic;
+  uint32_t version;
+  uint32_t cpu_count;
+  uint64_t tsc_khz;
+  uint64_t cpu_block_size; // sizeof(TELEMETRY_CPU)
+  uint64_t cpu_blocks[];   // guest physical addresses, in MADT order
+} TELEMETRY_DIRECTORY;
+
+extern TELEMETRY_DIRECTORY * telemetry_directory;
+
+int telemetry_init(void);
+void telemetry_cpu_init(HVM * hvm, TELEMETRY_CPU * block);
+void telemetry_error(HVM * hvm, uint32_t code, uint64_t exit_reason);
+uint64_t telemetry_directory_size(void);
+void telemetry_ept_protect(uint64_t * pml4t);
+
+#endif
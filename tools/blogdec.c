@@ -0,0 +1,269 @@
+/*
+
+blogdec - turns a BlueGuard binary log dump back into text
+
+  blogdec blogfmt.bin blog.bin
+
+blogfmt.bin is the .blogfmt section of the very hv_driver.efi that wrote the dump (make blogfmt.bin),
+blog.bin is BLOG_DUMP_FILE from the EFI system partition or VMCALL_BLOG_DUMP output saved by the
+guest. Records of all CPUs are merged by TSC, times are microseconds since the oldest record.
+
+The structures below mirror blog.h and logring.h, which need the UEFI headers.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define BLOG_DUMP_MAGIC 0x504D5544474F4C42ULL
+#define BLOG_TABLE_MAGIC 0x00544D46474F4C42ULL
+#define BLOG_MAX_ARGS 8
+#define LOGRING_PAD 3
+#define LOGRING_BINARY 4
+#define LOGRING_ALIGN(n) (((n) + 7) & ~7ULL)
+
+typedef struct{
+  uint16_t level;
+  uint16_t category;
+  uint16_t nargs;
+  uint16_t line;
+  char fmt[];
+} BLOG_FORMAT;
+
+typedef struct{
+  uint32_t id;
+  uint32_t nargs;
+  uint64_t tsc;
+  uint64_t args[];
+} BLOG_RECORD;
+
+typedef struct{
+  uint64_t magic;
+  uint32_t cpu;
+  uint32_t apic_id;
+  uint64_t size;
+  uint64_t head;
+  uint64_t tail;
+  uint64_t records;
+  uint64_t drops;
+  uint64_t tsc_khz;
+} BLOG_DUMP_HEADER;
+
+typedef struct{
+  uint16_t type;
+  uint16_t len;
+  uint32_t reserved;
+} LOGRING_RECORD;
+
+typedef struct{
+  uint32_t cpu;
+  uint64_t tsc;
+  const BLOG_RECORD * rec;
+} ENTRY;
+
+const char * level_names[] = {"?", "ERROR", "WARN", "INFO", "DEBUG"};
+const char * category_names[] = {"exit", "smp", "ept", "inval", "cpuid"};
+
+uint8_t * read_file(const char * path, size_t * size){
+  FILE * f = fopen(path, "rb");
+  uint8_t * buf;
+  long len;
+
+  if(!f){
+    perror(path);
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  buf = malloc(len ? len : 1);
+  if(!buf || fread(buf, 1, len, f) != (size_t)len){
+    fprintf(stderr, "%s: read error\n", path);
+    fclose(f);
+    free(buf);
+    return NULL;
+  }
+
+  fclose(f);
+  *size = len;
+  return buf;
+}
+
+const char * category_name(uint16_t category){
+  uint32_t i;
+
+  for(i = 0; i < sizeof(category_names) / sizeof(category_names[0]); ++i){
+    if(category & (1 << i)) return category_names[i];
+  }
+  return "?";
+}
+
+// The hypervisor's printf() conversions: %u, %x, %b, %c and %%, all taking 64-bit arguments
+void print_record(const BLOG_FORMAT * format, const BLOG_RECORD * rec){
+  const char * p;
+  uint32_t arg = 0;
+  uint64_t value;
+  int bit;
+
+  for(p = format->fmt; *p; ++p){
+    if(*p == '\r') continue;
+    if(*p != '%' || !p[1]){
+      putchar(*p);
+      continue;
+    }
+
+    ++p;
+    if(*p == '%'){
+      putchar('%');
+      continue;
+    }
+    if(arg >= rec->nargs){
+      fputs("<missing>", stdout);
+      continue;
+    }
+
+    value = rec->args[arg++];
+    switch(*p){
+      case 'u':
+        printf("%llu", (unsigned long long)value);
+        break;
+      case 'x':
+        printf("0x%llx", (unsigned long long)value);
+        break;
+      case 'b':
+        for(bit = 63; bit > 0 && !(value >> bit & 1); --bit);
+        for(; bit >= 0; --bit) putchar('0' + (value >> bit & 1));
+        break;
+      case 'c':
+        putchar((char)value);
+        break;
+      default:
+        printf("<%%%c>", *p);
+        break;
+    }
+  }
+
+  if(p == format->fmt || p[-1] != '\n'){
+    putchar('\n');
+  }
+}
+
+// Adds the valid records of one ring to entries, returns the number added
+size_t collect_ring(const BLOG_DUMP_HEADER * hdr, const uint8_t * data, size_t table_size, ENTRY * entries){
+  uint64_t tail = hdr->tail;
+  const LOGRING_RECORD * lrec;
+  const BLOG_RECORD * rec;
+  size_t count = 0;
+  uint64_t offset, len;
+
+  if(hdr->head - tail > hdr->size){
+    tail = hdr->head - hdr->size;
+  }
+
+  while(tail < hdr->head){
+    offset = tail % hdr->size;
+    if(offset + sizeof(LOGRING_RECORD) > hdr->size) break;
+    lrec = (const LOGRING_RECORD*)(data + offset);
+    len = LOGRING_ALIGN(sizeof(LOGRING_RECORD) + lrec->len);
+    if(offset + len > hdr->size) break;
+
+    if(lrec->type == LOGRING_BINARY){
+      rec = (const BLOG_RECORD*)(lrec + 1);
+      if(lrec->len < sizeof(BLOG_RECORD) || rec->nargs > BLOG_MAX_ARGS ||
+         lrec->len < sizeof(BLOG_RECORD) + rec->nargs * 8 || rec->id < 8 ||
+         rec->id + sizeof(BLOG_FORMAT) > table_size){
+        fprintf(stderr, "CPU %u: bad record at %llu, stopping\n", hdr->cpu, (unsigned long long)tail);
+        break;
+      }
+      entries[count].cpu = hdr->cpu;
+      entries[count].tsc = rec->tsc;
+      entries[count].rec = rec;
+      ++count;
+    }
+    else if(lrec->type != LOGRING_PAD){
+      fprintf(stderr, "CPU %u: unknown record type %u at %llu, stopping\n", hdr->cpu, lrec->type,
+        (unsigned long long)tail);
+      break;
+    }
+
+    tail += len;
+  }
+
+  return count;
+}
+
+int compare_entries(const void * a, const void * b){
+  const ENTRY * x = a;
+  const ENTRY * y = b;
+
+  if(x->tsc != y->tsc) return x->tsc < y->tsc ? -1 : 1;
+  return x->cpu < y->cpu ? -1 : x->cpu > y->cpu;
+}
+
+int main(int argc, char ** argv){
+  uint8_t * table, * dump;
+  size_t table_size, dump_size, pos, count = 0, capacity = 0, i;
+  const BLOG_DUMP_HEADER * hdr;
+  const BLOG_FORMAT * format;
+  ENTRY * entries = NULL;
+  uint64_t tsc_khz = 0;
+
+  if(argc != 3){
+    fprintf(stderr, "usage: %s blogfmt.bin blog.bin\n", argv[0]);
+    return 2;
+  }
+
+  table = read_file(argv[1], &table_size);
+  dump = read_file(argv[2], &dump_size);
+  if(!table || !dump){
+    return 1;
+  }
+  if(table_size < 8 || *(uint64_t*)table != BLOG_TABLE_MAGIC){
+    fprintf(stderr, "%s: not a .blogfmt section\n", argv[1]);
+    return 1;
+  }
+
+  // Every record takes at least 24 bytes of ring, that bounds the entries of a ring
+  for(pos = 0; pos + sizeof(BLOG_DUMP_HEADER) <= dump_size; pos += sizeof(BLOG_DUMP_HEADER) + hdr->size){
+    hdr = (const BLOG_DUMP_HEADER*)(dump + pos);
+    if(hdr->magic != BLOG_DUMP_MAGIC || !hdr->size || hdr->size > dump_size - pos - sizeof(BLOG_DUMP_HEADER)){
+      fprintf(stderr, "%s: bad CPU header at %zu\n", argv[2], pos);
+      break;
+    }
+
+    printf("CPU %u (APIC ID %u): %llu records written, %llu lost\n", hdr->cpu, hdr->apic_id,
+      (unsigned long long)hdr->records, (unsigned long long)hdr->drops);
+    tsc_khz = hdr->tsc_khz;
+
+    capacity += hdr->size / 24;
+    entries = realloc(entries, capacity * sizeof(ENTRY));
+    if(!entries){
+      fprintf(stderr, "out of memory\n");
+      return 1;
+    }
+    count += collect_ring(hdr, (const uint8_t*)(hdr + 1), table_size, entries + count);
+  }
+
+  qsort(entries, count, sizeof(ENTRY), compare_entries);
+
+  for(i = 0; i < count; ++i){
+    format = (const BLOG_FORMAT*)(table + entries[i].rec->id);
+    if(tsc_khz){
+      printf("%12.3f ", (double)(entries[i].tsc - entries[0].tsc) * 1000 / tsc_khz);
+    }
+    else{
+      printf("%12llu ", (unsigned long long)(entries[i].tsc - entries[0].tsc));
+    }
+    printf("%3u %-5s %-5s %4u: ", entries[i].cpu, format->level <= 4 ? level_names[format->level] : "?",
+      category_name(format->category), format->line);
+    print_record(format, entries[i].rec);
+  }
+
+  free(entries);
+  free(dump);
+  free(table);
+  return 0;
+}
@@ -0,0 +1,212 @@
+/*
+
+mtrrtest - checks the MTRR resolver of mtrr.c on the build host
+
+  make mtrrtest
+
+Feeds synthetic fixed and variable MTRR sets to mtrr_range_type() and compares the type of each
+range with the one the Intel SDM (11.11.4.1) gives: UC wins over any overlap, WT wins over WB,
+other overlaps are undefined and resolved to UC, the fixed MTRRs take precedence below 1 MB and
+a range with more than one type is MTRR_TYPE_MIXED. mtrr_read() is run against a fake MSR file.
+
+mtrr.c is linked in as is, only get_msr() is provided here.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "../mtrr.h"
+
+#define KB 0x400ULL
+#define MB 0x100000ULL
+#define GB 0x40000000ULL
+#define PHYS_MASK 0xFFFFFF000ULL // 36-bit physical addresses
+
+MTRR_STATE state;
+int failures, checks;
+
+// Fake MSR file for mtrr_read()
+uint64_t msr_values[0x300];
+
+uint64_t get_msr(uint64_t index){
+  return index < sizeof(msr_values) / 8 ? msr_values[index] : 0;
+}
+
+uint32_t mtrr_fixed_index(uint64_t addr); // mtrr.c
+
+const char * type_name(uint8_t type){
+  switch(type){
+    case MTRR_TYPE_UC: return "UC";
+    case MTRR_TYPE_WC: return "WC";
+    case MTRR_TYPE_WT: return "WT";
+    case MTRR_TYPE_WP: return "WP";
+    case MTRR_TYPE_WB: return "WB";
+    case MTRR_TYPE_MIXED: return "MIXED";
+    default: return "?";
+  }
+}
+
+void reset(bool fixed_enabled, uint8_t def_type, uint8_t fixed_type){
+  memset(&state, 0, sizeof(state));
+  state.enabled = true;
+  state.fixed_enabled = fixed_enabled;
+  state.def_type = def_type;
+  state.var_count = 8;
+  memset(state.fixed, fixed_type, sizeof(state.fixed));
+}
+
+// Variable MTRR n for the naturally aligned power of two [base, base + size)
+void set_var(uint32_t n, uint64_t base, uint64_t size, uint8_t type){
+  state.var[n].base = base | type;
+  state.var[n].mask = (~(size - 1) & PHYS_MASK) | MTRR_PHYSMASK_VALID;
+}
+
+void set_fixed(uint64_t base, uint64_t end, uint8_t type){
+  uint64_t addr;
+
+  for(addr = base; addr < end; addr += 4 * KB){
+    state.fixed[mtrr_fixed_index(addr)] = type;
+  }
+}
+
+void check(const char * what, uint64_t base, uint64_t size, uint8_t expected){
+  uint8_t type = mtrr_range_type(&state, base, size);
+
+  ++checks;
+  if(type != expected){
+    printf("FAIL %s: [0x%llx, 0x%llx) is %s, expected %s\n", what, (unsigned long long)base,
+      (unsigned long long)(base + size), type_name(type), type_name(expected));
+    ++failures;
+  }
+}
+
+void test_default(void){
+  reset(false, MTRR_TYPE_WB, MTRR_TYPE_WB);
+  check("default type", 4 * GB, GB, MTRR_TYPE_WB);
+  check("default type", 0, 2 * MB, MTRR_TYPE_WB);
+
+  state.enabled = false;
+  check("MTRRs disabled", 4 * GB, GB, MTRR_TYPE_UC);
+}
+
+void test_variable(void){
+  reset(false, MTRR_TYPE_WB, MTRR_TYPE_WB);
+  set_var(0, 3 * GB, GB, MTRR_TYPE_UC);
+  set_var(1, 2 * GB + 256 * MB, 256 * MB, MTRR_TYPE_WC);
+
+  check("inside", 3 * GB, GB, MTRR_TYPE_UC);
+  check("inside", 3 * GB + 2 * MB, 2 * MB, MTRR_TYPE_UC);
+  check("outside", 2 * GB + 512 * MB, 2 * MB, MTRR_TYPE_WB);
+  check("outside", 4 * GB, GB, MTRR_TYPE_WB);
+  check("partly covered", 2 * GB, GB, MTRR_TYPE_MIXED);
+  check("partly covered", 2 * GB + 256 * MB, 512 * MB, MTRR_TYPE_MIXED);
+  check("exactly covered", 2 * GB + 256 * MB, 256 * MB, MTRR_TYPE_WC);
+
+  state.var[0].mask &= ~MTRR_PHYSMASK_VALID;
+  check("invalid MTRR", 3 * GB, GB, MTRR_TYPE_WB);
+}
+
+void test_overlap(void){
+  reset(false, MTRR_TYPE_UC, MTRR_TYPE_UC);
+  set_var(0, 0, 4 * GB, MTRR_TYPE_WB);
+  set_var(1, 0xE0000000, 512 * MB, MTRR_TYPE_UC);
+  set_var(2, 16 * MB, 16 * MB, MTRR_TYPE_WT);
+  set_var(3, 64 * MB, 2 * MB, MTRR_TYPE_WC);
+  set_var(4, 128 * MB, 2 * MB, MTRR_TYPE_WT);
+  set_var(5, 128 * MB, 2 * MB, MTRR_TYPE_UC);
+
+  check("UC over WB", 0xE0000000, 2 * MB, MTRR_TYPE_UC);
+  check("UC over WB", 0xE0000000, 512 * MB, MTRR_TYPE_UC);
+  check("UC inside a WB gigabyte", 3 * GB, GB, MTRR_TYPE_MIXED);
+  check("WT over WB", 16 * MB, 2 * MB, MTRR_TYPE_WT);
+  check("WT over WB", 16 * MB, 16 * MB, MTRR_TYPE_WT);
+  check("WT inside WB", 0, 32 * MB, MTRR_TYPE_MIXED);
+  check("WC over WB is undefined", 64 * MB, 2 * MB, MTRR_TYPE_UC);
+  check("UC over WT and WB", 128 * MB, 2 * MB, MTRR_TYPE_UC);
+  check("plain WB", 256 * MB, 2 * MB, MTRR_TYPE_WB);
+  check("above the WB MTRR", 4 * GB, GB, MTRR_TYPE_UC);
+
+  // Precedence doesn't depend on the order of the MTRRs
+  reset(false, MTRR_TYPE_UC, MTRR_TYPE_UC);
+  set_var(0, 16 * MB, 16 * MB, MTRR_TYPE_WT);
+  set_var(1, 0, 4 * GB, MTRR_TYPE_WB);
+  set_var(2, 16 * MB, 2 * MB, MTRR_TYPE_UC);
+  check("WT before WB", 18 * MB, 2 * MB, MTRR_TYPE_WT);
+  check("UC last", 16 * MB, 2 * MB, MTRR_TYPE_UC);
+}
+
+void test_fixed(void){
+  reset(true, MTRR_TYPE_WB, MTRR_TYPE_WB);
+  set_var(0, 0, 4 * GB, MTRR_TYPE_WB);
+  set_fixed(0xA0000, 0xC0000, MTRR_TYPE_UC); // VGA, 16 KB ranges
+  set_fixed(0xC8000, 0xC9000, MTRR_TYPE_WP); // one 4 KB range
+
+  check("64 KB range", 0x10000, 4 * KB, MTRR_TYPE_WB);
+  check("16 KB range", 0xA0000, 4 * KB, MTRR_TYPE_UC);
+  check("16 KB range", 0xBC000, 4 * KB, MTRR_TYPE_UC);
+  check("4 KB range", 0xC8000, 4 * KB, MTRR_TYPE_WP);
+  check("4 KB range", 0xC9000, 4 * KB, MTRR_TYPE_WB);
+  check("fixed boundary", 0x9F000, 4 * KB, MTRR_TYPE_WB);
+  check("mixed fixed ranges", 0, 2 * MB, MTRR_TYPE_MIXED);
+
+  set_fixed(0, MTRR_FIXED_END, MTRR_TYPE_WB);
+  check("uniform fixed and variable", 0, 2 * MB, MTRR_TYPE_WB);
+  check("uniform fixed and variable", 0, GB, MTRR_TYPE_WB);
+
+  // Below 1 MB the fixed MTRRs win over variable ones, above it they don't apply
+  set_var(1, 0, MB, MTRR_TYPE_UC);
+  check("fixed over variable UC", 0x1000, 4 * KB, MTRR_TYPE_WB);
+  check("variable UC across 1 MB", 0, 2 * MB, MTRR_TYPE_MIXED);
+
+  reset(true, MTRR_TYPE_UC, MTRR_TYPE_WB);
+  check("fixed WB, default UC above", 0, 2 * MB, MTRR_TYPE_MIXED);
+  check("fixed WB, default UC above", 0, MB, MTRR_TYPE_WB);
+
+  state.fixed_enabled = false;
+  check("fixed MTRRs disabled", 0xA0000, 4 * KB, MTRR_TYPE_UC);
+}
+
+void test_read(void){
+  uint32_t i;
+
+  memset(msr_values, 0, sizeof(msr_values));
+  msr_values[MSR_IA32_MTRRCAP] = MTRRCAP_FIX | 2;
+  msr_values[MSR_IA32_MTRR_DEF_TYPE] = MTRR_DEF_TYPE_E | MTRR_DEF_TYPE_FE | MTRR_TYPE_UC;
+  msr_values[MSR_IA32_MTRR_PHYSBASE0] = 0 | MTRR_TYPE_WB;
+  msr_values[MSR_IA32_MTRR_PHYSBASE0 + 1] = (~(2 * GB - 1) & PHYS_MASK) | MTRR_PHYSMASK_VALID;
+  msr_values[MSR_IA32_MTRR_PHYSBASE0 + 2] = 0x80000000 | MTRR_TYPE_UC; // mask not valid
+  msr_values[MSR_IA32_MTRR_FIX64K_00000] = 0x0606060606060606ULL;
+  msr_values[MSR_IA32_MTRR_FIX16K_80000] = 0x0606060606060606ULL;
+  msr_values[MSR_IA32_MTRR_FIX16K_A0000] = 0; // A0000-BFFFF UC
+  for(i = 0; i < 8; ++i){
+    msr_values[MSR_IA32_MTRR_FIX4K_C0000 + i] = 0x0505050505050505ULL; // C0000-FFFFF WP
+  }
+  msr_values[MSR_IA32_MTRR_FIX4K_C0000 + 7] = 0x0605050505050505ULL; // except FF000-FFFFF WB
+
+  memset(&state, 0xCC, sizeof(state));
+  mtrr_read(&state);
+
+  ++checks;
+  if(!state.enabled || !state.fixed_enabled || state.def_type != MTRR_TYPE_UC || state.var_count != 2){
+    printf("FAIL mtrr_read(): enabled %d, fixed %d, default %s, %u variable MTRRs\n",
+      state.enabled, state.fixed_enabled, type_name(state.def_type), state.var_count);
+    ++failures;
+  }
+  check("read 64 KB range", 0x70000, 4 * KB, MTRR_TYPE_WB);
+  check("read 16 KB range", 0xA4000, 4 * KB, MTRR_TYPE_UC);
+  check("read 4 KB range", 0xC0000, 4 * KB, MTRR_TYPE_WP);
+  check("read last 4 KB range", 0xFF000, 4 * KB, MTRR_TYPE_WB);
+  check("read variable MTRR", 2 * MB, 2 * MB, MTRR_TYPE_WB);
+  check("read invalid MTRR", 2 * GB, 2 * MB, MTRR_TYPE_UC);
+}
+
+int main(void){
+  test_default();
+  test_variable();
+  test_overlap();
+  test_fixed();
+  test_read();
+
+  printf("%d of %d checks failed\n", failures, checks);
+  return failures != 0;
+}
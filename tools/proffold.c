@@ -0,0 +1,245 @@
+/*
+
+proffold - folds BlueGuard profiler dumps into flame graph input
+
+  proffold [-c] [-e] [-m symbols] dump.bin...
+
+A dump is the buffer VMCALL_PROFILE_DUMP filled, saved as is by the guest agent; several dumps
+of one run may be given. Every sample becomes a stack of address space (CR3), privilege level
+and RIP, printed as "frame;frame;frame count" lines for flamegraph.pl or speedscope.
+
+  -c  start each stack with the CPU
+  -e  end each stack with the exit the guest took before the sample
+  -m  resolve RIPs with a symbol map, "address name" or /proc/kallsyms lines
+
+The structures below mirror profile.h, which needs the UEFI headers.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define PROFILE_MAGIC 0x464F525047424221ULL
+#define PROFILE_MODE_REAL 0
+#define PROFILE_MODE_PROTECTED 1
+#define PROFILE_MODE_LONG 2
+
+typedef struct{
+  uint64_t tsc;
+  uint64_t rip;
+  uint64_t cr3;
+  uint16_t cpu;
+  uint8_t cpl;
+  uint8_t mode;
+  uint16_t prev_exit_reason;
+  uint16_t exits;
+} PROFILE_SAMPLE;
+
+typedef struct{
+  uint64_t magic;
+  uint32_t cpu_count;
+  uint32_t hz;
+  uint64_t tsc_khz;
+  uint32_t samples;
+  uint32_t lost;
+} PROFILE_DUMP_HEADER;
+
+typedef struct{
+  uint64_t addr;
+  char * name;
+} SYMBOL;
+
+SYMBOL * symbols;
+size_t symbol_count;
+
+uint8_t * read_file(const char * path, size_t * size){
+  FILE * f = fopen(path, "rb");
+  uint8_t * buf;
+  long len;
+
+  if(!f){
+    perror(path);
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  buf = malloc(len ? len : 1);
+  if(!buf || fread(buf, 1, len, f) != (size_t)len){
+    fprintf(stderr, "%s: read error\n", path);
+    fclose(f);
+    free(buf);
+    return NULL;
+  }
+
+  fclose(f);
+  *size = len;
+  return buf;
+}
+
+int compare_symbols(const void * a, const void * b){
+  const SYMBOL * x = a;
+  const SYMBOL * y = b;
+
+  return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+int load_symbols(const char * path){
+  FILE * f = fopen(path, "r");
+  char line[512], name[256], type[16];
+  unsigned long long addr;
+  size_t capacity = 0;
+  int fields;
+
+  if(!f){
+    perror(path);
+    return 0;
+  }
+
+  while(fgets(line, sizeof(line), f)){
+    fields = sscanf(line, "%llx %15s %255s", &addr, type, name);
+    if(fields == 2){
+      strcpy(name, type); // "address name"
+    }
+    else if(fields != 3){
+      continue;
+    }
+
+    if(symbol_count == capacity){
+      capacity = capacity ? capacity * 2 : 4096;
+      symbols = realloc(symbols, capacity * sizeof(SYMBOL));
+      if(!symbols){
+        fclose(f);
+        return 0;
+      }
+    }
+    symbols[symbol_count].addr = addr;
+    symbols[symbol_count].name = strdup(name);
+    ++symbol_count;
+  }
+
+  fclose(f);
+  qsort(symbols, symbol_count, sizeof(SYMBOL), compare_symbols);
+  return 1;
+}
+
+// Nearest symbol at or below addr
+const char * lookup_symbol(uint64_t addr){
+  size_t low = 0, high = symbol_count;
+
+  while(low < high){
+    size_t mid = (low + high) / 2;
+    if(symbols[mid].addr <= addr){
+      low = mid + 1;
+    }
+    else{
+      high = mid;
+    }
+  }
+
+  return low ? symbols[low - 1].name : NULL;
+}
+
+char * fold_sample(const PROFILE_SAMPLE * s, int with_cpu, int with_exit){
+  char stack[512];
+  const char * symbol = lookup_symbol(s->rip);
+  int len = 0;
+
+  if(with_cpu){
+    len += snprintf(stack + len, sizeof(stack) - len, "cpu %u;", s->cpu);
+  }
+  len += snprintf(stack + len, sizeof(stack) - len, "cr3 0x%llx;", (unsigned long long)(s->cr3 & ~0xFFFULL));
+
+  if(s->mode == PROFILE_MODE_REAL){
+    len += snprintf(stack + len, sizeof(stack) - len, "real mode;");
+  }
+  else{
+    len += snprintf(stack + len, sizeof(stack) - len, "%s%s;", s->cpl ? "user" : "kernel",
+      s->mode == PROFILE_MODE_LONG ? "" : " 32-bit");
+  }
+
+  if(symbol){
+    len += snprintf(stack + len, sizeof(stack) - len, "%s", symbol);
+  }
+  else{
+    len += snprintf(stack + len, sizeof(stack) - len, "0x%llx", (unsigned long long)s->rip);
+  }
+
+  if(with_exit){
+    snprintf(stack + len, sizeof(stack) - len, ";after exit %u", s->prev_exit_reason);
+  }
+
+  return strdup(stack);
+}
+
+int compare_stacks(const void * a, const void * b){
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+int main(int argc, char ** argv){
+  int with_cpu = 0, with_exit = 0;
+  const PROFILE_DUMP_HEADER * hdr;
+  const PROFILE_SAMPLE * samples;
+  char ** stacks = NULL;
+  size_t count = 0, capacity = 0, size, i, run;
+  uint64_t lost = 0;
+  uint8_t * data;
+  int arg;
+
+  for(arg = 1; arg < argc && argv[arg][0] == '-'; ++arg){
+    if(!strcmp(argv[arg], "-c")){
+      with_cpu = 1;
+    }
+    else if(!strcmp(argv[arg], "-e")){
+      with_exit = 1;
+    }
+    else if(!strcmp(argv[arg], "-m") && arg + 1 < argc){
+      if(!load_symbols(argv[++arg])) return 1;
+    }
+    else{
+      break;
+    }
+  }
+  if(arg >= argc){
+    fprintf(stderr, "usage: %s [-c] [-e] [-m symbols] dump.bin...\n", argv[0]);
+    return 1;
+  }
+
+  for(; arg < argc; ++arg){
+    data = read_file(argv[arg], &size);
+    if(!data) return 1;
+
+    hdr = (const PROFILE_DUMP_HEADER*)data;
+    if(size < sizeof(*hdr) || hdr->magic != PROFILE_MAGIC ||
+       size < sizeof(*hdr) + (uint64_t)hdr->samples * sizeof(PROFILE_SAMPLE)){
+      fprintf(stderr, "%s: not a profiler dump\n", argv[arg]);
+      return 1;
+    }
+
+    samples = (const PROFILE_SAMPLE*)(hdr + 1);
+    for(i = 0; i < hdr->samples; ++i){
+      if(count == capacity){
+        capacity = capacity ? capacity * 2 : 65536;
+        stacks = realloc(stacks, capacity * sizeof(char*));
+        if(!stacks) return 1;
+      }
+      stacks[count++] = fold_sample(&samples[i], with_cpu, with_exit);
+    }
+    lost += hdr->lost;
+    free(data);
+  }
+
+  qsort(stacks, count, sizeof(char*), compare_stacks);
+  for(i = 0; i < count; i += run){
+    for(run = 1; i + run < count && !strcmp(stacks[i], stacks[i + run]); ++run);
+    printf("%s %zu\n", stacks[i], run);
+  }
+
+  if(lost){
+    fprintf(stderr, "%llu samples were lost, the agent didn't dump often enough\n", (unsigned long long)lost);
+  }
+  return 0;
+}
@@ -0,0 +1,21 @@
+#include "lib_uefi.h"
+#include "regs.h"
+#include "tsc.h"
+
+uint64_t tsc_khz; // TSC ticks per millisecond, 0 until tsc_calibrate()
+
+// Measures the TSC against the boot services stall, boot services only
+void tsc_calibrate(void){
+  uint64_t start = get_tsc();
+
+  BS->Stall(10 * 1000); // 10 ms
+  tsc_khz = (get_tsc() - start) / 10;
+}
+
+uint64_t tsc_to_us(uint64_t cycles){
+  if(!tsc_khz){
+    return 0;
+  }
+
+  return cycles * 1000 / tsc_khz;
+}
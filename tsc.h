@@ -0,0 +1,11 @@
+#ifndef _TSC_
+#define _TSC_
+
+#include <stdint.h>
+
+extern uint64_t tsc_khz;
+
+void tsc_calibrate(void);
+uint64_t tsc_to_us(uint64_t cycles);
+
+#endif
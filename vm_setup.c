@@ -7,8 +7,23 @@
 #include "regs.h"
 #include "string.h"
 #include "smp.h"
+#include "msr_bitmap.h"
+#include "cpuid.h"
+#include "vpid.h"
+#include "mtrr.h"
+#include "tsc.h"
+#include "spinlock.h"
+#include "inval.h"
+#include "telemetry.h"
+#include "dirty.h"
 
 FEATURES features;
+EPT_STATS ept_stats;
+EPT_POOL ept_pool;
+LOCK_STATS ept_lock_stats = {"ept"};
+ticket_lock_t ept_lock = {0, 0, &ept_lock_stats}; // serializes changes to the shared EPT tables
+EPT_RANGE * ept_ranges; // memory map ranges kept for EPT_LAZY
+UINTN ept_range_count;
 
 
 void set_guest_selector(uint64_t gdt_base, uint32_t reg, uint64_t sel){
@@ -143,12 +158,14 @@ void vm_start(void){
 
 void vmcs_init(HVM * hvm){
   uint64_t cr0, cr3, cr4, sysenter_cs, sysenter_esp, sysenter_eip, debugctl;
+  uint64_t rax = 1, rbx, rcx = 0, rdx;
+  uint32_t pin_ctls, secondary_ctls;
   uint64_t base = (uint64_t)hvm->st->gdt_base;
   uint64_t tr_sel = hvm->st->tr_sel;
   uint64_t tss_base = (uint64_t)hvm->st->tss_base;
   //EFI_STATUS st;
   
-  vmx_write(HOST_IDTR_BASE, hvm->st->idt_base);
+  vmx_write(HOST_IDTR_BASE, hvm->st->host_idt_base);
   vmx_write(GUEST_IDTR_BASE, hvm->st->idt_base);
   vmx_write(GUEST_IDTR_LIMIT, hvm->st->idt_limit);
 
@@ -216,7 +233,9 @@ void vmcs_init(HVM * hvm){
   vmx_write(GUEST_CR0, cr0);
   vmx_write(HOST_CR3, hvm->st->host_cr3);
   vmx_write(GUEST_CR3, cr3);
-  vmx_write(HOST_CR4, cr4);
+  // XSAVE and XSETBV in root mode: handle_xsetbv() runs whether or not hvm->xstate is set up
+  emu_cpuid(&rax, &rbx, &rcx, &rdx);
+  vmx_write(HOST_CR4, rcx & CPUID_01_ECX_XSAVE ? cr4 | X86_CR4_OSXSAVE : cr4);
   vmx_write(GUEST_CR4, cr4);
 
   vmx_write(GUEST_DR7, 0x400);
@@ -263,6 +282,13 @@ void vmcs_init(HVM * hvm){
   // It will end up as the last element of GUEST_REGS structure
   *(HVM**)(hvm->host_stack + 0xFFF8) = hvm;
 
+  // CPUID and VMCALL ping exits are serviced by the vmx_exit fast path
+  cpuid_init(hvm);
+  hvm->apic_id = hvm->cpuid_table->apic_id;
+  hvm->inval_generation = inval_generation;
+  hvm->guest_XCR0 = (cr4 & X86_CR4_OSXSAVE) ? get_xcr0() : 1; // XGETBV #UDs without CR4.OSXSAVE
+  hvm->fast_exit_enabled = true;
+
   vmx_write(HOST_ESP, hvm->host_stack + 0xFFF8);
   //vmx_write(HOST_EIP, (uint64_t)ptr_vmx_exit);
   vmx_write(HOST_EIP, (uint64_t)vmx_exit);
@@ -271,26 +297,41 @@ void vmcs_init(HVM * hvm){
   vmx_write(IO_BITMAP_A_HIGH, hvm->io_bitmap_a >> 32);
 
   vmx_write(IO_BITMAP_B, hvm->io_bitmap_b & 0xFFFFFFFF);
-  vmx_write(IO_BITMAP_B_HIGH, hvm->io_bitmap_b >> 32);
+  vmx_write(IO_BITMAP_B_HIGH, hvm->io_bitmap_b >> 32);*/
 
-  vmx_write(MSR_BITMAP, hvm->msr_bitmap & 0xFFFFFFFF);
-  vmx_write(MSR_BITMAP_HIGH, hvm->msr_bitmap >> 32);*/
+  // Only the MSRs virtualized by the handlers cause VM exits, the rest go straight to the hardware
+  msr_bitmap_init(hvm);
 
   /*vmx_write(TSC_OFFSET, 0);
   vmx_write(TSC_OFFSET_HIGH, 0);*/
 
-  //disable Vmexit by Extern-interrupt,NMI and Virtual NMI
-  vmx_write(PIN_BASED_VM_EXEC_CONTROL, init_control_field(0, MSR_IA32_VMX_PINBASED_CTLS));
+  // NMIs exit so inval_commit() can kick CPUs running the guest, external interrupts don't. With
+  // virtual NMIs the CPU tracks the guest's NMI blocking and NMI-window exits tell nmi_sync() when
+  // a pending NMI can be injected.
+  pin_ctls = init_control_field(PIN_BASED_NMI_EXITING | PIN_BASED_VIRTUAL_NMIS, MSR_IA32_VMX_PINBASED_CTLS);
+  vmx_write(PIN_BASED_VM_EXEC_CONTROL, pin_ctls);
+  if(pin_ctls & PIN_BASED_VIRTUAL_NMIS){
+    hvm->nmi_window_exiting = init_control_field(CPU_BASED_NMI_WINDOW_EXITING, MSR_IA32_VMX_PROCBASED_CTLS) & CPU_BASED_NMI_WINDOW_EXITING;
+  }
+
+  // Tag guest TLB entries so VM entries/exits don't flush them
+  secondary_ctls = vpid_init(hvm);
 
-  //CPU_BASED_ACTIVATE_MSR_BITMAP
 #if EPT_ENABLED
-  vmx_write(PRIMARY_CPU_BASED_VM_EXEC_CONTROL, init_control_field(VM_EXEC_PROCBASED_CTLS2_ENABLE, MSR_IA32_VMX_PROCBASED_CTLS));
-  vmx_write(SECONDARY_CPU_BASED_VM_EXEC_CONTROL, init_control_field(VM_EXEC_UG | VM_EXEC_EPT, MSR_IA32_VMX_PROCBASED_CTLS2));
-  vmx_write(EPT_POINTER_FULL, hvm->st->ept_area | 0x18); // 5:3 (page-walk length), 2:0 (Mem. type UC)
-#else
-  vmx_write(PRIMARY_CPU_BASED_VM_EXEC_CONTROL, init_control_field(0, MSR_IA32_VMX_PROCBASED_CTLS));
+  if(features.ept){
+    secondary_ctls |= VM_EXEC_UG | VM_EXEC_EPT;
+    vmx_write(EPT_POINTER_FULL, ept_pointer(hvm));
+  }
 #endif
 
+  if(secondary_ctls){
+    vmx_write(PRIMARY_CPU_BASED_VM_EXEC_CONTROL, init_control_field(CPU_BASED_ACTIVATE_MSR_BITMAP | VM_EXEC_PROCBASED_CTLS2_ENABLE, MSR_IA32_VMX_PROCBASED_CTLS));
+    vmx_write(SECONDARY_CPU_BASED_VM_EXEC_CONTROL, init_control_field(secondary_ctls, MSR_IA32_VMX_PROCBASED_CTLS2));
+  }
+  else{
+    vmx_write(PRIMARY_CPU_BASED_VM_EXEC_CONTROL, init_control_field(CPU_BASED_ACTIVATE_MSR_BITMAP, MSR_IA32_VMX_PROCBASED_CTLS));
+  }
+
   //print(L"CPU_BASED_VM_EXEC_CONTROL: "); print_uintb(vmx_read(PRIMARY_CPU_BASED_VM_EXEC_CONTROL)); print(L"\r\n");
 
   vmx_write(VM_EXIT_CONTROLS, init_control_field(VM_EXIT_IA32E_MODE | VM_EXIT_SAVE_IA32_EFER | VM_EXIT_ACK_INTR_ON_EXIT, MSR_IA32_VMX_EXIT_CTLS));
@@ -346,19 +387,19 @@ void vmcs_init(HVM * hvm){
   print(L"Guest GS limit: "); print_uintx(vmx_read(GUEST_GS_LIMIT)); print(L"\r\n");*/
 }
 
-uint64_t get_max_memory_addr(void){
+// Reads the UEFI memory map into sorted, merged physical ranges, returns the number of ranges
+UINTN ept_read_memory_map(EPT_RANGE ** ranges){
   UINTN mem_map_size = 0;
   UINTN map_key, desc_size;
   UINT32 desc_version;
-  uint64_t max_phys_addr = 0;
   EFI_MEMORY_DESCRIPTOR * mem_map = NULL;
   EFI_MEMORY_DESCRIPTOR * desc;
   void * mem_map_end;
   EFI_STATUS st;
+  EPT_RANGE range;
+  UINTN count = 0, i, j;
 
   BS->GetMemoryMap(&mem_map_size, mem_map, &map_key, &desc_size, &desc_version);
-  bsp_printf("mem_map_size: %u\r\n", mem_map_size);
-
   BS->AllocatePool(EfiRuntimeServicesData, mem_map_size, (void**)&mem_map);
   
   do{
@@ -369,138 +410,555 @@ uint64_t get_max_memory_addr(void){
       BS->AllocatePool(EfiRuntimeServicesData, mem_map_size, (void**)&mem_map);
     }
     else{
-      bsp_printf("mem_map_size: %u\r\n", mem_map_size);
       break;
     }
   } while(true);
 
+  BS->AllocatePool(EfiRuntimeServicesData, (mem_map_size / desc_size) * sizeof(EPT_RANGE), (void**)ranges);
+
   desc = mem_map;
   mem_map_end = (uint8_t*)mem_map + mem_map_size;
 
   while(desc != mem_map_end){
-    uint64_t phys_end = desc->PhysicalStart + (desc->NumberOfPages * 4096) - 1;
-    if(phys_end > max_phys_addr){
-      max_phys_addr = phys_end;
+    range.start = desc->PhysicalStart;
+    range.end = desc->PhysicalStart + desc->NumberOfPages * 4096;
+
+    // Insertion sort, the map is usually sorted already
+    for(i = count; i > 0 && (*ranges)[i - 1].start > range.start; --i){
+      (*ranges)[i] = (*ranges)[i - 1];
     }
+    (*ranges)[i] = range;
+    ++count;
 
     desc = (EFI_MEMORY_DESCRIPTOR*)((uint8_t*)desc + desc_size);
   }
 
   BS->FreePool(mem_map);
 
-  bsp_printf("max_phys_addr: 0x%x\r\n", max_phys_addr);
-  return max_phys_addr;
+  // Merge adjacent and overlapping descriptors
+  for(i = 0, j = 1; j < count; ++j){
+    if((*ranges)[j].start <= (*ranges)[i].end){
+      if((*ranges)[j].end > (*ranges)[i].end){
+        (*ranges)[i].end = (*ranges)[j].end;
+      }
+    }
+    else{
+      (*ranges)[++i] = (*ranges)[j];
+    }
+  }
+
+  return count ? i + 1 : 0;
 }
 
-int ept_init(HVM * hvm){
-  uint64_t rax, rbx, rcx, rdx;
-  uint64_t i, j, k;
-  uint64_t * pml4t = (uint64_t*)hvm->st->ept_area;
-  uint64_t * pdpt = pml4t + 512;
-  uint64_t * pdt;
-  uint8_t phys_addr_width;
-  uint64_t pml4e_count, pdpte_count, pdte_count;
-  int64_t tmp;
-  uint64_t increment;
-  uint64_t max_phys_addr = get_max_memory_addr();
-  uint64_t max_addr_bits = 0;
-  EFI_STATUS err;
-
-  uint64_t ept_area_size;
-  uint64_t ept_capabilities = get_msr(MSR_IA32_VMX_EPT_VPID_CAP);
-  features.ept_cap_2MB_page = ept_capabilities & 0x10000;
-  //features.ept_cap_1GB_page = ept_capabilities & 0x20000;
-  features.ept_cap_1GB_page = 0;
+// 6 (accessed and dirty flags), 5:3 (page-walk length), 2:0 (memory type used for the EPT paging structures).
+// With A/D flags the CPU's accesses to guest paging structures count as writes for the EPT.
+uint64_t ept_pointer(HVM * hvm){
+  uint64_t eptp = hvm->st->ept_area | EPTP_WALK_LENGTH_4 | (features.ept_ad ? EPTP_AD : 0);
 
+  if(get_msr(MSR_IA32_VMX_EPT_VPID_CAP) & EPT_CAP_WB){
+    return eptp | MTRR_TYPE_WB;
+  }
 
-  rax = 0x80000008;
-  emu_cpuid(&rax, &rbx, &rcx, &rdx);
-  phys_addr_width = rax & 0xFF;
+  return eptp | MTRR_TYPE_UC;
+}
+
+// Paging-structure pages come from the pool once the guest runs. While ept_init() builds the
+// initial tables they come from boot services, so the whole pool is left for runtime.
+uint64_t * ept_alloc_table(void){
+  EFI_PHYSICAL_ADDRESS table = 0xFFFFFFFF;
+
+  if(ept_pool.runtime || BS->AllocatePages(AllocateMaxAddress, EfiRuntimeServicesData, 1, &table) != EFI_SUCCESS){
+    if(!ept_pool.free){
+      return NULL;
+    }
+    table = (EFI_PHYSICAL_ADDRESS)ept_pool.free;
+    ept_pool.free = *(uint64_t**)ept_pool.free;
+    --ept_pool.free_count;
+  }
+  ZeroMem((void*)table, 4096);
+  ++ept_stats.tables;
+
+  return (uint64_t*)table;
+}
+
+void ept_free_table(uint64_t * table){
+  *(uint64_t**)table = ept_pool.free;
+  ept_pool.free = table;
+  ++ept_pool.free_count;
+  --ept_stats.tables;
+}
 
-  pml4e_count = (1ULL << (phys_addr_width - 30 - 9));
-  bsp_printf("Physical-address width: %u, pml4e_count: %u\r\n", phys_addr_width, pml4e_count);
+int ept_pool_init(void){
+  EFI_PHYSICAL_ADDRESS base = 0xFFFFFFFF;
+  uint32_t i;
 
+  if(BS->AllocatePages(AllocateMaxAddress, EfiRuntimeServicesData, EPT_POOL_PAGES, &base) != EFI_SUCCESS){
+    return 0;
+  }
 
-  while(max_phys_addr){
-    ++max_addr_bits;
-    max_phys_addr >>= 1;
+  ept_pool.free = NULL;
+  ept_pool.free_count = 0;
+  for(i = EPT_POOL_PAGES; i > 0; --i){
+    *(uint64_t**)(base + (i - 1) * 4096) = ept_pool.free;
+    ept_pool.free = (uint64_t*)(base + (i - 1) * 4096);
+    ++ept_pool.free_count;
   }
 
-  bsp_printf("Max address bits: %u\r\n", max_addr_bits);
+  return 1;
+}
 
-  pdte_count = 512;
-  pdpte_count = (1ULL << (max_addr_bits - 30));
-  tmp = max_addr_bits - 39;
-  if(tmp < 0) tmp = 0;
-  tmp = 1ULL << tmp;
-  if(tmp < pml4e_count){
-    pml4e_count = tmp;
+bool ept_leaf_supported(int level){
+  switch(level){
+    case 1:
+      return true;
+    case 2:
+      return features.ept_cap_2MB_page;
+    case 3:
+      return features.ept_cap_1GB_page;
+    default:
+      return false;
   }
+}
 
-  bsp_printf("pml4e_count: %u, pdpte_count: %u, pdte_count: %u\r\n", pml4e_count, pdpte_count, pdte_count);
+// Identity maps [start, end) below the table of the given level (4: PML4 ... 1: PT). Every entry
+// fully inside the range becomes the largest leaf the CPU supports and the MTRRs allow, only the
+// unaligned edges and mixed MTRR ranges get tables of smaller leaves.
+int ept_map_range(uint64_t * table, int level, uint64_t start, uint64_t end){
+  uint64_t size = EPT_LEVEL_SIZE(level);
+  uint64_t entry_base, next;
+  uint64_t * entry;
+  uint8_t type;
+
+  while(start < end){
+    entry = &table[(start / size) & 0x1FF];
+    entry_base = start & ~(size - 1);
+    next = entry_base + size;
+
+    if(!(*entry & EPT_RWX) && start == entry_base && next <= end && ept_leaf_supported(level)){
+      type = mtrr_range_type(&mtrr_state, entry_base, size);
+      if(type != MTRR_TYPE_MIXED || level == 1){
+        if(type == MTRR_TYPE_MIXED){
+          type = MTRR_TYPE_UC; // Can't be split any further
+        }
+        *entry = entry_base | EPT_MEMORY_TYPE(type) | (level > 1 ? EPT_LEAF : 0) | EPT_RWX;
+        ++ept_stats.leaves[level];
+        start = next;
+        continue;
+      }
+      ++ept_stats.mtrr_splits;
+    }
+
+    if(level == 1 || (*entry & EPT_LEAF)){
+      start = next; // Already mapped by an overlapping range
+      continue;
+    }
 
-  if(features.ept_cap_1GB_page){
-    //ept_area_size = 1 + 512;
-    ept_area_size = 1 + pml4e_count;
+    if(!(*entry & EPT_RWX)){
+      uint64_t * sub_table = ept_alloc_table();
+      if(!sub_table){
+        return 0;
+      }
+      *entry = (uint64_t)sub_table | EPT_RWX;
+    }
+
+    if(!ept_map_range((uint64_t*)(*entry & EPT_ADDR_MASK), level - 1, start, next < end ? next : end)){
+      return 0;
+    }
+    start = next;
+  }
+
+  return 1;
+}
+
+// Finds the span around gpa that may be identity mapped: its memory map range, or the hole
+// between two ranges if holes are mapped too. Returns false if gpa must stay unmapped.
+bool ept_find_span(uint64_t gpa, uint64_t * start, uint64_t * end){
+  UINTN lo = 0, hi = ept_range_count, mid;
+
+  if(gpa >= (1ULL << ept_stats.phys_addr_width)){
+    return false;
+  }
+
+  // First range ending above gpa
+  while(lo < hi){
+    mid = (lo + hi) / 2;
+    if(ept_ranges[mid].end <= gpa) lo = mid + 1;
+    else hi = mid;
   }
-  else if(features.ept_cap_2MB_page){
-    //ept_area_size = 1 + 512 + 512 * 512;
-    ept_area_size = 1 + pml4e_count + pdpte_count * pml4e_count;
+
+  if(lo < ept_range_count && ept_ranges[lo].start <= gpa){
+    *start = ept_ranges[lo].start;
+    *end = ept_ranges[lo].end;
+    return true;
+  }
+
+#if EPT_HOLE_POLICY == EPT_HOLES_IDENTITY
+  *start = lo ? ept_ranges[lo - 1].end : 0;
+  *end = lo < ept_range_count ? ept_ranges[lo].start : 1ULL << ept_stats.phys_addr_width;
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Lazy EPT: maps the largest leaf around a guest physical address that caused an EPT violation
+// because nothing is mapped there yet. Returns 0 if gpa can't be mapped.
+int ept_handle_violation(HVM * hvm, uint64_t gpa, uint64_t exit_qualification){
+  uint64_t start, end, base, size;
+  int level, ret = 0;
+
+  uint64_t * entry;
+
+  if(exit_qualification & EPT_VIOLATION_GPA_RWX){
+    // The translation exists. If the EPT allows the access by now, it was a stale translation
+    // from before an access change that wasn't flushed on this CPU yet - retry.
+    entry = ept_get_entry((uint64_t*)hvm->st->ept_area, gpa, &level);
+    return (*entry & exit_qualification & EPT_VIOLATION_ACCESS) == (exit_qualification & EPT_VIOLATION_ACCESS);
+  }
+
+  ticket_lock(&ept_lock);
+
+  if(ept_find_span(gpa, &start, &end)){
+    for(level = 3; level > 0; --level){
+      size = EPT_LEVEL_SIZE(level);
+      base = gpa & ~(size - 1);
+      if(ept_leaf_supported(level) && base >= start && base + size <= end &&
+        (level == 1 || mtrr_range_type(&mtrr_state, base, size) != MTRR_TYPE_MIXED)){
+        break;
+      }
+    }
+    if(level == 0){ // Span not 4 KB aligned
+      level = 1;
+      size = 4096;
+      base = gpa & ~0xFFFULL;
+    }
+
+    // Another CPU may have mapped it in the meantime, ept_map_range() skips existing leaves
+    ret = ept_map_range((uint64_t*)hvm->st->ept_area, 4, base, base + size);
+  }
+
+  if(ret){
+    ++ept_stats.faults_served;
   }
   else{
-    // Not implemented
+    ++ept_stats.faults_unresolved;
   }
 
-  hvm->st->ept_area = 0xFFFFFFFF;
-  err = BS->AllocatePages(AllocateMaxAddress, EfiRuntimeServicesData, ept_area_size, &hvm->st->ept_area); // Space for EPT PML4T and 512 PDPTs
-  if(err != EFI_SUCCESS){
-    return 0;
+  ticket_unlock(&ept_lock);
+
+  return ret;
+}
+
+// Returns the entry mapping gpa - a leaf or a not-present entry - and its level
+uint64_t * ept_get_entry(uint64_t * pml4t, uint64_t gpa, int * level){
+  uint64_t * table = pml4t;
+  uint64_t * entry;
+  int l;
+
+  for(l = 4; ; --l){
+    entry = &table[(gpa / EPT_LEVEL_SIZE(l)) & 0x1FF];
+    if(l == 1 || !(*entry & EPT_RWX) || (*entry & EPT_LEAF)){
+      break;
+    }
+    table = (uint64_t*)(*entry & EPT_ADDR_MASK);
   }
 
-  //ZeroMem((void*)st->ept_area, ept_area_size * 4096);
-  uint64_t * ept_ptr = (uint64_t*)hvm->st->ept_area;
-  uint64_t * ept_end = ept_ptr + ept_area_size * 512;
-  while(ept_ptr != ept_end){
-    *ept_ptr++ = 0;
+  *level = l;
+  return entry;
+}
+
+// True if the guest may write all of [gpa, gpa + size), so the hypervisor may write it for the guest.
+// The EPT is an identity mapping, without it the guest can write everywhere anyway.
+bool ept_guest_writable(HVM * hvm, uint64_t gpa, uint64_t size){
+  uint64_t page;
+  int level;
+  bool writable = true;
+
+  if(gpa + size < gpa){
+    return false;
+  }
+  if(!features.ept || !hvm->st->ept_area){
+    return true;
   }
 
-  //bsp_printf("IA32_VMX_EPT_VPID_CAP: %b\r\n", ept_capabilities);
+  ticket_lock(&ept_lock);
+  for(page = gpa & ~0xFFFULL; page < gpa + size && writable; page += 4096){
+    writable = (*ept_get_entry((uint64_t*)hvm->st->ept_area, page, &level) & EPT_WRITE) != 0;
+  }
+  ticket_unlock(&ept_lock);
 
-  if(features.ept_cap_2MB_page){
-    bsp_printf("2MB EPT pages supported.\r\n");
-    increment = 513 * 512;
+  return writable;
+}
+
+// After the hypervisor wrote [gpa, gpa + size) for the guest. Such writes don't go through the EPT,
+// they set no dirty flag and log nothing, so dirty tracking is told directly.
+void ept_guest_written(uint64_t gpa, uint64_t size){
+  if(size){
+    dirty_mark(gpa, size);
   }
-  if(features.ept_cap_1GB_page){
-    bsp_printf("1GB EPT pages supported.\r\n");
-    increment = 512;
+}
+
+// Replaces a 1 GB/2 MB leaf by a table of 512 leaves one level down with the same attributes
+int ept_split_entry(uint64_t * entry, int level){
+  uint64_t child_size = EPT_LEVEL_SIZE(level - 1);
+  uint64_t attr = *entry & ~EPT_ADDR_MASK & ~EPT_LEAF;
+  uint64_t base = *entry & EPT_ADDR_MASK & ~(EPT_LEVEL_SIZE(level) - 1);
+  uint64_t * table;
+  int i;
+
+  table = ept_alloc_table();
+  if(!table){
+    return 0;
   }
 
-  // Setup identity memory mapping
-  for(i = 0; i < pml4e_count; ++i){
-    pml4t[i] = (uint64_t)pdpt | 0x7; // 2 (X), 1 (W), 0 (R)
-    pdt = pdpt + 512;
+  // The children inherit the dirty flag without their own PML entries, report all of them
+  if(*entry & EPT_DIRTY){
+    dirty_mark(base, EPT_LEVEL_SIZE(level));
+  }
 
-    for(j = 0; j < pdpte_count; ++j){
-      if(features.ept_cap_1GB_page){
-        pdpt[j] = (i << 39) | (j << 30) | 0x87; // 7 (1 GB page), 2 (X), 1 (W), 0 (R)
-      }
-      else if(features.ept_cap_2MB_page){
-        pdpt[j] = (uint64_t)pdt | 0x7; // 2 (X), 1 (W), 0 (R)
+  for(i = 0; i < 512; ++i){
+    table[i] = (base + i * child_size) | attr | (level - 1 > 1 ? EPT_LEAF : 0);
+  }
+  *entry = (uint64_t)table | EPT_RWX;
 
-        for(k = 0; k < pdte_count; ++k){
-          //pdt[k] = ((i << 39) & 0xFF8000000000ULL) | ((j << 30) & 0x7FC0000000ULL) | ((k << 21) & 0x3FE00000) | 0x87; // 7 (1 GB page), 2 (X), 1 (W), 0 (R)
-          pdt[k] = (i << 39) | (j << 30) | (k << 21) | 0x87; // 7 (1 GB page), 2 (X), 1 (W), 0 (R)
-        }
+  --ept_stats.leaves[level];
+  ept_stats.leaves[level - 1] += 512;
+  ++ept_stats.splits;
+
+  return 1;
+}
+
+// Splits the leaf mapping gpa until it is at the given level (1: 4 KB, 2: 2 MB)
+int ept_split(uint64_t * pml4t, uint64_t gpa, int target_level){
+  uint64_t * entry;
+  int level;
+
+  entry = ept_get_entry(pml4t, gpa, &level);
+  while(level > target_level){
+    if(!(*entry & EPT_RWX)){
+      return 0; // Nothing mapped
+    }
+    if(!ept_split_entry(entry, level)){
+      return 0;
+    }
+    entry = ept_get_entry(pml4t, gpa, &level);
+  }
 
-        pdt += 512;
+  return 1;
+}
+
+// Merges the table holding the leaf of gpa back into one large leaf if all of its 512 entries
+// are contiguous leaves with the same attributes, and continues one level up. Other CPUs may still
+// walk an unlinked table until they invalidate, so it goes to retired (EPT_MERGE_MAX entries) for
+// the caller to free after a synchronous invalidation. Without retired it's freed right away.
+int ept_merge(uint64_t * pml4t, uint64_t gpa, uint64_t ** retired){
+  uint64_t * parent;
+  uint64_t * table;
+  uint64_t attr, base, child_size;
+  int level, parent_level, i, merged = 0;
+
+  while(true){
+    ept_get_entry(pml4t, gpa, &level);
+    parent_level = level + 1;
+    if(parent_level > 3 || !ept_leaf_supported(parent_level)){
+      break;
+    }
+
+    // The parent entry points to the table holding the leaf
+    parent = pml4t;
+    for(i = 4; i > parent_level; --i){
+      parent = (uint64_t*)(parent[(gpa / EPT_LEVEL_SIZE(i)) & 0x1FF] & EPT_ADDR_MASK);
+    }
+    parent = &parent[(gpa / EPT_LEVEL_SIZE(parent_level)) & 0x1FF];
+    table = (uint64_t*)(*parent & EPT_ADDR_MASK);
+
+    // Above level 1 only entries with EPT_LEAF map memory, the others point to tables
+    child_size = EPT_LEVEL_SIZE(level);
+    base = table[0] & EPT_ADDR_MASK;
+    attr = table[0] & EPT_MERGE_ATTR_MASK;
+    if(!(attr & EPT_RWX) || (base & (EPT_LEVEL_SIZE(parent_level) - 1))){
+      break;
+    }
+    for(i = 0; i < 512; ++i){
+      if((table[i] & EPT_MERGE_ATTR_MASK) != attr || (table[i] & EPT_ADDR_MASK) != base + i * child_size){
+        break;
       }
-      else{
-        // Not implemented
+      if(level > 1 && !(table[i] & EPT_LEAF)){
+        break;
       }
     }
+    if(i < 512 || mtrr_range_type(&mtrr_state, base, EPT_LEVEL_SIZE(parent_level)) != ((attr >> 3) & 7)){
+      break;
+    }
+
+    // The merged leaf starts clean so PML logs the next write to any part of it. Dirty children
+    // may not be logged (DIRTY_MODE_SCAN), they are marked pending instead.
+    for(i = 0; i < 512; ++i){
+      if(table[i] & EPT_DIRTY){
+        dirty_mark(base + i * child_size, child_size);
+      }
+    }
+    *parent = base | (table[0] & ~EPT_ADDR_MASK & ~(EPT_ACCESSED | EPT_DIRTY)) | EPT_LEAF;
+    if(retired){
+      retired[merged] = table;
+    }
+    else{
+      ept_free_table(table);
+    }
+
+    ept_stats.leaves[level] -= 512;
+    ++ept_stats.leaves[parent_level];
+    ++ept_stats.merges;
+    ++merged;
+  }
+
+  return merged;
+}
+
+// Returns 1 if nothing had to change, 2 if the entry changed, 0 if the leaf couldn't be split.
+// Tables in use need ept_lock held and an invalidation afterwards, see ept_merge() for retired.
+int ept_change_page_access(uint64_t * pml4t, uint64_t gpa, uint64_t access, uint64_t * revoked,
+  uint64_t ** retired){
+  uint64_t * entry;
+  int level;
+
+  entry = ept_get_entry(pml4t, gpa, &level);
+  if((*entry & EPT_RWX) == access){
+    return 1; // Nothing to change, even if it's a large leaf
+  }
+  if(!ept_split(pml4t, gpa, 1)){
+    return 0;
+  }
+
+  entry = ept_get_entry(pml4t, gpa, &level);
+  if(revoked){
+    *revoked = *entry & EPT_RWX & ~access;
+  }
+  *entry = (*entry & ~EPT_RWX) | access;
+  ept_merge(pml4t, gpa, retired);
+
+  return 2;
+}
+
+// Changes the RWX permissions of the 4 KB page holding gpa. The leaf is split as needed and merged
+// again once the whole large page has the same permissions, like after a protection is lifted.
+int ept_set_page_access(HVM * hvm, uint64_t gpa, uint64_t access){
+  uint64_t * retired[EPT_MERGE_MAX] = {NULL};
+  uint64_t revoked = 0;
+  int ret, i;
+
+  ticket_lock(&ept_lock);
+  ret = ept_change_page_access((uint64_t*)hvm->st->ept_area, gpa, access, &revoked, retired);
+  if(ret == 2){
+    inval_queue(INVAL_EPT_SINGLE);
+  }
+  ticket_unlock(&ept_lock);
+
+  // Stale translations with more rights than the EPT must be gone everywhere before returning,
+  // stale ones with fewer rights only cause an EPT violation that is retried. Merged tables can
+  // only be reused once no CPU caches a path through them.
+  if(ret == 2){
+    inval_commit(hvm, revoked != 0 || retired[0]);
+  }
+  if(retired[0]){
+    ticket_lock(&ept_lock);
+    for(i = 0; i < EPT_MERGE_MAX && retired[i]; ++i){
+      ept_free_table(retired[i]);
+    }
+    ticket_unlock(&ept_lock);
+  }
+
+  return ret != 0;
+}
+
+int ept_init(HVM * hvm){
+  uint64_t rax, rbx, rcx, rdx;
+  uint64_t * pml4t;
+  uint64_t ept_capabilities = get_msr(MSR_IA32_VMX_EPT_VPID_CAP);
+  uint64_t start_tsc = get_tsc();
+  uint64_t top, hole;
+  EPT_RANGE * ranges;
+  UINTN range_count, i;
+
+  lock_stats_register(&ept_lock_stats);
+  features.ept_cap_2MB_page = ept_capabilities & EPT_CAP_2MB_PAGE;
+  features.ept_cap_1GB_page = ept_capabilities & EPT_CAP_1GB_PAGE;
+  features.ept_ad = EPT_AD_ENABLED && (ept_capabilities & EPT_CAP_AD);
 
-    pdpt += increment;
+  rax = 0x80000008;
+  emu_cpuid(&rax, &rbx, &rcx, &rdx);
+  ept_stats.phys_addr_width = rax & 0xFF;
+
+  // Leaves get the memory type of the MTRRs instead of UC
+  mtrr_read(&mtrr_state);
+
+  if(!ept_pool_init()){
+    return 0;
   }
 
+  pml4t = ept_alloc_table();
+  if(!pml4t){
+    return 0;
+  }
+  hvm->st->ept_area = (uint64_t)pml4t;
+
+  range_count = ept_read_memory_map(&ranges);
+  ept_stats.top = range_count ? ranges[range_count - 1].end : 0;
+
+#if EPT_LAZY
+  // Only the PML4 and the read-only telemetry pages exist, ept_handle_violation() maps the rest
+  // on first touch around them
+  ept_ranges = ranges;
+  ept_range_count = range_count;
+  telemetry_ept_protect(pml4t);
+  ept_pool.runtime = true;
+
+  ept_stats.build_cycles = get_tsc() - start_tsc;
+  ept_report();
+
   return 1;
-}
\ No newline at end of file
+#endif
+
+#if EPT_HOLE_POLICY == EPT_HOLES_IDENTITY
+  // Holes between the ranges and up to 4 GB are MMIO (PCI, local/IO APIC, flash). They are mapped
+  // with their MTRR type - normally UC - just like without EPT, so the whole span is one range.
+  top = range_count ? ranges[range_count - 1].end : 0;
+  for(i = 0, hole = 0; i < range_count; ++i){
+    ept_stats.holes += ranges[i].start - hole;
+    hole = ranges[i].end;
+  }
+  if(top < 0x100000000ULL){
+    ept_stats.holes += 0x100000000ULL - top;
+    top = 0x100000000ULL;
+  }
+  ranges[0].start = 0;
+  ranges[0].end = top;
+  range_count = 1;
+#endif
+
+  for(i = 0; i < range_count; ++i){
+    if(!ept_map_range(pml4t, 4, ranges[i].start, ranges[i].end)){
+      return 0;
+    }
+    ept_stats.mapped += ranges[i].end - ranges[i].start;
+  }
+  telemetry_ept_protect(pml4t);
+
+  BS->FreePool(ranges);
+  ept_pool.runtime = true;
+
+  ept_stats.build_cycles = get_tsc() - start_tsc;
+  ept_report();
+
+  return 1;
+}
+
+void ept_report(void){
+  bsp_printf("EPT: %u MB mapped (%u MB holes), %u tables, built in %u us\r\n",
+    ept_stats.mapped >> 20, ept_stats.holes >> 20, ept_stats.tables, tsc_to_us(ept_stats.build_cycles));
+  bsp_printf("EPT leaves: %u x 1 GB, %u x 2 MB, %u x 4 KB, %u split for MTRR ranges\r\n",
+    ept_stats.leaves[3], ept_stats.leaves[2], ept_stats.leaves[1], ept_stats.mtrr_splits);
+  bsp_printf("EPT changes: %u splits, %u merges\r\n", ept_stats.splits, ept_stats.merges);
+  bsp_printf("EPT violations: %u served, %u unresolved, %u pool pages free\r\n",
+    ept_stats.faults_served, ept_stats.faults_unresolved, (uint64_t)ept_pool.free_count);
+}
@@ -2,22 +2,119 @@
 #define _VMCS_
 
 #include "vmx_api.h"
+#include "spinlock.h"
 
 #define EPT_ENABLED 0
+#define VPID_ENABLED 1
+
+// Per-CPU state block, allocated from the CPU's NUMA domain by alloc_cpu_state() (in pages)
+#define CPU_PAGE_VMXON 0
+#define CPU_PAGE_VMCS 1
+#define CPU_PAGE_MSR_BITMAP 2
+#define CPU_PAGE_STACK 3 // 64 KB host stack
+#define CPU_PAGE_CPUID (CPU_PAGE_STACK + 16)
+#define CPU_PAGE_HVM (CPU_PAGE_CPUID + EFI_SIZE_TO_PAGES(sizeof(CPUID_TABLE)))
+#define CPU_PAGE_LOG (CPU_PAGE_HVM + EFI_SIZE_TO_PAGES(sizeof(HVM)))
+#define CPU_PAGE_BLOG (CPU_PAGE_LOG + LOGRING_PAGES)
+#define CPU_PAGE_TELEMETRY (CPU_PAGE_BLOG + BLOG_RING_PAGES)
+#define CPU_PAGE_LATENCY (CPU_PAGE_TELEMETRY + EFI_SIZE_TO_PAGES(sizeof(TELEMETRY_CPU)))
+#define CPU_PAGE_XSTATE (CPU_PAGE_LATENCY + EFI_SIZE_TO_PAGES(sizeof(LATENCY_TABLE)))
+#define CPU_PAGE_PROFILE (CPU_PAGE_XSTATE + EFI_SIZE_TO_PAGES(sizeof(XSTATE)))
+#define CPU_PAGE_PML (CPU_PAGE_PROFILE + EFI_SIZE_TO_PAGES(sizeof(PROFILE_RING)))
+#define CPU_STATE_PAGES (CPU_PAGE_PML + 1)
+
+// What ept_init() does with the physical address space not described by the UEFI memory map
+#define EPT_HOLES_UNMAPPED 0 // guest accesses cause EPT violations
+#define EPT_HOLES_IDENTITY 1 // identity mapped with the MTRR type, the whole space below 4 GB at least
+#define EPT_HOLE_POLICY EPT_HOLES_IDENTITY
+
+#define EPT_LAZY 0 // start with an empty EPT and map on the first EPT violation
+#define EPT_POOL_PAGES 256 // paging-structure pages reserved for changes while the guest runs
+#define EPT_MERGE_MAX 2 // tables one ept_merge() can unlink, a level 1 and a level 2 table
+#define EPT_AD_ENABLED 1 // accessed and dirty flags in the EPT if the CPU has them, see dirty.c
+
+// EPT paging-structure entries
+#define EPT_READ 0x1
+#define EPT_WRITE 0x2
+#define EPT_EXEC 0x4
+#define EPT_RWX (EPT_READ | EPT_WRITE | EPT_EXEC)
+#define EPT_MEMORY_TYPE(type) ((uint64_t)(type) << 3) // leaves only, combined with the guest PAT type
+#define EPT_IGNORE_PAT 0x40
+#define EPT_LEAF 0x80 // 2 MB / 1 GB page
+#define EPT_ADDR_MASK 0x000FFFFFFFFFF000ULL
+#define EPT_ACCESSED 0x100
+#define EPT_DIRTY 0x200
+#define EPT_MERGE_ATTR_MASK (~EPT_ADDR_MASK & ~(EPT_LEAF | EPT_ACCESSED | EPT_DIRTY)) // leaves with equal bits can be merged
+#define EPT_LEVEL_SIZE(level) (1ULL << (12 + 9 * ((level) - 1))) // bytes mapped by one entry, level 1: PT ... 4: PML4
+
+// Exit qualification of EPT violations, 5:3 - the GPA was readable/writable/executable
+#define EPT_VIOLATION_GPA_RWX (7 << 3)
+#define EPT_VIOLATION_ACCESS 7 // 2:0 - the access was a read/write/fetch, same bits as EPT_RWX
+
+// EPT pointer
+#define EPTP_WALK_LENGTH_4 (3 << 3)
+#define EPTP_AD (1 << 6) // accessed and dirty flags
+#define EPT_CAP_WB (1 << 14) // IA32_VMX_EPT_VPID_CAP: WB paging-structure memory type
+#define EPT_CAP_2MB_PAGE (1 << 16)
+#define EPT_CAP_1GB_PAGE (1 << 17)
+#define EPT_CAP_AD (1 << 21)
+
+typedef struct{
+	uint64_t start;
+	uint64_t end; // exclusive
+} EPT_RANGE;
+
+typedef struct{
+	uint8_t phys_addr_width;
+	uint64_t tables; // paging-structure pages allocated
+	uint64_t leaves[4]; // by level: 1 (4 KB), 2 (2 MB), 3 (1 GB)
+	uint64_t mtrr_splits; // leaves broken up because their MTRR type isn't uniform
+	uint64_t mapped; // bytes identity mapped
+	uint64_t top; // end of the highest memory map range
+	uint64_t holes; // of these not in the memory map
+	uint64_t build_cycles;
+	uint64_t faults_served; // EPT violations resolved by ept_handle_violation()
+	uint64_t faults_unresolved;
+	uint64_t splits;
+	uint64_t merges;
+} EPT_STATS;
+
+typedef struct{
+	uint64_t * free; // free pages, linked through their first entry
+	uint32_t free_count;
+	bool runtime; // boot services no longer usable
+} EPT_POOL;
 
 typedef struct{
 	bool pse;
 	bool ept;
 	bool ug;
 	bool vpid;
+	uint8_t invvpid_types; // bit n set: INVVPID type n supported
 	bool ept_cap_2MB_page;
 	bool ept_cap_1GB_page;
+	bool ept_ad; // EPTP_AD set, the CPU sets EPT_ACCESSED/EPT_DIRTY
+	bool pml; // page modification logging
 } FEATURES;
 
 extern FEATURES features;
+extern EPT_STATS ept_stats;
+extern EPT_POOL ept_pool;
+extern ticket_lock_t ept_lock;
 
 void vmcs_init(HVM * hvm);
 int ept_init(HVM * hvm);
+uint64_t ept_pointer(HVM * hvm);
+int ept_map_range(uint64_t * table, int level, uint64_t start, uint64_t end);
+uint64_t * ept_get_entry(uint64_t * pml4t, uint64_t gpa, int * level);
+int ept_split(uint64_t * pml4t, uint64_t gpa, int target_level);
+int ept_merge(uint64_t * pml4t, uint64_t gpa, uint64_t ** retired);
+bool ept_guest_writable(HVM * hvm, uint64_t gpa, uint64_t size);
+void ept_guest_written(uint64_t gpa, uint64_t size);
+int ept_change_page_access(uint64_t * pml4t, uint64_t gpa, uint64_t access, uint64_t * revoked, uint64_t ** retired);
+int ept_set_page_access(HVM * hvm, uint64_t gpa, uint64_t access);
+int ept_handle_violation(HVM * hvm, uint64_t gpa, uint64_t exit_qualification);
+void ept_report(void);
 void vm_start(void);
 uint32_t init_control_field(uint32_t ctl, uint32_t msr);
 void set_guest_selector(uint64_t gdt_base, uint32_t reg, uint64_t sel);
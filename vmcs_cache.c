@@ -0,0 +1,131 @@
+#include "vmx_api.h"
+#include "vmcs_cache.h"
+#include "smp.h"
+
+/*
+
+Per-exit VMCS field cache
+
+vmcs_read() fills a slot on the first read of a field during the current exit and answers
+further reads from memory. vmcs_write() only records the new value, the dirty slots are written
+back once by vmcs_cache_flush() right before VMRESUME. Writing the value a slot already holds
+costs nothing. Fields without a slot go straight to vmx_read()/vmx_write().
+
+During exit handling a cached field has to be accessed only through vmcs_read()/vmcs_write(),
+otherwise the write back would overwrite a direct vmx_write().
+
+*/
+
+#define VMCS_FIELD_INFO_ENTRY(field) { field, VMCS_FIELD_WIDTH(field), VMCS_FIELD_READ_ONLY(field) },
+const VMCS_FIELD_INFO vmcs_field_info[VMCS_CACHE_SLOTS] = {
+  VMCS_CACHED_FIELDS(VMCS_FIELD_INFO_ENTRY)
+};
+#undef VMCS_FIELD_INFO_ENTRY
+
+int vmcs_cache_slot(uint64_t field){
+  switch(field){
+#define VMCS_SLOT_CASE(field) case field: return VMCS_SLOT_##field;
+    VMCS_CACHED_FIELDS(VMCS_SLOT_CASE)
+#undef VMCS_SLOT_CASE
+    default:
+      return -1;
+  }
+}
+
+uint64_t vmcs_width_mask(uint8_t width){
+  switch(width){
+    case VMCS_WIDTH_16:
+      return 0xFFFF;
+    case VMCS_WIDTH_32:
+      return 0xFFFFFFFF;
+    default:
+      return ~0ULL;
+  }
+}
+
+// Called at the start of every exit, the previous exit's values are stale
+void vmcs_cache_reset(HVM * hvm){
+  VMCS_CACHE * cache = &hvm->vmcs_cache;
+
+  cache->valid = 0;
+  cache->dirty = 0;
+  ++cache->exits;
+}
+
+// Called right before VMRESUME
+void vmcs_cache_flush(HVM * hvm){
+  VMCS_CACHE * cache = &hvm->vmcs_cache;
+  uint32_t dirty = cache->dirty;
+  int slot;
+
+  for(slot = 0; dirty; ++slot, dirty >>= 1){
+    if(dirty & 1){
+      vmx_write(vmcs_field_info[slot].encoding, cache->value[slot]);
+      ++cache->vmwrites;
+    }
+  }
+
+  cache->dirty = 0;
+}
+
+uint64_t vmcs_read(HVM * hvm, uint64_t field){
+  VMCS_CACHE * cache = &hvm->vmcs_cache;
+  int slot = vmcs_cache_slot(field);
+
+  ++cache->vmreads;
+  if(slot < 0){
+    return vmx_read(field);
+  }
+
+  if(cache->valid & (1 << slot)){
+    --cache->vmreads;
+    ++cache->vmreads_saved;
+    return cache->value[slot];
+  }
+
+  cache->value[slot] = vmx_read(field);
+  cache->valid |= 1 << slot;
+
+  return cache->value[slot];
+}
+
+void vmcs_write(HVM * hvm, uint64_t field, uint64_t value){
+  VMCS_CACHE * cache = &hvm->vmcs_cache;
+  int slot = vmcs_cache_slot(field);
+
+  if(slot < 0){
+    vmx_write(field, value);
+    ++cache->vmwrites;
+    return;
+  }
+
+  if(vmcs_field_info[slot].read_only){
+    return; // VMWRITE would fail anyway
+  }
+
+  value &= vmcs_width_mask(vmcs_field_info[slot].width);
+
+  if((cache->valid & (1 << slot)) && cache->value[slot] == value){
+    ++cache->vmwrites_saved; // no-op write
+    return;
+  }
+
+  if(cache->dirty & (1 << slot)){
+    ++cache->vmwrites_saved; // overwrites a pending write
+  }
+
+  cache->value[slot] = value;
+  cache->valid |= 1 << slot;
+  cache->dirty |= 1 << slot;
+}
+
+void vmcs_cache_report(HVM * hvm){
+  VMCS_CACHE * cache = &hvm->vmcs_cache;
+  uint64_t exits = cache->exits ? cache->exits : 1;
+
+  // Averages are printed in hundredths
+  bsp_printf("%u: VMCS cache: %u exits, %u vmreads (%u saved, %u/100 per exit), %u vmwrites (%u saved, %u/100 per exit)\r\n",
+    (uint64_t)hvm->cpu_id, cache->exits,
+    cache->vmreads, cache->vmreads_saved, cache->vmreads_saved * 100 / exits,
+    cache->vmwrites, cache->vmwrites_saved, cache->vmwrites_saved * 100 / exits);
+}
@@ -0,0 +1,23 @@
+#ifndef _VMCS_CACHE_
+#define _VMCS_CACHE_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmx_api.h"
+
+typedef struct{
+  uint32_t encoding;
+  uint8_t width;
+  bool read_only;
+} VMCS_FIELD_INFO;
+
+extern const VMCS_FIELD_INFO vmcs_field_info[VMCS_CACHE_SLOTS];
+
+int vmcs_cache_slot(uint64_t field);
+void vmcs_cache_reset(HVM * hvm);
+void vmcs_cache_flush(HVM * hvm);
+uint64_t vmcs_read(HVM * hvm, uint64_t field);
+void vmcs_write(HVM * hvm, uint64_t field, uint64_t value);
+void vmcs_cache_report(HVM * hvm);
+
+#endif
@@ -1,4 +1,37 @@
 extern vmexit_handler
+extern latency_record
+extern inval_generation
+
+%define FAST_EXIT_ENABLED 1 ; service CPUID and VMCALL ping without entering vmexit_handler
+
+; HVM fields used by the fast path (see HVM in vmx_api.h)
+%define HVM_CPUID_TABLE 0
+%define HVM_FAST_CPUID_EXITS 8
+%define HVM_FAST_VMCALL_EXITS 16
+%define HVM_FAST_EXIT_ENABLED 24
+%define HVM_INVAL_GENERATION 32
+%define HVM_LATENCY 40
+%define HVM_EXIT_START_TSC 48
+%define HVM_ROOT_NMIS 56
+%define HVM_NMI_WINDOW_EXITING 64
+
+; CPUID_TABLE layout (see cpuid.h)
+%define CPUID_FAST_LEAVES 64
+%define CPUID_BASIC_MASK 0
+%define CPUID_EXT_MASK 8
+%define CPUID_BASIC 16
+%define CPUID_EXT (CPUID_BASIC + CPUID_FAST_LEAVES * 16)
+
+%define VM_EXIT_REASON 4402h
+%define VM_EXIT_INSTRUCTION_LEN 440ch
+%define GUEST_EIP 681eh
+%define GUEST_CR4 6804h
+%define HOST_RSP 6c14h
+%define PRIMARY_CPU_BASED_VM_EXEC_CONTROL 4002h
+%define EXIT_REASON_CPUID 10
+%define EXIT_REASON_VMCALL 18
+%define VMCALL_PING 0
+%define VMCALL_PING_REPLY 47415753h ; "SWAG"
 
 global vmx_supported
 global vmx_ug_supported
@@ -11,7 +44,12 @@ global vmx_vmcs_activate
 global vmx_read
 global vmx_write
 global vmx_launch
+global vmx_vmcall
+global vmx_invvpid
+global vmx_invept
 global vmx_exit
+global host_nmi_handler
+global host_nmi_count
 global vmx_ret
 global vmx_enable_a20_line
 global vmx_disable_a20_line
@@ -108,7 +146,73 @@ vmx_launch:
 	vmlaunch
 	ret
 
+vmx_vmcall:
+	mov rax,rcx
+	vmcall
+	ret
+
+vmx_invvpid:
+	xor rax,rax
+	invvpid rcx,[rdx]
+	jbe vmx_invvpid_end ; CF or ZF - VMfailInvalid/VMfailValid
+	inc eax
+vmx_invvpid_end:
+	ret
+
+vmx_invept:
+	xor rax,rax
+	invept rcx,[rdx]
+	jbe vmx_invept_end ; CF or ZF - VMfailInvalid/VMfailValid
+	inc eax
+vmx_invept_end:
+	ret
+
+; Host IDT vector 2. The NMI may be a kick or belong to the guest, nmi_sync() sorts it out. It can
+; arrive after vmexit_handler() looked for root NMIs, so NMI-window exiting is turned on here to
+; exit again right after VM entry. The HVM pointer is on top of the host stack (HOST_RSP).
+host_nmi_handler:
+	push rax
+	push rcx
+	push rdx
+	lock inc qword [rel host_nmi_count]
+	mov ecx,HOST_RSP
+	vmread rdx,rcx
+	mov rdx,[rdx]
+	lock inc qword [rdx+HVM_ROOT_NMIS]
+	mov ecx,PRIMARY_CPU_BASED_VM_EXEC_CONTROL
+	vmread rax,rcx
+	or eax,[rdx+HVM_NMI_WINDOW_EXITING]
+	vmwrite rcx,rax
+	pop rdx
+	pop rcx
+	pop rax
+	iretq
+
 vmx_exit:
+%if FAST_EXIT_ENABLED
+	; Save only the registers touched by the fast path, [rsp+32] is the HVM pointer
+	push rbx
+	push rdx
+	push rcx
+	push rax
+	mov rbx,[rsp+32]
+	cmp byte [rbx+HVM_FAST_EXIT_ENABLED],0
+	je vmx_exit_slow
+	mov rax,[rel inval_generation] ; pending invalidations are handled by vmexit_handler
+	cmp rax,[rbx+HVM_INVAL_GENERATION]
+	jne vmx_exit_slow
+	mov ecx,VM_EXIT_REASON
+	vmread rax,rcx
+	cmp eax,EXIT_REASON_CPUID
+	je fast_cpuid
+	cmp eax,EXIT_REASON_VMCALL
+	je fast_vmcall
+vmx_exit_slow:
+	pop rax
+	pop rcx
+	pop rdx
+	pop rbx
+%endif
 	push r15
 	push r14
 	push r13
@@ -125,9 +229,27 @@ vmx_exit:
 	push rdx
 	push rcx
 	push rax
+	; Exit latency start, all guest registers are saved and [rsp+128] is the HVM pointer
+	mov rbx,[rsp+128]
+	cmp qword [rbx+HVM_LATENCY],0
+	je vmx_exit_call
+	rdtscp
+	shl rdx,32
+	or rax,rdx
+	mov [rbx+HVM_EXIT_START_TSC],rax
+vmx_exit_call:
 	mov rcx,rsp
 	sub rsp,28h
 	call vmexit_handler
+	mov rbx,[rsp+28h+128]
+	cmp qword [rbx+HVM_LATENCY],0
+	je vmx_exit_restore
+	rdtscp ; RAX, RCX, RDX and the registers latency_record() clobbers are reloaded below
+	shl rdx,32
+	or rdx,rax
+	mov rcx,rbx
+	call latency_record
+vmx_exit_restore:
 	add rsp,28h
 	pop rax
 	pop rcx
@@ -148,6 +270,84 @@ vmx_exit:
 	vmresume
 	ret
 
+%if FAST_EXIT_ENABLED
+fast_cpuid:
+	mov rdx,[rbx+HVM_CPUID_TABLE]
+	test rdx,rdx
+	jz vmx_exit_slow
+	mov eax,[rsp] ; guest EAX - leaf
+	cmp eax,CPUID_FAST_LEAVES
+	jb fast_cpuid_basic
+	sub eax,80000000h
+	cmp eax,CPUID_FAST_LEAVES
+	jae vmx_exit_slow
+	mov rcx,[rdx+CPUID_EXT_MASK]
+	bt rcx,rax
+	jnc vmx_exit_slow
+	shl eax,4
+	lea rdx,[rdx+rax+CPUID_EXT]
+	jmp fast_cpuid_reply
+fast_cpuid_basic:
+	mov rcx,[rdx+CPUID_BASIC_MASK]
+	bt rcx,rax
+	jnc vmx_exit_slow
+	mov ecx,eax
+	shl eax,4
+	lea rdx,[rdx+rax+CPUID_BASIC]
+	cmp ecx,1
+	jne fast_cpuid_reply
+	; CPUID.01H:ECX.OSXSAVE follows guest CR4.OSXSAVE
+	mov ecx,GUEST_CR4
+	vmread rax,rcx
+	mov ecx,[rdx+8]
+	btr ecx,27
+	bt eax,18
+	jnc fast_cpuid_leaf1
+	bts ecx,27
+fast_cpuid_leaf1:
+	mov [rsp+8],rcx
+	mov eax,[rdx]
+	mov [rsp],rax
+	mov eax,[rdx+4]
+	mov [rsp+24],rax
+	mov eax,[rdx+12]
+	mov [rsp+16],rax
+	jmp fast_cpuid_done
+fast_cpuid_reply:
+	mov eax,[rdx] ; 32-bit loads clear the upper halves just like CPUID does
+	mov [rsp],rax
+	mov eax,[rdx+4]
+	mov [rsp+24],rax
+	mov eax,[rdx+8]
+	mov [rsp+8],rax
+	mov eax,[rdx+12]
+	mov [rsp+16],rax
+fast_cpuid_done:
+	inc qword [rbx+HVM_FAST_CPUID_EXITS]
+	jmp fast_exit_skip_instr
+
+fast_vmcall:
+	cmp qword [rsp],VMCALL_PING
+	jne vmx_exit_slow
+	mov qword [rsp],VMCALL_PING_REPLY
+	inc qword [rbx+HVM_FAST_VMCALL_EXITS]
+
+fast_exit_skip_instr:
+	mov ecx,GUEST_EIP
+	vmread rax,rcx
+	mov ecx,VM_EXIT_INSTRUCTION_LEN
+	vmread rdx,rcx
+	add rax,rdx
+	mov ecx,GUEST_EIP
+	vmwrite rcx,rax
+	pop rax
+	pop rcx
+	pop rdx
+	pop rbx
+	vmresume
+	ret
+%endif
+
 vmx_ret:
 	pop rbp
 	ret
@@ -176,4 +376,9 @@ vmx_disable_a20_line:
    call WaitKBC
    mov al,0ddh ; use 0dfh to enable and 0ddh to disable.
    out 60h,al
-ret
\ No newline at end of file
+ret
+
+section .data
+
+host_nmi_count:
+	dq 0
@@ -19,6 +19,8 @@
 #define MSR_IA32_VMX_TRUE_EXIT_CTLS 0x48f
 #define MSR_IA32_VMX_TRUE_ENTRY_CTLS 0x490
 
+#define MSR_IA32_VMX_MISC           0x485 // bits 4:0: TSC bits per preemption timer tick
+
 #define MSR_IA32_VMX_CR0_FIXED0     0x486
 #define MSR_IA32_VMX_CR0_FIXED1     0x487
 #define MSR_IA32_VMX_CR4_FIXED0     0x488
@@ -71,8 +73,18 @@
 #define X86_CR4_OSFXSR		0x0200  /* enable fast FPU save and restore */
 #define X86_CR4_OSXMMEXCPT	0x0400  /* enable unmasked SSE exceptions */
 #define X86_CR4_VMXE		0x2000  /* enable VMX */
+#define X86_CR4_PCIDE		0x20000 /* enable PCID */
+#define X86_CR4_OSXSAVE		0x40000 /* enable XSAVE and processor extended states */
+#define X86_CR4_SMEP		0x100000 /* enable SMEP */
+#define X86_CR4_SMAP		0x200000 /* enable SMAP */
+
+// CR4 bits whose modification flushes the TLB
+#define CR4_TLB_FLUSH_BITS (X86_CR4_PSE | X86_CR4_PAE | X86_CR4_PGE | X86_CR4_PCIDE | X86_CR4_SMEP | X86_CR4_SMAP)
+#define CR3_NO_FLUSH (1ULL << 63)
 
 enum{
+  // 16 bits Control Fields
+  VIRTUAL_PROCESSOR_ID = 0x00000000,
   // 16 bits Guest State Fields
   GUEST_ES_SELECTOR = 0x00000800,
   GUEST_CS_SELECTOR = 0x00000802,
@@ -82,6 +94,7 @@ enum{
   GUEST_GS_SELECTOR = 0x0000080a,
   GUEST_LDTR_SELECTOR = 0x0000080c,
   GUEST_TR_SELECTOR = 0x0000080e,
+  GUEST_PML_INDEX = 0x00000812,
   // 16 bits Host State Fields
   HOST_ES_SELECTOR = 0x00000c00,
   HOST_CS_SELECTOR = 0x00000c02,
@@ -103,6 +116,8 @@ enum{
   VM_EXIT_MSR_LOAD_ADDR_HIGH = 0x00002009,
   VM_ENTRY_MSR_LOAD_ADDR = 0x0000200a,
   VM_ENTRY_MSR_LOAD_ADDR_HIGH = 0x0000200b,
+  PML_ADDRESS = 0x0000200e,
+  PML_ADDRESS_HIGH = 0x0000200f,
   TSC_OFFSET = 0x00002010,
   TSC_OFFSET_HIGH = 0x00002011,
   VIRTUAL_APIC_PAGE_ADDR = 0x00002012,
@@ -170,6 +185,7 @@ enum{
   GUEST_ACTIVITY_STATE = 0x00004826,
   GUEST_SM_BASE = 0x00004828,
   GUEST_SYSENTER_CS = 0x0000482A,
+  VMX_PREEMPTION_TIMER_VALUE = 0x0000482E,
   // 32 bits Host State Field
   HOST_IA32_SYSENTER_CS = 0x00004c00,
   // Natural width Control Fields
@@ -232,8 +248,10 @@ enum{
 #define EXIT_REASON_IO_SMI 5
 #define EXIT_REASON_OTHER_SMI 6
 #define EXIT_REASON_PENDING_INTERRUPT 7
+#define EXIT_REASON_NMI_WINDOW 8
 #define EXIT_REASON_TASK_SWITCH 9
 #define EXIT_REASON_CPUID 10
+#define EXIT_REASON_GETSEC 11
 #define EXIT_REASON_HLT 12
 #define EXIT_REASON_INVD 13
 #define EXIT_REASON_INVLPG 14
@@ -258,25 +276,65 @@ enum{
 #define EXIT_REASON_INVALID_GUEST_STATE 33
 #define EXIT_REASON_MSR_LOADING 34
 #define EXIT_REASON_MWAIT_INSTRUCTION 36
+#define EXIT_REASON_MONITOR_TRAP_FLAG 37
 #define EXIT_REASON_MONITOR_INSTRUCTION 39
 #define EXIT_REASON_PAUSE_INSTRUCTION 40
 #define EXIT_REASON_MACHINE_CHECK 41
 #define EXIT_REASON_TPR_BELOW_THRESHOLD 43
+#define EXIT_REASON_APIC_ACCESS 44
+#define EXIT_REASON_VIRTUALIZED_EOI 45
+#define EXIT_REASON_GDTR_IDTR_ACCESS 46
+#define EXIT_REASON_LDTR_TR_ACCESS 47
+#define EXIT_REASON_EPT_VIOLATION 48
 #define EXIT_REASON_EPT_MISCONFIGURATION 49
-#define VMX_MAX_GUEST_VMEXIT EXIT_REASON_EPT_MISCONFIGURATION
+#define EXIT_REASON_INVEPT 50
+#define EXIT_REASON_RDTSCP 51
+#define EXIT_REASON_PREEMPTION_TIMER 52
+#define EXIT_REASON_INVVPID 53
+#define EXIT_REASON_WBINVD 54
+#define EXIT_REASON_XSETBV 55
+#define EXIT_REASON_APIC_WRITE 56
+#define EXIT_REASON_RDRAND 57
+#define EXIT_REASON_INVPCID 58
+#define EXIT_REASON_VMFUNC 59
+#define EXIT_REASON_ENCLS 60
+#define EXIT_REASON_RDSEED 61
+#define EXIT_REASON_PML_FULL 62
+#define EXIT_REASON_XSAVES 63
+#define EXIT_REASON_XRSTORS 64
+#define VMX_MAX_GUEST_VMEXIT EXIT_REASON_XRSTORS
+#define VMX_EXIT_REASON_COUNT (VMX_MAX_GUEST_VMEXIT + 1) // basic exit reasons (bits 15:0)
+
+#define PIN_BASED_NMI_EXITING           0x00000008
+#define PIN_BASED_VIRTUAL_NMIS          0x00000020
+#define PIN_BASED_PREEMPTION_TIMER      0x00000040
 
+#define CPU_BASED_NMI_WINDOW_EXITING    0x00400000
 #define CPU_BASED_ACTIVATE_MSR_BITMAP   0x10000000
 
 //#define VM_EXIT_HOST_ADDR_SPACE_SIZE    0x00000100
 #define VM_EXIT_IA32E_MODE              0x00000200
 #define VM_EXIT_ACK_INTR_ON_EXIT        0x00008000
 #define VM_EXIT_SAVE_IA32_EFER          0x00100000
+#define VM_EXIT_SAVE_PREEMPTION_TIMER   0x00400000
 //#define VM_EXIT_LOAD_IA32_EFER          0x00200000
 
+// VM-exit/VM-entry interruption information
+#define INTR_INFO_VECTOR(info) ((info) & 0xFF)
+#define INTR_INFO_TYPE(info) (((info) >> 8) & 7)
+#define INTR_INFO_VALID 0x80000000
+#define INTR_INFO_DELIVER_CODE 0x800
+#define INTR_INFO_UNBLOCK_NMI 0x1000 // NMI unblocking due to IRET, also bit 12 of EPT exit qualifications
+#define INTR_TYPE_NMI 2
+#define INTR_TYPE_HARD_EXCEPTION 3
+#define NMI_VECTOR 2
+#define GP_VECTOR 13
+
 #define VM_EXEC_PROCBASED_CTLS2_ENABLE 0x80000000
 #define VM_EXEC_UG  0x80
 #define VM_EXEC_EPT 0x2
 #define VM_EXEC_VPID 0x20
+#define VM_EXEC_PML 0x20000
 
 
 #define VM_ENTRY_IA32E_MODE             0x00000200
@@ -289,6 +347,69 @@ enum{
 #define STATE_SHUTDOWN 2
 #define STATE_WAIT_FOR_SIPI 3
 
+// GUEST_INTERRUPTIBILITY_INFO
+#define GUEST_INTR_STATE_STI 0x1
+#define GUEST_INTR_STATE_MOV_SS 0x2
+#define GUEST_INTR_STATE_NMI 0x8
+
+//
+// VMCS field encoding (Intel SDM Appendix B)
+//
+#define VMCS_FIELD_HIGH(f) ((f) & 1) // access type: high 32 bits of a 64-bit field
+#define VMCS_FIELD_TYPE(f) (((f) >> 10) & 3)
+#define VMCS_FIELD_WIDTH(f) (((f) >> 13) & 3)
+#define VMCS_FIELD_READ_ONLY(f) (VMCS_FIELD_TYPE(f) == VMCS_TYPE_RO_DATA)
+
+#define VMCS_TYPE_CONTROL 0
+#define VMCS_TYPE_RO_DATA 1
+#define VMCS_TYPE_GUEST 2
+#define VMCS_TYPE_HOST 3
+
+#define VMCS_WIDTH_16 0
+#define VMCS_WIDTH_64 1
+#define VMCS_WIDTH_32 2
+#define VMCS_WIDTH_NATURAL 3
+
+// Fields kept in the per-exit VMCS cache (see vmcs_cache.c)
+#define VMCS_CACHED_FIELDS(X) \
+  X(VM_EXIT_REASON) \
+  X(EXIT_QUALIFICATION) \
+  X(VM_EXIT_INSTRUCTION_LEN) \
+  X(GUEST_PHYS_ADDR) \
+  X(GUEST_EIP) \
+  X(GUEST_ESP) \
+  X(GUEST_CR0) \
+  X(GUEST_CR3) \
+  X(GUEST_CR4) \
+  X(GUEST_IA32_EFER) \
+  X(GUEST_CS_SELECTOR) \
+  X(GUEST_CS_BASE) \
+  X(GUEST_CS_LIMIT) \
+  X(GUEST_CS_AR_BYTES) \
+  X(GUEST_ACTIVITY_STATE) \
+  X(CR0_READ_SHADOW) \
+  X(CR4_READ_SHADOW) \
+  X(VM_ENTRY_CONTROLS)
+
+#define VMCS_CACHE_SLOT(field) VMCS_SLOT_##field,
+enum{
+  VMCS_CACHED_FIELDS(VMCS_CACHE_SLOT)
+  VMCS_CACHE_SLOTS
+};
+#undef VMCS_CACHE_SLOT
+
+typedef struct{
+  uint32_t valid; // slot bitmask: value[] holds the current field value
+  uint32_t dirty; // slot bitmask: value[] has to be written back before VMRESUME
+  uint64_t value[VMCS_CACHE_SLOTS];
+  // Statistics
+  uint64_t exits;
+  uint64_t vmreads;
+  uint64_t vmreads_saved;
+  uint64_t vmwrites;
+  uint64_t vmwrites_saved;
+} VMCS_CACHE;
+
 typedef struct{
   uint64_t idt_limit;
   uint64_t gdt_limit;
@@ -299,25 +420,73 @@ typedef struct{
   uint64_t host_cr3;
   uint64_t guest_cr3_32bit;
   uint64_t ept_area;
-  uint64_t debug_area;
+  uint64_t host_idt_base; // IDT copy with the host NMI handler
 } SharedTables;
 
+struct _CPUID_TABLE;
+
+// INVEPT types (Intel SDM 30.3, INVEPT)
+#define INVEPT_SINGLE_CONTEXT 1
+#define INVEPT_ALL_CONTEXT 2
+
 typedef struct{
-  uint8_t cpu_id;
+  uint64_t eptp;
+  uint64_t reserved;
+} __attribute__ ((packed)) INVEPT_DESCRIPTOR;
+
+typedef struct{
+  // Used by the vmx_exit fast path, keep the offsets in sync with HVM_* in vmx_api.asm
+  struct _CPUID_TABLE * cpuid_table; // 0x00
+  uint64_t fast_cpuid_exits;         // 0x08
+  uint64_t fast_vmcall_exits;        // 0x10
+  bool fast_exit_enabled;            // 0x18
+  uint64_t inval_generation;         // 0x20, last invalidation generation flushed by this CPU
+  struct _LATENCY_TABLE * latency;   // 0x28, NULL if exits aren't timed
+  uint64_t exit_start_tsc;           // 0x30, RDTSCP once vmx_exit has saved the guest registers
+  volatile uint64_t root_nmis;       // 0x38, NMIs host_nmi_handler took while this CPU was in root
+  uint32_t nmi_window_exiting;       // 0x40, CPU_BASED_NMI_WINDOW_EXITING, 0 without virtual NMIs
+
+  uint32_t cpu_id;
   bool guest_realmode;
   bool guest_realsegment;
   uint64_t guest_EFER;
   uint64_t guest_CR0;
   uint64_t guest_CR3;
   uint64_t guest_CR4;
+  uint64_t guest_XCR0;
   EFI_PHYSICAL_ADDRESS vmxon_region;
   EFI_PHYSICAL_ADDRESS vmcs;
   EFI_PHYSICAL_ADDRESS host_stack;
+  EFI_PHYSICAL_ADDRESS msr_bitmap;
+  uint32_t msr_intercepts; // number of MSR read/write bits set in msr_bitmap
+  uint64_t msr_read_exits;
+  uint64_t msr_write_exits;
+  struct _TELEMETRY_CPU * telemetry; // exit counts, readable by the guest
+  struct _XSTATE * xstate; // NULL: no XSAVE, root mode can't touch vector registers
+  struct _PROFILE_RING * profile; // guest samples, NULL without a VMX-preemption timer
+  uint64_t * pml_buffer; // page modification log, 512 GPAs filled downwards from GUEST_PML_INDEX
+  uint64_t dirty_generation; // last dirty_generation this CPU synced with
+  uint64_t pml_full_exits;
+  uint64_t pml_logged; // GPAs taken from pml_buffer
+  VMCS_CACHE vmcs_cache;
+  uint16_t vpid; // 0 if VPID is disabled
+  uint64_t vpid_flushes;
+  uint32_t apic_id;
+  volatile uint64_t nmi_kick_generation; // generation of the last kick inval_commit() sent
+  volatile uint64_t nmi_kick_taken; // nmi_kick_generation when an NMI was last taken for a kick
+  uint64_t root_nmis_seen; // root_nmis already passed to nmi_sync()
+  uint32_t nmi_pending; // NMIs owed to the guest, injected by nmi_sync() once it can take them
+  uint64_t nmi_injected;
+  volatile bool wait_for_sipi; // guest in wait-for-SIPI state, it holds NMIs until handle_sipi()
+  uint64_t inval_flushes;
+  uint64_t inval_coalesced;
+  struct _LOGRING * log_ring; // bsp_printf() output of this CPU unless it is the BSP
+  struct _LOGRING * blog_ring; // BLOG() records, kept until blog_save()
   SharedTables * st;
 } HVM;
 
 extern HVM * bsp_hvm;
-extern HVM * ap_hvm; // array of AP HVMs
+extern HVM ** cpu_hvm; // per CPU in MADT order, the BSP included
 
 int vmx_supported(void);
 int vmx_ug_supported(void);
@@ -330,7 +499,11 @@ int vmx_vmcs_activate(void * vmcs);
 void vmx_write(uint64_t index, uint64_t value);
 uint64_t vmx_read(uint64_t index);
 void vmx_launch(void);
+uint64_t vmx_vmcall(uint64_t rax);
+int vmx_invvpid(uint64_t type, void * descriptor);
+int vmx_invept(uint64_t type, void * descriptor);
 void vmx_exit(void);
+void host_nmi_handler(void);
 void vmx_ret(void);
 int vmx_guest_efer_supported(void);
 
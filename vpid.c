@@ -0,0 +1,100 @@
+#include "lib_uefi.h"
+#include "vmx_api.h"
+#include "vm_setup.h"
+#include "vpid.h"
+#include "smp.h"
+
+/*
+
+Virtual processor identifiers
+
+Every CPU tags its guest TLB entries with VPID = cpu_id + 1 (VPID 0 is the host), so VM entries
+and exits no longer flush the linear and combined mappings. In exchange the hypervisor has to
+invalidate guest mappings itself whenever it emulates something that would flush the TLB on
+bare metal, like MOV to CR3 or paging related CR0/CR4 changes.
+
+INVVPID types that aren't supported fall back to the next wider one.
+
+*/
+
+typedef struct{
+  uint64_t vpid;
+  uint64_t linear_address;
+} __attribute__ ((packed)) INVVPID_DESCRIPTOR;
+
+// Returns the secondary processor-based control enabling VPID, 0 if VPID stays disabled
+uint32_t vpid_init(HVM * hvm){
+  hvm->vpid = 0;
+  hvm->vpid_flushes = 0;
+
+#if VPID_ENABLED
+  if(features.vpid && features.invvpid_types){
+    hvm->vpid = hvm->cpu_id + 1;
+  }
+#endif
+
+  vmx_write(VIRTUAL_PROCESSOR_ID, hvm->vpid);
+
+  if(hvm->vpid){
+    vpid_flush_context(hvm); // Drop stale entries from a previous use of this VPID
+    return VM_EXEC_VPID;
+  }
+
+  return 0;
+}
+
+void vpid_invalidate(uint64_t type, uint16_t vpid, uint64_t linear_address){
+  INVVPID_DESCRIPTOR desc;
+
+  if(!(features.invvpid_types & (1 << type))){
+    switch(type){
+      case INVVPID_INDIVIDUAL_ADDRESS:
+      case INVVPID_SINGLE_CONTEXT_RETAIN_GLOBALS:
+        type = INVVPID_SINGLE_CONTEXT;
+        if(features.invvpid_types & (1 << type)) break;
+      default:
+        type = INVVPID_ALL_CONTEXT;
+    }
+  }
+
+  desc.vpid = vpid;
+  desc.linear_address = linear_address;
+  vmx_invvpid(type, &desc);
+}
+
+void vpid_flush_address(HVM * hvm, uint64_t linear_address){
+  if(!hvm->vpid) return; // VM transitions flush the TLB
+
+  ++hvm->vpid_flushes;
+  vpid_invalidate(INVVPID_INDIVIDUAL_ADDRESS, hvm->vpid, linear_address);
+}
+
+void vpid_flush_context(HVM * hvm){
+  if(!hvm->vpid) return;
+
+  ++hvm->vpid_flushes;
+  vpid_invalidate(INVVPID_SINGLE_CONTEXT, hvm->vpid, 0);
+}
+
+// Same as MOV to CR3 on bare metal, global translations survive
+void vpid_flush_context_nonglobal(HVM * hvm){
+  if(!hvm->vpid) return;
+
+  ++hvm->vpid_flushes;
+  vpid_invalidate(INVVPID_SINGLE_CONTEXT_RETAIN_GLOBALS, hvm->vpid, 0);
+}
+
+void vpid_flush_all(void){
+  if(!features.invvpid_types) return;
+
+  vpid_invalidate(INVVPID_ALL_CONTEXT, 0, 0);
+}
+
+void vpid_report(HVM * hvm){
+  if(hvm->vpid){
+    bsp_printf("%u: VPID %u, %u INVVPID flushes\r\n", (uint64_t)hvm->cpu_id, (uint64_t)hvm->vpid, hvm->vpid_flushes);
+  }
+  else{
+    bsp_printf("%u: VPID disabled\r\n", (uint64_t)hvm->cpu_id);
+  }
+}
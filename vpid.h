@@ -0,0 +1,25 @@
+#ifndef _VPID_
+#define _VPID_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmx_api.h"
+
+// INVVPID types (Intel SDM 30.3, INVVPID)
+#define INVVPID_INDIVIDUAL_ADDRESS 0
+#define INVVPID_SINGLE_CONTEXT 1
+#define INVVPID_ALL_CONTEXT 2
+#define INVVPID_SINGLE_CONTEXT_RETAIN_GLOBALS 3
+
+// IA32_VMX_EPT_VPID_CAP
+#define VPID_CAP_INVVPID (1ULL << 32)
+#define VPID_CAP_INVVPID_TYPES_SHIFT 40 // bits 43:40 - types 0-3 supported
+
+uint32_t vpid_init(HVM * hvm);
+void vpid_flush_address(HVM * hvm, uint64_t linear_address);
+void vpid_flush_context(HVM * hvm);
+void vpid_flush_context_nonglobal(HVM * hvm);
+void vpid_flush_all(void);
+void vpid_report(HVM * hvm);
+
+#endif
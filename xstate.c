@@ -0,0 +1,183 @@
+#include "lib_uefi.h"
+#include "vmx_api.h"
+#include "vmx_emu.h"
+#include "vmcs_cache.h"
+#include "regs.h"
+#include "hv_handlers.h"
+#include "smp.h"
+#include "cpuid.h"
+#include "xstate.h"
+
+/*
+
+Extended state manager
+
+Root mode runs with the guest's x87, SSE, AVX and other XSAVE state still in the registers. The
+exit path never touches it: vmx_exit and the fast path are assembly that only uses general
+purpose registers and the C code is built with -mgeneral-regs-only, so the compiler can't emit
+vector instructions either.
+
+Code that wants vector registers brackets them with xstate_begin() and xstate_end(). The
+outermost pair saves the guest's components with XSAVEOPT, or skips the save when XINUSE shows
+them all in their init state, and puts them back with XRSTOR. Components the guest hasn't
+enabled in XCR0 are enabled for the section and disabled again afterwards.
+
+*/
+
+// xstate is zeroed, without XSAVE or with a too large area root mode stays general purpose only
+void xstate_init(HVM * hvm, XSTATE * xstate){
+  uint64_t rax = 1, rbx, rcx = 0, rdx;
+
+  hvm->xstate = NULL;
+#if XSTATE_ENABLED
+  emu_cpuid(&rax, &rbx, &rcx, &rdx);
+  if(!(rcx & CPUID_01_ECX_XSAVE)){
+    return;
+  }
+
+  rax = 0xD;
+  rcx = 0;
+  emu_cpuid(&rax, &rbx, &rcx, &rdx);
+  if(rcx > XSTATE_AREA_SIZE){ // ECX: area size for every supported component
+    return;
+  }
+  xstate->supported = (rdx << 32) | (uint32_t)rax;
+
+  rax = 0xD;
+  rcx = 1;
+  emu_cpuid(&rax, &rbx, &rcx, &rdx);
+  xstate->xsaveopt = (rax & CPUID_0D_1_EAX_XSAVEOPT) != 0;
+  xstate->xinuse = (rax & CPUID_0D_1_EAX_XINUSE) != 0;
+
+  hvm->xstate = xstate;
+#endif
+}
+
+// XSETBV rules for XCR0 (Intel SDM 13.3), against the components this CPU supports
+bool xstate_xcr0_valid(HVM * hvm, uint64_t xcr0){
+  CPUID_LEAF * leafD = &hvm->cpuid_table->leafD[0];
+  uint64_t supported = ((uint64_t)leafD->edx << 32) | leafD->eax;
+
+  if(!(xcr0 & XSTATE_X87) || (xcr0 & ~supported)){
+    return false;
+  }
+  if((xcr0 & XSTATE_AVX) && !(xcr0 & XSTATE_SSE)){
+    return false;
+  }
+  if((xcr0 & XSTATE_MPX) && (xcr0 & XSTATE_MPX) != XSTATE_MPX){
+    return false;
+  }
+  if((xcr0 & XSTATE_AVX512) && ((xcr0 & XSTATE_AVX512) != XSTATE_AVX512 || !(xcr0 & XSTATE_AVX))){
+    return false;
+  }
+  if((xcr0 & XSTATE_AMX) && (xcr0 & XSTATE_AMX) != XSTATE_AMX){
+    return false;
+  }
+
+  return true;
+}
+
+/*
+  Saves the guest's state so the caller may use the given components, returns false if it
+  can't: then the caller has to do without vector registers. Nested sections may only use
+  components the outermost one asked for.
+*/
+bool xstate_begin(HVM * hvm, uint64_t components){
+  XSTATE * xstate = hvm->xstate;
+  uint64_t start;
+
+  if(!xstate){
+    return false;
+  }
+  if(components & XSTATE_AVX512){
+    components |= XSTATE_AVX512 | XSTATE_AVX;
+  }
+  if(components & XSTATE_AVX){
+    components |= XSTATE_SSE;
+  }
+
+  if(xstate->depth){
+    if(components & ~xstate->rfbm){
+      return false;
+    }
+    ++xstate->depth;
+    return true;
+  }
+
+  start = get_tsc();
+  xstate->guest_xcr0 = hvm->guest_XCR0;
+  xstate->rfbm = xstate->guest_xcr0 | components;
+  if(xstate->rfbm != xstate->guest_xcr0){
+    if(!xstate_xcr0_valid(hvm, xstate->rfbm)){
+      return false;
+    }
+    set_xcr0(xstate->rfbm);
+    ++xstate->widened;
+  }
+
+  if(xstate->xinuse && !(get_xinuse() & xstate->rfbm)){
+    // Nothing to save, XRSTOR puts every component back in its init state. XINUSE doesn't cover
+    // MXCSR, which XRSTOR loads from the area whenever SSE or AVX is requested: keep the live one.
+    *(uint64_t*)(xstate->area + XSAVE_XSTATE_BV) = 0;
+    store_mxcsr(xstate->area + XSAVE_MXCSR);
+    ++xstate->skipped;
+  }
+  else if(xstate->xsaveopt){
+    xsaveopt_area(xstate->area, xstate->rfbm);
+  }
+  else{
+    xsave_area(xstate->area, xstate->rfbm);
+  }
+
+  xstate->depth = 1;
+  xstate->cycles += get_tsc() - start;
+  return true;
+}
+
+void xstate_end(HVM * hvm){
+  XSTATE * xstate = hvm->xstate;
+  uint64_t start;
+
+  if(--xstate->depth){
+    return;
+  }
+
+  start = get_tsc();
+  xrstor_area(xstate->area, xstate->rfbm);
+  if(xstate->rfbm != xstate->guest_xcr0){
+    set_xcr0(xstate->guest_xcr0);
+  }
+  ++xstate->sections;
+  xstate->cycles += get_tsc() - start;
+}
+
+/*
+  XCR0 is shared between root and non-root mode, so the guest's value is written right away.
+  CR4.OSXSAVE and CPL are checked by the CPU before the exit.
+*/
+int handle_xsetbv(GUEST_REGS * regs, uint64_t exit_reason){
+  uint64_t xcr0 = (regs->rdx << 32) | (uint32_t)regs->rax;
+
+  if((uint32_t)regs->rcx != 0 || !xstate_xcr0_valid(regs->hvm, xcr0)){
+    inject_gp(regs->hvm);
+    return EXIT_KEEP_RIP;
+  }
+
+  set_xcr0(xcr0);
+  regs->hvm->guest_XCR0 = xcr0;
+
+  return EXIT_ADVANCE_RIP;
+}
+
+void xstate_report(HVM * hvm){
+  XSTATE * xstate = hvm->xstate;
+
+  if(!xstate){
+    bsp_printf("%u: no XSAVE, root mode uses general purpose registers only\r\n", (uint64_t)hvm->cpu_id);
+    return;
+  }
+
+  bsp_printf("%u: %s, XCR0 %x of %x, %u vector sections (%u without state, %u widened XCR0), %u cycles per section\r\n",
+    (uint64_t)hvm->cpu_id, xstate->xsaveopt ? "XSAVEOPT" : "XSAVE", hvm->guest_XCR0, xstate->supported,
+    xstate->sections, xstate->skipped, xstate->widened, xstate->sections ? xstate->cycles / xstate->sections : 0);
+}
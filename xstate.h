@@ -0,0 +1,56 @@
+#ifndef _XSTATE_
+#define _XSTATE_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmx_api.h"
+#include "regs.h"
+
+#define XSTATE_ENABLED 1 // let root mode code use vector registers between xstate_begin() and xstate_end()
+#define XSTATE_AREA_SIZE (3 * 4096) // standard format XSAVE area, AMX tile data included
+
+// State components, XCR0 bits
+#define XSTATE_X87 0x1
+#define XSTATE_SSE 0x2
+#define XSTATE_AVX 0x4
+#define XSTATE_MPX 0x18 // BNDREGS, BNDCSR
+#define XSTATE_AVX512 0xE0 // opmask, ZMM_Hi256, Hi16_ZMM
+#define XSTATE_AMX 0x60000 // XTILECFG, XTILEDATA
+
+#define CPUID_0D_1_EAX_XSAVEOPT (1 << 0)
+#define CPUID_0D_1_EAX_XINUSE (1 << 2) // XGETBV with ECX = 1
+
+// Offsets in the XSAVE area
+#define XSAVE_MXCSR 24
+#define XSAVE_XSTATE_BV 512
+
+/*
+  The guest's extended state stays in the registers while the hypervisor runs: vmx_exit saves
+  only general purpose registers and every C file is built with -mgeneral-regs-only. Vector
+  registers may only be used between xstate_begin() and xstate_end(), which save and restore the
+  guest's components in the CPU's area; bench_xstate() measures the cost of such a section.
+  XCR0 isn't switched on VM exits, the guest's value is live in root mode as well.
+*/
+typedef struct _XSTATE{
+  uint8_t area[XSTATE_AREA_SIZE]; // page aligned
+  uint64_t supported; // XCR0 bits the CPU supports, CPUID.0DH.0:EDX:EAX
+  bool xsaveopt;
+  bool xinuse;
+  uint32_t depth; // xstate_begin() nesting
+  uint64_t rfbm; // components saved by the outermost xstate_begin()
+  uint64_t guest_xcr0; // XCR0 to restore, xstate_begin() widens it to the components it needs
+  // Cost
+  uint64_t sections; // outermost xstate_begin()/xstate_end() pairs
+  uint64_t skipped; // sections with every saved component in its init state, no XSAVE
+  uint64_t widened; // sections that had to enable components in XCR0
+  uint64_t cycles; // TSC cycles spent saving and restoring
+} XSTATE;
+
+void xstate_init(HVM * hvm, XSTATE * xstate);
+bool xstate_xcr0_valid(HVM * hvm, uint64_t xcr0);
+bool xstate_begin(HVM * hvm, uint64_t components);
+void xstate_end(HVM * hvm);
+int handle_xsetbv(GUEST_REGS * regs, uint64_t exit_reason);
+void xstate_report(HVM * hvm);
+
+#endif